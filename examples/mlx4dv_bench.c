@@ -0,0 +1,1720 @@
+/*
+ * Copyright (c) 2016 Mellanox Technologies Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Micro benchmarks for the mlx4dv fast paths.  Each mode runs one path
+ * on a port of an mlx4 device, against its plain verbs equivalent
+ * where there is one, and prints the rate.  Paths switched on by an
+ * environment variable are compared by running the mode with and
+ * without it.
+ */
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <netinet/tcp.h>
+
+#include <infiniband/verbs.h>
+
+#include "mlx4dv.h"
+
+struct bench {
+	struct ibv_context     *context;
+	struct ibv_pd	       *pd;
+	int			port;
+	long			iters;
+	int			burst;
+	int			size;
+	/* Flows, queues or objects, 0 for the mode's default */
+	int			num;
+	int			threads;
+	/* Per thread queues of the threaded modes */
+	struct conn	       *conns;
+};
+
+struct conn {
+	struct ibv_cq	       *cq;
+	struct ibv_qp	       *qp;
+};
+
+struct mode {
+	const char	       *name;
+	int		      (*run)(struct bench *b);
+	const char	       *help;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void report(const char *what, long count, uint64_t ns)
+{
+	printf("%-28s %12.0f /s %10.1f ns\n", what,
+	       count * 1e9 / ns, (double) ns / count);
+}
+
+struct worker {
+	struct bench	       *b;
+	int		      (*fn)(struct bench *b, int id, long iters);
+	pthread_barrier_t      *barrier;
+	pthread_t		thread;
+	int			id;
+	int			ret;
+};
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	pthread_barrier_wait(w->barrier);
+	w->ret = w->fn(w->b, w->id, w->b->iters);
+
+	return NULL;
+}
+
+/*
+ * Run fn for -n iterations on each of -t threads, numbered from 0 in
+ * id and started together.  Returns the wall time, or 0 if a thread
+ * failed.
+ */
+static uint64_t run_threads(struct bench *b,
+			    int (*fn)(struct bench *b, int id, long iters))
+{
+	pthread_barrier_t barrier;
+	struct worker *workers;
+	uint64_t start;
+	uint64_t ns;
+	int started;
+	int failed = 0;
+	int i;
+
+	workers = calloc(b->threads, sizeof *workers);
+	if (!workers)
+		return 0;
+
+	pthread_barrier_init(&barrier, NULL, b->threads + 1);
+
+	for (started = 0; started < b->threads; ++started) {
+		workers[started].b	 = b;
+		workers[started].fn	 = fn;
+		workers[started].id	 = started;
+		workers[started].barrier = &barrier;
+		if (pthread_create(&workers[started].thread, NULL,
+				   worker_main, workers + started))
+			break;
+	}
+
+	if (started < b->threads) {
+		/* Nobody can pass the barrier, so don't wait on it */
+		fprintf(stderr, "only %d threads started\n", started);
+		exit(1);
+	}
+
+	pthread_barrier_wait(&barrier);
+	start = now_ns();
+
+	for (i = 0; i < b->threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		failed |= workers[i].ret;
+	}
+	ns = now_ns() - start;
+
+	pthread_barrier_destroy(&barrier);
+	free(workers);
+
+	return failed ? 0 : ns;
+}
+
+/* Poll cq until at most limit of the *inflight signaled WRs are left */
+static int reap(struct ibv_cq *cq, int *inflight, int limit)
+{
+	struct ibv_wc wc[16];
+	int n;
+	int i;
+
+	while (*inflight > limit) {
+		n = ibv_poll_cq(cq, 16, wc);
+		if (n < 0)
+			return -1;
+
+		for (i = 0; i < n; ++i)
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "completion error %d\n",
+					wc[i].status);
+				return -1;
+			}
+
+		*inflight -= n;
+	}
+
+	return 0;
+}
+
+static int raw_qp_to_rts(struct ibv_qp *qp, int port)
+{
+	struct ibv_qp_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.qp_state = IBV_QPS_INIT;
+	attr.port_num = port;
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PORT))
+		return -1;
+
+	attr.qp_state = IBV_QPS_RTR;
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE))
+		return -1;
+
+	attr.qp_state = IBV_QPS_RTS;
+	return ibv_modify_qp(qp, &attr, IBV_QP_STATE);
+}
+
+static struct ibv_qp *create_raw_qp(struct bench *b, struct ibv_cq *cq,
+				    int depth, int inline_size)
+{
+	struct ibv_qp_init_attr attr;
+	struct ibv_qp *qp;
+
+	memset(&attr, 0, sizeof attr);
+	attr.send_cq		 = cq;
+	attr.recv_cq		 = cq;
+	attr.qp_type		 = IBV_QPT_RAW_PACKET;
+	attr.cap.max_send_wr	 = depth;
+	attr.cap.max_recv_wr	 = depth;
+	attr.cap.max_send_sge	 = 2;
+	attr.cap.max_recv_sge	 = 1;
+	attr.cap.max_inline_data = inline_size;
+
+	qp = ibv_create_qp(b->pd, &attr);
+	if (!qp) {
+		perror("raw packet QP (needs CAP_NET_RAW)");
+		return NULL;
+	}
+
+	if (raw_qp_to_rts(qp, b->port)) {
+		perror("modify raw packet QP");
+		ibv_destroy_qp(qp);
+		return NULL;
+	}
+
+	return qp;
+}
+
+static int rc_qp_to_rts(struct bench *b, struct ibv_qp *qp)
+{
+	struct ibv_port_attr port_attr;
+	struct ibv_qp_attr attr;
+
+	if (ibv_query_port(b->context, b->port, &port_attr))
+		return -1;
+
+	memset(&attr, 0, sizeof attr);
+	attr.qp_state	     = IBV_QPS_INIT;
+	attr.port_num	     = b->port;
+	attr.qp_access_flags = IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+			  IBV_QP_PORT | IBV_QP_ACCESS_FLAGS))
+		return -1;
+
+	/* Connected to itself */
+	attr.qp_state		 = IBV_QPS_RTR;
+	attr.path_mtu		 = port_attr.active_mtu;
+	attr.dest_qp_num	 = qp->qp_num;
+	attr.max_dest_rd_atomic	 = 1;
+	attr.min_rnr_timer	 = 12;
+	attr.ah_attr.dlid	 = port_attr.lid;
+	attr.ah_attr.port_num	 = b->port;
+	if (port_attr.link_layer == IBV_LINK_LAYER_ETHERNET) {
+		if (ibv_query_gid(b->context, b->port, 0,
+				  &attr.ah_attr.grh.dgid))
+			return -1;
+		attr.ah_attr.is_global	   = 1;
+		attr.ah_attr.grh.hop_limit = 1;
+	}
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_AV |
+			  IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN |
+			  IBV_QP_MAX_DEST_RD_ATOMIC | IBV_QP_MIN_RNR_TIMER))
+		return -1;
+
+	attr.qp_state	   = IBV_QPS_RTS;
+	attr.timeout	   = 14;
+	attr.retry_cnt	   = 7;
+	attr.rnr_retry	   = 7;
+	attr.max_rd_atomic = 1;
+	return ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN |
+			     IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT |
+			     IBV_QP_RNR_RETRY | IBV_QP_MAX_QP_RD_ATOMIC);
+}
+
+/* An RC QP connected to itself, flags are enum mlx4dv_qp_create_flags */
+static struct ibv_qp *create_rc_qp(struct bench *b, struct ibv_cq *cq,
+				   int depth, uint32_t flags)
+{
+	struct mlx4dv_qp_init_attr mlx4_attr;
+	struct ibv_qp_init_attr_ex attr;
+	struct ibv_qp *qp;
+
+	memset(&attr, 0, sizeof attr);
+	attr.send_cq	      = cq;
+	attr.recv_cq	      = cq;
+	attr.qp_type	      = IBV_QPT_RC;
+	attr.cap.max_send_wr  = depth;
+	attr.cap.max_recv_wr  = 1;
+	attr.cap.max_send_sge = 1;
+	attr.cap.max_recv_sge = 1;
+	attr.comp_mask	      = IBV_QP_INIT_ATTR_PD;
+	attr.pd		      = b->pd;
+
+	memset(&mlx4_attr, 0, sizeof mlx4_attr);
+	mlx4_attr.comp_mask    = MLX4DV_QP_INIT_ATTR_MASK_CREATE_FLAGS;
+	mlx4_attr.create_flags = flags;
+
+	qp = mlx4dv_create_qp(b->context, &attr, &mlx4_attr);
+	if (!qp) {
+		perror("mlx4dv_create_qp");
+		return NULL;
+	}
+
+	if (rc_qp_to_rts(b, qp)) {
+		perror("connect RC QP");
+		ibv_destroy_qp(qp);
+		return NULL;
+	}
+
+	return qp;
+}
+
+/* flags are enum mlx4dv_cq_create_flags */
+static struct ibv_cq *create_cq(struct bench *b, int cqe, uint32_t flags)
+{
+	struct mlx4dv_cq_init_attr mlx4_attr;
+	struct ibv_cq_init_attr_ex attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.cqe = cqe;
+
+	memset(&mlx4_attr, 0, sizeof mlx4_attr);
+	mlx4_attr.comp_mask    = MLX4DV_CQ_INIT_ATTR_MASK_CREATE_FLAGS;
+	mlx4_attr.create_flags = flags;
+
+	return mlx4dv_create_cq(b->context, &attr, &mlx4_attr);
+}
+
+/*
+ * A chain of num signaled RDMA writes of length bytes from buf back
+ * to itself
+ */
+static void build_write_chain(struct ibv_send_wr *wrs, struct ibv_sge *sge,
+			      int num, struct ibv_mr *mr, int length)
+{
+	int i;
+
+	sge->addr   = (uintptr_t) mr->addr;
+	sge->length = length;
+	sge->lkey   = mr->lkey;
+
+	memset(wrs, 0, num * sizeof *wrs);
+	for (i = 0; i < num; ++i) {
+		wrs[i].wr_id		   = i;
+		wrs[i].sg_list		   = sge;
+		wrs[i].num_sge		   = length ? 1 : 0;
+		wrs[i].opcode		   = IBV_WR_RDMA_WRITE;
+		wrs[i].send_flags	   = IBV_SEND_SIGNALED;
+		wrs[i].wr.rdma.remote_addr = (uintptr_t) mr->addr;
+		wrs[i].wr.rdma.rkey	   = mr->rkey;
+		wrs[i].next		   = i + 1 < num ? wrs + i + 1 : NULL;
+	}
+}
+
+enum {
+	UDP_HDR_LEN = 14 + sizeof (struct iphdr) + sizeof (struct udphdr),
+	TCP_HDR_LEN = 14 + sizeof (struct iphdr) + sizeof (struct tcphdr)
+};
+
+/*
+ * Destination and source MACs of the frames sent, locally
+ * administered.  The gro mode steers the destination to its QP.
+ */
+static const uint8_t bench_macs[12] = { 2, 0, 0, 0, 0, 1, 2, 0, 0, 0, 0, 2 };
+
+static struct iphdr *build_ip_hdr(uint8_t *hdr, int protocol, int l4_len)
+{
+	struct iphdr *ip = (struct iphdr *) (hdr + 14);
+
+	memcpy(hdr, bench_macs, sizeof bench_macs);
+	hdr[12] = 0x08;
+	hdr[13] = 0x00;
+
+	memset(ip, 0, sizeof *ip);
+	ip->version  = 4;
+	ip->ihl	     = 5;
+	ip->ttl	     = 64;
+	ip->protocol = protocol;
+	ip->tot_len  = htons(sizeof *ip + l4_len);
+	ip->saddr    = htonl(0x0a000001);
+	ip->daddr    = htonl(0x0a000002);
+
+	return ip;
+}
+
+static void build_udp_hdr(uint8_t *hdr, int payload_len)
+{
+	struct iphdr *ip = build_ip_hdr(hdr, IPPROTO_UDP,
+					sizeof (struct udphdr) + payload_len);
+	struct udphdr *udp = (struct udphdr *) (ip + 1);
+
+	memset(udp, 0, sizeof *udp);
+	udp->source = htons(9);
+	udp->dest   = htons(9);
+	udp->len    = htons(sizeof *udp + payload_len);
+}
+
+static void build_tcp_hdr(uint8_t *hdr, int flow, uint32_t seq,
+			  int payload_len)
+{
+	struct iphdr *ip = build_ip_hdr(hdr, IPPROTO_TCP,
+					sizeof (struct tcphdr) + payload_len);
+	struct tcphdr *th = (struct tcphdr *) (ip + 1);
+
+	memset(th, 0, sizeof *th);
+	th->source = htons(1024 + flow);
+	th->dest   = htons(5001);
+	th->seq	   = htonl(seq);
+	th->doff   = sizeof *th / 4;
+	th->ack	   = 1;
+	th->window = htons(65535);
+}
+
+/*
+ * Raw Ethernet packets per second: bursts of UDP frames posted with
+ * mlx4dv_tx_burst(), headers inline and payload gathered, then the
+ * same frames as one ibv_post_send() chain per burst with the headers
+ * in a second gather entry.  The last frame of every burst is
+ * signaled.
+ */
+static int run_tx(struct bench *b)
+{
+	int depth = 1024;
+	int max_inflight = depth / b->burst - 1;
+	struct mlx4dv_tx_pkt *pkts = NULL;
+	struct ibv_send_wr *wrs = NULL;
+	struct ibv_send_wr *bad_wr;
+	struct ibv_sge *sges = NULL;
+	struct ibv_cq *cq = NULL;
+	struct ibv_qp *qp = NULL;
+	struct ibv_mr *mr = NULL;
+	uint8_t *buf = NULL;
+	uint64_t start;
+	long sent;
+	int inflight;
+	int posted;
+	int ret = -1;
+	int i;
+
+	if (max_inflight < 1) {
+		fprintf(stderr, "burst too large\n");
+		return -1;
+	}
+
+	buf  = calloc(1, UDP_HDR_LEN + b->size);
+	pkts = calloc(b->burst, sizeof *pkts);
+	wrs  = calloc(b->burst, sizeof *wrs);
+	sges = calloc(2 * b->burst, sizeof *sges);
+	if (!buf || !pkts || !wrs || !sges)
+		goto out;
+
+	build_udp_hdr(buf, b->size);
+
+	mr = ibv_reg_mr(b->pd, buf, UDP_HDR_LEN + b->size, 0);
+	cq = ibv_create_cq(b->context, depth, NULL, NULL, 0);
+	if (!mr || !cq)
+		goto out;
+
+	qp = create_raw_qp(b, cq, depth, UDP_HDR_LEN);
+	if (!qp)
+		goto out;
+
+	for (i = 0; i < b->burst; ++i) {
+		pkts[i].hdr		= buf;
+		pkts[i].hdr_len		= UDP_HDR_LEN;
+		pkts[i].flags		= MLX4DV_TX_PKT_IP_CSUM;
+		pkts[i].payload.addr	= (uintptr_t) buf + UDP_HDR_LEN;
+		pkts[i].payload.length	= b->size;
+		pkts[i].payload.lkey	= mr->lkey;
+
+		sges[2 * i].addr	= (uintptr_t) buf;
+		sges[2 * i].length	= UDP_HDR_LEN;
+		sges[2 * i].lkey	= mr->lkey;
+		sges[2 * i + 1]		= pkts[i].payload;
+		wrs[i].sg_list		= sges + 2 * i;
+		wrs[i].num_sge		= 2;
+		wrs[i].opcode		= IBV_WR_SEND;
+		wrs[i].send_flags	= IBV_SEND_IP_CSUM;
+		wrs[i].next		= i + 1 < b->burst ? wrs + i + 1 : NULL;
+	}
+	pkts[b->burst - 1].flags      |= MLX4DV_TX_PKT_SIGNALED;
+	wrs[b->burst - 1].send_flags |= IBV_SEND_SIGNALED;
+
+	inflight = 0;
+	start = now_ns();
+	for (sent = 0; sent < b->iters; sent += b->burst) {
+		if (reap(cq, &inflight, max_inflight - 1))
+			goto out;
+		if (mlx4dv_tx_burst(qp, pkts, b->burst, &posted)) {
+			fprintf(stderr, "mlx4dv_tx_burst: %d of %d posted\n",
+				posted, b->burst);
+			goto out;
+		}
+		++inflight;
+	}
+	if (reap(cq, &inflight, 0))
+		goto out;
+	report("mlx4dv_tx_burst", sent, now_ns() - start);
+
+	start = now_ns();
+	for (sent = 0; sent < b->iters; sent += b->burst) {
+		if (reap(cq, &inflight, max_inflight - 1))
+			goto out;
+		if (ibv_post_send(qp, wrs, &bad_wr)) {
+			perror("ibv_post_send");
+			goto out;
+		}
+		++inflight;
+	}
+	if (reap(cq, &inflight, 0))
+		goto out;
+	report("ibv_post_send", sent, now_ns() - start);
+
+	ret = 0;
+
+out:
+	if (qp)
+		ibv_destroy_qp(qp);
+	if (cq)
+		ibv_destroy_cq(cq);
+	if (mr)
+		ibv_dereg_mr(mr);
+	free(sges);
+	free(wrs);
+	free(pkts);
+	free(buf);
+	return ret;
+}
+
+/*
+ * In order TCP segments of -q flows, round robin, sent to the MAC the
+ * gro mode steers.  Run it on the port cabled to the receiving one.
+ */
+static int run_tcptx(struct bench *b)
+{
+	int depth = 1024;
+	int max_inflight = depth / b->burst - 1;
+	int flows = b->num ? b->num : 4;
+	struct mlx4dv_tx_pkt *pkts = NULL;
+	struct ibv_cq *cq = NULL;
+	struct ibv_qp *qp = NULL;
+	struct ibv_mr *mr = NULL;
+	uint32_t *seqs = NULL;
+	uint8_t *hdrs = NULL;
+	uint8_t *payload = NULL;
+	uint64_t start;
+	long sent;
+	int inflight = 0;
+	int posted;
+	int ret = -1;
+	int f;
+	int i;
+
+	if (max_inflight < 1) {
+		fprintf(stderr, "burst too large\n");
+		return -1;
+	}
+
+	hdrs	= calloc(b->burst, TCP_HDR_LEN);
+	payload = calloc(1, b->size ? b->size : 1);
+	pkts	= calloc(b->burst, sizeof *pkts);
+	seqs	= calloc(flows, sizeof *seqs);
+	if (!hdrs || !payload || !pkts || !seqs)
+		goto out;
+
+	mr = ibv_reg_mr(b->pd, payload, b->size ? b->size : 1, 0);
+	cq = ibv_create_cq(b->context, depth, NULL, NULL, 0);
+	if (!mr || !cq)
+		goto out;
+
+	qp = create_raw_qp(b, cq, depth, TCP_HDR_LEN);
+	if (!qp)
+		goto out;
+
+	for (i = 0; i < b->burst; ++i) {
+		pkts[i].hdr		= hdrs + i * TCP_HDR_LEN;
+		pkts[i].hdr_len		= TCP_HDR_LEN;
+		pkts[i].flags		= MLX4DV_TX_PKT_IP_CSUM;
+		pkts[i].payload.addr	= (uintptr_t) payload;
+		pkts[i].payload.length	= b->size;
+		pkts[i].payload.lkey	= mr->lkey;
+	}
+	pkts[b->burst - 1].flags |= MLX4DV_TX_PKT_SIGNALED;
+
+	start = now_ns();
+	for (sent = 0; sent < b->iters; sent += b->burst) {
+		if (reap(cq, &inflight, max_inflight - 1))
+			goto out;
+
+		for (i = 0; i < b->burst; ++i) {
+			f = (sent + i) % flows;
+			build_tcp_hdr(hdrs + i * TCP_HDR_LEN, f, seqs[f],
+				      b->size);
+			seqs[f] += b->size;
+		}
+
+		if (mlx4dv_tx_burst(qp, pkts, b->burst, &posted)) {
+			fprintf(stderr, "mlx4dv_tx_burst: %d of %d posted\n",
+				posted, b->burst);
+			goto out;
+		}
+		++inflight;
+	}
+	if (reap(cq, &inflight, 0))
+		goto out;
+	report("TCP segments sent", sent, now_ns() - start);
+
+	ret = 0;
+
+out:
+	if (qp)
+		ibv_destroy_qp(qp);
+	if (cq)
+		ibv_destroy_cq(cq);
+	if (mr)
+		ibv_dereg_mr(mr);
+	free(seqs);
+	free(pkts);
+	free(payload);
+	free(hdrs);
+	return ret;
+}
+
+static struct ibv_flow *steer_bench_mac(struct ibv_qp *qp, int port)
+{
+	struct {
+		struct ibv_flow_attr	 attr;
+		struct ibv_flow_spec_eth eth;
+	} rule;
+
+	memset(&rule, 0, sizeof rule);
+	rule.attr.type	       = IBV_FLOW_ATTR_NORMAL;
+	rule.attr.size	       = sizeof rule;
+	rule.attr.num_of_specs = 1;
+	rule.attr.port	       = port;
+	rule.eth.type	       = IBV_FLOW_SPEC_ETH;
+	rule.eth.size	       = sizeof rule.eth;
+	memcpy(rule.eth.val.dst_mac, bench_macs, 6);
+	memset(rule.eth.mask.dst_mac, 0xff, 6);
+
+	return ibv_create_flow(qp, &rule.attr);
+}
+
+enum {
+	GRO_BUFS	= 4096,
+	GRO_STRIDE	= 2048,
+	GRO_MAX_SEGS	= 16
+};
+
+/* Give up after this long without a packet */
+#define IDLE_NS		5000000000ull
+
+/*
+ * Receive cost per packet of the frames tcptx sends: -n packets taken
+ * with mlx4dv_rx_burst() and freed, then -n more through
+ * mlx4dv_gro_rx_burst().  Only calls that consumed packets are timed,
+ * so the ns column is the CPU time per received segment whatever the
+ * arrival rate.
+ */
+static int run_gro(struct bench *b)
+{
+	struct mlx4dv_gro_attr gro_attr = {
+		.max_burst	= b->burst,
+		.max_flows	= 64,
+		.max_segs	= GRO_MAX_SEGS,
+		.max_size	= 65000,
+		.flush_ns	= 20000
+	};
+	struct mlx4dv_rx_pool_attr pool;
+	struct mlx4dv_gro_stats stats;
+	struct mlx4dv_gro_pkt *gpkts = NULL;
+	struct mlx4dv_rx_pkt *pkts = NULL;
+	struct mlx4dv_gro *gro = NULL;
+	struct ibv_flow *flow = NULL;
+	struct ibv_cq *cq = NULL;
+	struct ibv_qp *qp = NULL;
+	struct ibv_mr *mr = NULL;
+	void **bufs = NULL;
+	void *slab = NULL;
+	uint64_t busy;
+	uint64_t last;
+	uint64_t prev_in;
+	uint64_t t;
+	long got;
+	int ret = -1;
+	int n;
+	int m;
+	int i;
+	int j;
+
+	if (posix_memalign(&slab, 4096, GRO_BUFS * GRO_STRIDE))
+		return -1;
+
+	pkts  = calloc(b->burst, sizeof *pkts);
+	gpkts = calloc(b->burst, sizeof *gpkts);
+	bufs  = calloc(b->burst * GRO_MAX_SEGS, sizeof *bufs);
+	if (!pkts || !gpkts || !bufs)
+		goto out;
+
+	mr = ibv_reg_mr(b->pd, slab, GRO_BUFS * GRO_STRIDE,
+			IBV_ACCESS_LOCAL_WRITE);
+	cq = ibv_create_cq(b->context, GRO_BUFS, NULL, NULL, 0);
+	if (!mr || !cq)
+		goto out;
+
+	qp = create_raw_qp(b, cq, 1024, 0);
+	if (!qp)
+		goto out;
+
+	flow = steer_bench_mac(qp, b->port);
+	if (!flow) {
+		perror("ibv_create_flow");
+		goto out;
+	}
+
+	pool.addr     = (uintptr_t) slab;
+	pool.stride   = GRO_STRIDE;
+	pool.length   = GRO_STRIDE;
+	pool.lkey     = mr->lkey;
+	pool.num_bufs = GRO_BUFS;
+	if (mlx4dv_qp_start_rx(qp, &pool)) {
+		fprintf(stderr, "mlx4dv_qp_start_rx failed\n");
+		goto out;
+	}
+
+	busy = 0;
+	last = now_ns();
+	for (got = 0; got < b->iters; ) {
+		t = now_ns();
+		if (mlx4dv_rx_burst(qp, pkts, b->burst, &n))
+			goto out;
+		if (!n) {
+			if (t - last > IDLE_NS) {
+				fprintf(stderr, "no packets, is tcptx running?\n");
+				goto out;
+			}
+			continue;
+		}
+
+		for (i = 0; i < n; ++i)
+			bufs[i] = pkts[i].buf;
+		mlx4dv_rx_free(qp, bufs, n);
+
+		last  = now_ns();
+		busy += last - t;
+		got  += n;
+	}
+	report("mlx4dv_rx_burst", got, busy);
+
+	gro = mlx4dv_gro_create(&gro_attr);
+	if (!gro) {
+		perror("mlx4dv_gro_create");
+		goto out;
+	}
+
+	busy	= 0;
+	prev_in = 0;
+	last	= now_ns();
+	do {
+		t = now_ns();
+		if (mlx4dv_gro_rx_burst(gro, qp, gpkts, b->burst, &n))
+			goto out;
+
+		for (m = 0, i = 0; i < n; ++i)
+			for (j = 0; j < gpkts[i].nsegs; ++j)
+				bufs[m++] = gpkts[i].segs[j].buf;
+		if (m)
+			mlx4dv_rx_free(qp, bufs, m);
+
+		mlx4dv_gro_query_stats(gro, &stats);
+		if (stats.pkts_in == prev_in && !n) {
+			if (t - last > IDLE_NS) {
+				fprintf(stderr, "no packets, is tcptx running?\n");
+				goto out;
+			}
+			continue;
+		}
+
+		last	= now_ns();
+		busy   += last - t;
+		prev_in = stats.pkts_in;
+	} while (stats.pkts_in < b->iters);
+	report("mlx4dv_gro_rx_burst", stats.pkts_in, busy);
+
+	printf("%-28s %12.2f segments per packet, %llu merged\n", "GRO",
+	       stats.pkts_out ? (double) stats.pkts_in / stats.pkts_out : 0.0,
+	       (unsigned long long) stats.merged);
+
+	ret = 0;
+
+out:
+	if (gro)
+		mlx4dv_gro_destroy(gro);
+	if (flow)
+		ibv_destroy_flow(flow);
+	if (qp)
+		ibv_destroy_qp(qp);
+	if (cq)
+		ibv_destroy_cq(cq);
+	if (mr)
+		ibv_dereg_mr(mr);
+	free(bufs);
+	free(gpkts);
+	free(pkts);
+	free(slab);
+	return ret;
+}
+
+/*
+ * Deep queues: signaled RDMA writes of -s bytes on a QP connected to
+ * itself, cycling through a -q entry SQ and a CQ four times as large,
+ * so that every WQE and CQE touched is on a cold line of a different
+ * page.  Run with and without MLX4_HUGE_BUF=1 MLX4_POPULATE_BUF=1,
+ * under perf stat -e dTLB-load-misses,dTLB-store-misses.
+ */
+static int run_ring(struct bench *b)
+{
+	int depth = b->num ? b->num : 16384;
+	struct ibv_send_wr *wrs = NULL;
+	struct ibv_send_wr *bad_wr;
+	struct ibv_sge sge;
+	struct ibv_cq *cq = NULL;
+	struct ibv_qp *qp = NULL;
+	struct ibv_mr *mr = NULL;
+	void *buf = NULL;
+	uint64_t start;
+	long sent;
+	int inflight = 0;
+	int ret = -1;
+
+	if (b->burst > depth) {
+		fprintf(stderr, "burst too large\n");
+		return -1;
+	}
+
+	buf = calloc(1, b->size ? b->size : 1);
+	wrs = calloc(b->burst, sizeof *wrs);
+	if (!buf || !wrs)
+		goto out;
+
+	mr = ibv_reg_mr(b->pd, buf, b->size ? b->size : 1,
+			IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	cq = ibv_create_cq(b->context, 4 * depth, NULL, NULL, 0);
+	if (!mr || !cq)
+		goto out;
+
+	qp = create_rc_qp(b, cq, depth, 0);
+	if (!qp)
+		goto out;
+
+	build_write_chain(wrs, &sge, b->burst, mr, b->size);
+
+	start = now_ns();
+	for (sent = 0; sent < b->iters; sent += b->burst) {
+		if (reap(cq, &inflight, depth - b->burst))
+			goto out;
+		if (ibv_post_send(qp, wrs, &bad_wr)) {
+			perror("ibv_post_send");
+			goto out;
+		}
+		inflight += b->burst;
+	}
+	if (reap(cq, &inflight, 0))
+		goto out;
+	report("RDMA writes, deep queues", sent, now_ns() - start);
+
+	ret = 0;
+
+out:
+	if (qp)
+		ibv_destroy_qp(qp);
+	if (cq)
+		ibv_destroy_cq(cq);
+	if (mr)
+		ibv_dereg_mr(mr);
+	free(wrs);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Connection churn: -n rounds of creating a CQ and an RC QP with 512
+ * entry queues and destroying both, the buffer and doorbell work of a
+ * connection coming and going, on each of -t threads.  -q CQs are
+ * created first and kept until the end, so that the doorbell records
+ * are allocated among that many live ones.  Run with and without
+ * MLX4_BUF_CACHE_SIZE set, and with -t 1, 2, 4... for scaling.
+ */
+static int create_round(struct bench *b)
+{
+	struct ibv_qp_init_attr attr;
+	struct ibv_cq *cq;
+	struct ibv_qp *qp;
+
+	cq = ibv_create_cq(b->context, 512, NULL, NULL, 0);
+	if (!cq)
+		return -1;
+
+	memset(&attr, 0, sizeof attr);
+	attr.send_cq	      = cq;
+	attr.recv_cq	      = cq;
+	attr.qp_type	      = IBV_QPT_RC;
+	attr.cap.max_send_wr  = 512;
+	attr.cap.max_recv_wr  = 512;
+	attr.cap.max_send_sge = 1;
+	attr.cap.max_recv_sge = 1;
+
+	qp = ibv_create_qp(b->pd, &attr);
+	if (!qp) {
+		ibv_destroy_cq(cq);
+		return -1;
+	}
+
+	ibv_destroy_qp(qp);
+	return ibv_destroy_cq(cq);
+}
+
+static int create_loop(struct bench *b, int id, long iters)
+{
+	long i;
+
+	for (i = 0; i < iters; ++i)
+		if (create_round(b)) {
+			perror("create/destroy");
+			return -1;
+		}
+
+	return 0;
+}
+
+static int run_create(struct bench *b)
+{
+	struct ibv_cq **held;
+	uint64_t ns;
+	int i;
+
+	held = calloc(b->num ? b->num : 1, sizeof *held);
+	if (!held)
+		return -1;
+
+	for (i = 0; i < b->num; ++i) {
+		held[i] = ibv_create_cq(b->context, 1, NULL, NULL, 0);
+		if (!held[i]) {
+			perror("ibv_create_cq");
+			break;
+		}
+	}
+
+	ns = i == b->num ? run_threads(b, create_loop) : 0;
+	if (ns)
+		report("CQ+QP create/destroy", b->iters * b->threads, ns);
+
+	while (i--)
+		ibv_destroy_cq(held[i]);
+	free(held);
+
+	return ns ? 0 : -1;
+}
+
+/*
+ * Doorbell record false sharing: each of -t threads runs sends to
+ * itself on its own QP and CQ, -b receives posted with one RQ doorbell
+ * record update, -b signaled zero byte sends, then polling all 2 * -b
+ * completions, which updates the CQ's consumer index record.  The
+ * records of all threads' queues are allocated together, first packed
+ * and then each on its own cache line.  Run under taskset with cores
+ * of both sockets, and perf c2c shows the records' lines bouncing.
+ */
+static int isolated_loop(struct bench *b, int id, long iters)
+{
+	struct conn *c = b->conns + id;
+	struct ibv_recv_wr *rwrs;
+	struct ibv_send_wr *swrs;
+	struct ibv_recv_wr *bad_rwr;
+	struct ibv_send_wr *bad_swr;
+	struct ibv_wc wc[16];
+	long i;
+	int left;
+	int ret = -1;
+	int n;
+	int j;
+
+	rwrs = calloc(b->burst, sizeof *rwrs);
+	swrs = calloc(b->burst, sizeof *swrs);
+	if (!rwrs || !swrs)
+		goto out;
+
+	for (j = 0; j < b->burst; ++j) {
+		rwrs[j].next	   = j + 1 < b->burst ? rwrs + j + 1 : NULL;
+		swrs[j].next	   = j + 1 < b->burst ? swrs + j + 1 : NULL;
+		swrs[j].opcode	   = IBV_WR_SEND;
+		swrs[j].send_flags = IBV_SEND_SIGNALED;
+	}
+
+	for (i = 0; i < iters; ++i) {
+		if (ibv_post_recv(c->qp, rwrs, &bad_rwr) ||
+		    ibv_post_send(c->qp, swrs, &bad_swr))
+			goto out;
+
+		for (left = 2 * b->burst; left; left -= n) {
+			n = ibv_poll_cq(c->cq, 16, wc);
+			if (n < 0)
+				goto out;
+			for (j = 0; j < n; ++j)
+				if (wc[j].status != IBV_WC_SUCCESS)
+					goto out;
+		}
+	}
+
+	ret = 0;
+
+out:
+	free(swrs);
+	free(rwrs);
+	return ret;
+}
+
+static int isolated_phase(struct bench *b, const char *what,
+			  uint32_t cq_flags, uint32_t qp_flags)
+{
+	struct ibv_qp_init_attr_ex attr;
+	struct mlx4dv_qp_init_attr mlx4_attr;
+	uint64_t ns = 0;
+	int i;
+
+	b->conns = calloc(b->threads, sizeof *b->conns);
+	if (!b->conns)
+		return -1;
+
+	for (i = 0; i < b->threads; ++i) {
+		b->conns[i].cq = create_cq(b, 2 * b->burst, cq_flags);
+		if (!b->conns[i].cq)
+			goto out;
+
+		memset(&attr, 0, sizeof attr);
+		attr.send_cq	      = b->conns[i].cq;
+		attr.recv_cq	      = b->conns[i].cq;
+		attr.qp_type	      = IBV_QPT_RC;
+		attr.cap.max_send_wr  = b->burst;
+		attr.cap.max_recv_wr  = b->burst;
+		attr.cap.max_send_sge = 1;
+		attr.cap.max_recv_sge = 1;
+		attr.comp_mask	      = IBV_QP_INIT_ATTR_PD;
+		attr.pd		      = b->pd;
+
+		memset(&mlx4_attr, 0, sizeof mlx4_attr);
+		mlx4_attr.comp_mask    = MLX4DV_QP_INIT_ATTR_MASK_CREATE_FLAGS;
+		mlx4_attr.create_flags = qp_flags;
+
+		b->conns[i].qp = mlx4dv_create_qp(b->context, &attr, &mlx4_attr);
+		if (!b->conns[i].qp || rc_qp_to_rts(b, b->conns[i].qp))
+			goto out;
+	}
+
+	ns = run_threads(b, isolated_loop);
+	if (ns)
+		report(what, b->iters * b->burst * b->threads, ns);
+
+out:
+	if (!ns)
+		perror(what);
+	for (i = 0; i < b->threads; ++i) {
+		if (b->conns[i].qp)
+			ibv_destroy_qp(b->conns[i].qp);
+		if (b->conns[i].cq)
+			ibv_destroy_cq(b->conns[i].cq);
+	}
+	free(b->conns);
+	b->conns = NULL;
+
+	return ns ? 0 : -1;
+}
+
+static int run_isolated(struct bench *b)
+{
+	if (isolated_phase(b, "sends, packed doorbells", 0, 0))
+		return -1;
+
+	return isolated_phase(b, "sends, isolated doorbells",
+			      MLX4DV_CQ_CREATE_ISOLATED_DB,
+			      MLX4DV_QP_CREATE_ISOLATED_DB);
+}
+
+/*
+ * Producer and consumer on different cores: thread 0 posts chains of
+ * -b signaled RDMA writes to a QP connected to itself while thread 1
+ * polls its CQ, with at most -q WRs outstanding.  The SQ head the
+ * producer writes and the tail and CQ state the consumer writes should
+ * not share cache lines; perf c2c shows whether they do.
+ */
+static struct {
+	struct ibv_qp	       *qp;
+	struct ibv_cq	       *cq;
+	struct ibv_mr	       *mr;
+	int			depth;
+	long			done;
+	/* Set by a thread that gave up, so the other one stops too */
+	int			failed;
+} split;
+
+static int split_loop(struct bench *b, int id, long iters)
+{
+	long total = iters * b->burst;
+	struct ibv_send_wr *wrs;
+	struct ibv_send_wr *bad_wr;
+	struct ibv_sge sge;
+	struct ibv_wc wc[16];
+	long posted;
+	int ret = -1;
+	int n;
+	int i;
+
+	if (id) {
+		while (__atomic_load_n(&split.done, __ATOMIC_RELAXED) < total) {
+			if (__atomic_load_n(&split.failed, __ATOMIC_RELAXED))
+				return -1;
+			n = ibv_poll_cq(split.cq, 16, wc);
+			if (n < 0)
+				goto fail;
+			for (i = 0; i < n; ++i)
+				if (wc[i].status != IBV_WC_SUCCESS)
+					goto fail;
+			__atomic_add_fetch(&split.done, n, __ATOMIC_RELEASE);
+		}
+		return 0;
+	}
+
+	wrs = calloc(b->burst, sizeof *wrs);
+	if (!wrs)
+		goto fail;
+
+	build_write_chain(wrs, &sge, b->burst, split.mr, b->size);
+
+	for (posted = 0; posted < total; posted += b->burst) {
+		while (posted - __atomic_load_n(&split.done, __ATOMIC_ACQUIRE) >
+		       split.depth - b->burst)
+			if (__atomic_load_n(&split.failed, __ATOMIC_RELAXED))
+				goto out;
+		if (ibv_post_send(split.qp, wrs, &bad_wr))
+			goto out;
+	}
+
+	ret = 0;
+
+out:
+	free(wrs);
+	if (!ret)
+		return 0;
+fail:
+	__atomic_store_n(&split.failed, 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+static int run_split(struct bench *b)
+{
+	void *buf = NULL;
+	uint64_t ns = 0;
+
+	split.depth = b->num ? b->num : 1024;
+	split.done   = 0;
+	split.failed = 0;
+	b->threads   = 2;
+
+	if (b->burst > split.depth) {
+		fprintf(stderr, "burst too large\n");
+		return -1;
+	}
+
+	buf	 = calloc(1, b->size ? b->size : 1);
+	split.mr = buf ? ibv_reg_mr(b->pd, buf, b->size ? b->size : 1,
+				    IBV_ACCESS_LOCAL_WRITE |
+				    IBV_ACCESS_REMOTE_WRITE) : NULL;
+	split.cq = ibv_create_cq(b->context, split.depth, NULL, NULL, 0);
+	if (!split.mr || !split.cq)
+		goto out;
+
+	split.qp = create_rc_qp(b, split.cq, split.depth, 0);
+	if (!split.qp)
+		goto out;
+
+	ns = run_threads(b, split_loop);
+	if (ns)
+		report("RDMA writes, split threads", b->iters * b->burst, ns);
+
+out:
+	if (split.qp)
+		ibv_destroy_qp(split.qp);
+	if (split.cq)
+		ibv_destroy_cq(split.cq);
+	if (split.mr)
+		ibv_dereg_mr(split.mr);
+	free(buf);
+	return ns ? 0 : -1;
+}
+
+/*
+ * Registration churn: -n ibv_reg_mr() and ibv_dereg_mr() pairs with
+ * local write access, cycling through -q buffers of -s bytes.  Then
+ * one buffer is unmapped and mapped again, which the registration
+ * cache must notice.  Run with and without MLX4_MR_CACHE_SIZE.
+ */
+static int run_reg(struct bench *b)
+{
+	int num = b->num ? b->num : 64;
+	size_t size = b->size ? b->size : 1;
+	struct mlx4dv_mr_cache_stats stats;
+	struct ibv_mr *mr;
+	uint8_t **bufs;
+	uint64_t start;
+	long i;
+	int ret = -1;
+	int n;
+
+	bufs = calloc(num, sizeof *bufs);
+	if (!bufs)
+		return -1;
+
+	for (n = 0; n < num; ++n) {
+		bufs[n] = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (bufs[n] == MAP_FAILED)
+			goto out;
+		memset(bufs[n], 0, size);
+	}
+
+	start = now_ns();
+	for (i = 0; i < b->iters; ++i) {
+		mr = ibv_reg_mr(b->pd, bufs[i % num], size,
+				IBV_ACCESS_LOCAL_WRITE);
+		if (!mr) {
+			perror("ibv_reg_mr");
+			goto out;
+		}
+		ibv_dereg_mr(mr);
+	}
+	report("reg/dereg", b->iters, now_ns() - start);
+
+	/* The new mapping, likely at the same address, must not hit */
+	munmap(bufs[0], size);
+	bufs[0] = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (bufs[0] == MAP_FAILED)
+		goto out;
+	memset(bufs[0], 0, size);
+	mr = ibv_reg_mr(b->pd, bufs[0], size, IBV_ACCESS_LOCAL_WRITE);
+	if (mr)
+		ibv_dereg_mr(mr);
+
+	mlx4dv_mr_cache_query(b->context, &stats);
+	printf("cache: %llu hits, %llu misses, %llu evictions, "
+	       "%llu invalidations, %llu bytes\n",
+	       (unsigned long long) stats.hits,
+	       (unsigned long long) stats.misses,
+	       (unsigned long long) stats.evictions,
+	       (unsigned long long) stats.invalidations,
+	       (unsigned long long) stats.size);
+
+	ret = 0;
+
+out:
+	while (n--)
+		if (bufs[n] != MAP_FAILED)
+			munmap(bufs[n], size);
+	free(bufs);
+	return ret;
+}
+
+/*
+ * Connection setup with large queues: -n rounds of creating a CQ and
+ * an RC QP with -q entry send and receive queues (capped at what the
+ * device allows), moving it to RTS and destroying both.  Prints the
+ * time and the minor page faults per round, which is what lazy
+ * queue initialization saves.
+ */
+static int run_connect(struct bench *b)
+{
+	int depth = b->num ? b->num : 16384;
+	struct ibv_device_attr dev_attr;
+	struct ibv_qp_init_attr attr;
+	struct rusage before;
+	struct rusage after;
+	struct ibv_cq *cq;
+	struct ibv_qp *qp;
+	uint64_t start;
+	long i;
+
+	if (ibv_query_device(b->context, &dev_attr))
+		return -1;
+	if (depth > dev_attr.max_qp_wr)
+		depth = dev_attr.max_qp_wr;
+
+	getrusage(RUSAGE_SELF, &before);
+	start = now_ns();
+
+	for (i = 0; i < b->iters; ++i) {
+		cq = ibv_create_cq(b->context, 2 * depth, NULL, NULL, 0);
+		if (!cq) {
+			perror("ibv_create_cq");
+			return -1;
+		}
+
+		memset(&attr, 0, sizeof attr);
+		attr.send_cq	      = cq;
+		attr.recv_cq	      = cq;
+		attr.qp_type	      = IBV_QPT_RC;
+		attr.cap.max_send_wr  = depth;
+		attr.cap.max_recv_wr  = depth;
+		attr.cap.max_send_sge = 1;
+		attr.cap.max_recv_sge = 1;
+
+		qp = ibv_create_qp(b->pd, &attr);
+		if (!qp || rc_qp_to_rts(b, qp)) {
+			perror("create and connect QP");
+			if (qp)
+				ibv_destroy_qp(qp);
+			ibv_destroy_cq(cq);
+			return -1;
+		}
+
+		ibv_destroy_qp(qp);
+		ibv_destroy_cq(cq);
+	}
+
+	report("connect, deep queues", b->iters, now_ns() - start);
+	getrusage(RUSAGE_SELF, &after);
+	printf("%-28s %12.1f per connection (%d entries)\n", "minor faults",
+	       (double) (after.ru_minflt - before.ru_minflt) / b->iters,
+	       depth);
+
+	return 0;
+}
+
+static void init_small_rc_attr(struct bench *b, struct ibv_cq *cq,
+			       struct ibv_qp_init_attr_ex *attr)
+{
+	memset(attr, 0, sizeof *attr);
+	attr->send_cq	       = cq;
+	attr->recv_cq	       = cq;
+	attr->qp_type	       = IBV_QPT_RC;
+	attr->cap.max_send_wr  = 16;
+	attr->cap.max_recv_wr  = 16;
+	attr->cap.max_send_sge = 1;
+	attr->cap.max_recv_sge = 1;
+	attr->comp_mask	       = IBV_QP_INIT_ATTR_PD;
+	attr->pd	       = b->pd;
+}
+
+/*
+ * Job startup: -q RC QPs with 16 entry queues on one CQ, created by
+ * one mlx4dv_create_qp_bulk() call and then by as many
+ * mlx4dv_create_qp() calls, timing each way and destroying the QPs in
+ * between.  Try -q 1000, 10000 and 100000.
+ */
+static int run_bulk(struct bench *b)
+{
+	int num = b->num ? b->num : 1000;
+	struct ibv_qp_init_attr_ex *attrs = NULL;
+	struct ibv_qp **qps = NULL;
+	struct ibv_cq *cq;
+	uint64_t start;
+	int ret = -1;
+	int err;
+	int n;
+	int i;
+
+	cq = ibv_create_cq(b->context, 1, NULL, NULL, 0);
+	if (!cq)
+		return -1;
+
+	attrs = calloc(num, sizeof *attrs);
+	qps   = calloc(num, sizeof *qps);
+	if (!attrs || !qps)
+		goto out;
+
+	for (i = 0; i < num; ++i)
+		init_small_rc_attr(b, cq, attrs + i);
+
+	start = now_ns();
+	err = mlx4dv_create_qp_bulk(b->context, num, attrs, NULL, qps);
+	if (err) {
+		fprintf(stderr, "mlx4dv_create_qp_bulk: %s\n", strerror(err));
+		goto out;
+	}
+	report("QPs, mlx4dv_create_qp_bulk", num, now_ns() - start);
+
+	for (i = 0; i < num; ++i)
+		ibv_destroy_qp(qps[i]);
+
+	start = now_ns();
+	for (n = 0; n < num; ++n) {
+		qps[n] = mlx4dv_create_qp(b->context, attrs + n, NULL);
+		if (!qps[n]) {
+			perror("mlx4dv_create_qp");
+			break;
+		}
+	}
+	if (n == num) {
+		report("QPs, mlx4dv_create_qp", num, now_ns() - start);
+		ret = 0;
+	}
+
+	while (n--)
+		ibv_destroy_qp(qps[n]);
+
+out:
+	free(qps);
+	free(attrs);
+	ibv_destroy_cq(cq);
+	return ret;
+}
+
+/*
+ * QP table scaling: each of -t threads creates and destroys a small RC
+ * QP -n times on its own CQ, so the only state the threads share is
+ * the context's QP table.  Compare the rate at -t 1, 2, 4 and up.
+ */
+static int qp_loop(struct bench *b, int id, long iters)
+{
+	struct ibv_qp_init_attr_ex attr;
+	struct ibv_qp *qp;
+	long i;
+
+	init_small_rc_attr(b, b->conns[id].cq, &attr);
+
+	for (i = 0; i < iters; ++i) {
+		qp = mlx4dv_create_qp(b->context, &attr, NULL);
+		if (!qp || ibv_destroy_qp(qp)) {
+			perror("QP create/destroy");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int run_qp(struct bench *b)
+{
+	uint64_t ns = 0;
+	int i;
+
+	b->conns = calloc(b->threads, sizeof *b->conns);
+	if (!b->conns)
+		return -1;
+
+	for (i = 0; i < b->threads; ++i) {
+		b->conns[i].cq = ibv_create_cq(b->context, 1, NULL, NULL, 0);
+		if (!b->conns[i].cq) {
+			perror("ibv_create_cq");
+			goto out;
+		}
+	}
+
+	ns = run_threads(b, qp_loop);
+	if (ns)
+		report("QP create/destroy", b->iters * b->threads, ns);
+
+out:
+	for (i = 0; i < b->threads; ++i)
+		if (b->conns[i].cq)
+			ibv_destroy_cq(b->conns[i].cq);
+	free(b->conns);
+	b->conns = NULL;
+
+	return ns ? 0 : -1;
+}
+
+/* Resident set size in bytes, from /proc/self/statm */
+static long rss_bytes(void)
+{
+	FILE *f;
+	long pages = -1;
+
+	f = fopen("/proc/self/statm", "r");
+	if (!f)
+		return -1;
+	if (fscanf(f, "%*s %ld", &pages) != 1)
+		pages = -1;
+	fclose(f);
+
+	return pages < 0 ? -1 : pages * sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * QPN index: -q self-connected RC QPs with 16 entry queues on one CQ,
+ * reporting the resident memory they add per QP, then -n signaled
+ * RDMA writes posted -b at a time round-robin across the QPs.  Every
+ * completion polled looks its QPN up in the index, so ns per write
+ * tracks lookup cost as -q goes from 1k to 1M.
+ */
+static int run_index(struct bench *b)
+{
+	int num = b->num ? b->num : 1000;
+	struct ibv_qp_init_attr_ex *attrs = NULL;
+	struct ibv_qp **qps = NULL;
+	struct ibv_send_wr wr;
+	struct ibv_send_wr *bad_wr;
+	struct ibv_sge sge;
+	struct ibv_cq *cq = NULL;
+	struct ibv_mr *mr = NULL;
+	void *buf = NULL;
+	uint64_t start;
+	long rss;
+	long sent;
+	int inflight = 0;
+	int created = 0;
+	int ret = -1;
+	int err;
+	int i;
+
+	if (b->burst > 16 * num) {
+		fprintf(stderr, "burst too large\n");
+		return -1;
+	}
+
+	buf   = calloc(1, b->size ? b->size : 1);
+	attrs = calloc(num, sizeof *attrs);
+	qps   = calloc(num, sizeof *qps);
+	if (!buf || !attrs || !qps)
+		goto out;
+
+	mr = ibv_reg_mr(b->pd, buf, b->size ? b->size : 1,
+			IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
+	cq = ibv_create_cq(b->context, b->burst, NULL, NULL, 0);
+	if (!mr || !cq)
+		goto out;
+
+	for (i = 0; i < num; ++i)
+		init_small_rc_attr(b, cq, attrs + i);
+
+	rss = rss_bytes();
+	err = mlx4dv_create_qp_bulk(b->context, num, attrs, NULL, qps);
+	if (err) {
+		fprintf(stderr, "mlx4dv_create_qp_bulk: %s\n", strerror(err));
+		goto out;
+	}
+	created = num;
+	printf("%-28s %12.0f bytes per QP (%d QPs)\n", "resident memory",
+	       (double) (rss_bytes() - rss) / num, num);
+
+	for (i = 0; i < num; ++i)
+		if (rc_qp_to_rts(b, qps[i])) {
+			perror("connect RC QP");
+			goto out;
+		}
+
+	build_write_chain(&wr, &sge, 1, mr, b->size);
+
+	start = now_ns();
+	for (sent = 0; sent < b->iters; ) {
+		for (i = 0; i < b->burst; ++i, ++sent)
+			if (ibv_post_send(qps[sent % num], &wr, &bad_wr)) {
+				perror("ibv_post_send");
+				goto out;
+			}
+		inflight += b->burst;
+		if (reap(cq, &inflight, 0))
+			goto out;
+	}
+	report("RDMA writes, round-robin", sent, now_ns() - start);
+
+	ret = 0;
+
+out:
+	reap(cq, &inflight, 0);
+	while (created--)
+		ibv_destroy_qp(qps[created]);
+	if (cq)
+		ibv_destroy_cq(cq);
+	if (mr)
+		ibv_dereg_mr(mr);
+	free(qps);
+	free(attrs);
+	free(buf);
+	return ret;
+}
+
+static struct mode modes[] = {
+	{ "tx",		run_tx,
+	  "raw Ethernet packets/s, mlx4dv_tx_burst() vs ibv_post_send()" },
+	{ "tcptx",	run_tcptx,
+	  "send in order TCP segments of -q flows for the gro mode" },
+	{ "gro",	run_gro,
+	  "receive cost per segment, mlx4dv_rx_burst() vs GRO" },
+	{ "ring",	run_ring,
+	  "RDMA writes/s through a -q deep SQ, for MLX4_HUGE_BUF" },
+	{ "create",	run_create,
+	  "CQ+QP create/destroy rounds/s, for MLX4_BUF_CACHE_SIZE" },
+	{ "isolated",	run_isolated,
+	  "sends/s on -t threads, packed vs isolated doorbell records" },
+	{ "split",	run_split,
+	  "RDMA writes/s, posting and polling on different threads" },
+	{ "reg",	run_reg,
+	  "reg/dereg pairs/s over -q buffers, for MLX4_MR_CACHE_SIZE" },
+	{ "connect",	run_connect,
+	  "create, connect and destroy a -q deep RC QP, per second" },
+	{ "bulk",	run_bulk,
+	  "create -q QPs with one bulk call vs one call each" },
+	{ "qp",		run_qp,
+	  "create and destroy RC QPs on -t threads, per second" },
+	{ "index",	run_index,
+	  "memory per QP and completion rate across -q QPs" },
+	{ NULL }
+};
+
+static void usage(const char *argv0)
+{
+	struct mode *m;
+
+	fprintf(stderr, "usage: %s [-d device] [-p port] [-n iters] "
+		"[-b burst] [-s size] [-q num] [-t threads] mode\n", argv0);
+	for (m = modes; m->name; ++m)
+		fprintf(stderr, "  %-10s %s\n", m->name, m->help);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench b = {
+		.port	= 1,
+		.iters	= 1000000,
+		.burst	= 32,
+		.size	= 64,
+		.threads = 1
+	};
+	struct ibv_device **list;
+	const char *name = NULL;
+	struct mode *m;
+	int ret = 1;
+	int op;
+	int i;
+
+	while ((op = getopt(argc, argv, "d:p:n:b:s:q:t:")) != -1) {
+		switch (op) {
+		case 'd':
+			name = optarg;
+			break;
+		case 'p':
+			b.port = atoi(optarg);
+			break;
+		case 'n':
+			b.iters = atol(optarg);
+			break;
+		case 'b':
+			b.burst = atoi(optarg);
+			break;
+		case 's':
+			b.size = atoi(optarg);
+			break;
+		case 'q':
+			b.num = atoi(optarg);
+			break;
+		case 't':
+			b.threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (optind != argc - 1 || b.iters < 1 || b.burst < 1 || b.size < 0 ||
+	    b.num < 0 || b.threads < 1)
+		usage(argv[0]);
+
+	for (m = modes; m->name && strcmp(m->name, argv[optind]); ++m)
+		; /* nothing */
+	if (!m->name)
+		usage(argv[0]);
+
+	list = ibv_get_device_list(NULL);
+	for (i = 0; list && list[i]; ++i)
+		if (name ? !strcmp(ibv_get_device_name(list[i]), name) :
+		    !strncmp(ibv_get_device_name(list[i]), "mlx4", 4))
+			break;
+	if (!list || !list[i]) {
+		fprintf(stderr, "no mlx4 device found\n");
+		return 1;
+	}
+
+	b.context = ibv_open_device(list[i]);
+	if (!b.context) {
+		perror("ibv_open_device");
+		goto out_list;
+	}
+
+	b.pd = ibv_alloc_pd(b.context);
+	if (!b.pd) {
+		perror("ibv_alloc_pd");
+		goto out_close;
+	}
+
+	ret = m->run(&b) ? 1 : 0;
+
+	ibv_dealloc_pd(b.pd);
+out_close:
+	ibv_close_device(b.context);
+out_list:
+	ibv_free_device_list(list);
+	return ret;
+}
@@ -35,21 +35,122 @@
 #endif /* HAVE_CONFIG_H */
 
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 
 #include "mlx4.h"
 
-int mlx4_alloc_buf(struct mlx4_buf *buf, size_t size, int page_size)
+enum {
+	MLX4_MPOL_PREFERRED	= 1,
+	MLX4_MAX_NUMA_NODES	= 1024
+};
+
+/*
+ * Prefer numa_node for the pages of a buffer that hasn't been touched
+ * yet.  Best effort: without mbind() the pages land on first touch.
+ */
+static void bind_buf(void *addr, size_t length, int numa_node)
+{
+#ifdef __NR_mbind
+	unsigned long mask[MLX4_MAX_NUMA_NODES / (8 * sizeof (unsigned long))];
+	int bits = 8 * sizeof mask[0];
+
+	if (numa_node < 0 || numa_node >= MLX4_MAX_NUMA_NODES)
+		return;
+
+	memset(mask, 0, sizeof mask);
+	mask[numa_node / bits] = 1UL << (numa_node % bits);
+
+	/* The kernel reads maxnode - 1 bits of the mask */
+	syscall(__NR_mbind, addr, length, MLX4_MPOL_PREFERRED, mask,
+		MLX4_MAX_NUMA_NODES + 1, 0);
+#endif
+}
+
+/*
+ * Back a buffer with huge pages: hugetlb pages if any are reserved,
+ * otherwise an anonymous mapping aligned so that THP can back it.
+ */
+static void *alloc_huge_buf(size_t length, int mmap_flags)
+{
+	uintptr_t start;
+	uint8_t *p;
+
+#ifdef MAP_HUGETLB
+	p = mmap(NULL, length, PROT_READ | PROT_WRITE,
+		 mmap_flags | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+#endif
+
+	p = mmap(NULL, length + MLX4_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+
+	start = align((uintptr_t) p, MLX4_HUGE_PAGE_SIZE);
+	if (start != (uintptr_t) p)
+		munmap(p, start - (uintptr_t) p);
+	munmap((void *) start + length,
+	       (uintptr_t) p + MLX4_HUGE_PAGE_SIZE - start);
+	p = (void *) start;
+
+#ifdef MADV_HUGEPAGE
+	madvise(p, length, MADV_HUGEPAGE);
+#endif
+
+	return p;
+}
+
+int mlx4_alloc_buf(struct mlx4_buf *buf, size_t size, int page_size,
+		   int flags, int numa_node)
 {
+	int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	size_t touch = page_size;
+	size_t off;
 	int ret;
 
-	buf->length = align(size, page_size);
-	buf->buf = mmap(NULL, buf->length, PROT_READ | PROT_WRITE,
-			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	/*
+	 * MAP_POPULATE faults pages in before mbind() can apply, so a
+	 * bound buffer is prefaulted by hand once the policy is set.
+	 */
+	if (flags & MLX4_BUF_POPULATE && numa_node < 0)
+		mmap_flags |= MAP_POPULATE;
+
+	/* Rounding up a small buffer to a huge page costs more than it saves */
+	buf->flags     = MLX4_BUF_ZEROED;
+	buf->numa_node = numa_node;
+
+	if (flags & MLX4_BUF_HUGE && size >= MLX4_HUGE_PAGE_SIZE / 2) {
+		buf->flags |= MLX4_BUF_HUGE;
+		buf->length = align(size, MLX4_HUGE_PAGE_SIZE);
+		buf->buf = alloc_huge_buf(buf->length, mmap_flags);
+		/* Huge mappings can only be split on huge page boundaries */
+		size  = buf->length;
+		touch = MLX4_HUGE_PAGE_SIZE;
+	} else {
+		buf->length = align(size, page_size);
+		buf->buf = mmap(NULL, buf->length, PROT_READ | PROT_WRITE,
+				mmap_flags, -1, 0);
+	}
 	if (buf->buf == MAP_FAILED)
 		return errno;
 
+	bind_buf(buf->buf, buf->length, numa_node);
+
+	/*
+	 * Touch the pages ourselves when MAP_POPULATE wasn't used or
+	 * only covered base pages ahead of THP.
+	 */
+	if (flags & MLX4_BUF_POPULATE &&
+	    (numa_node >= 0 || touch == MLX4_HUGE_PAGE_SIZE))
+		for (off = 0; off < buf->length; off += touch)
+			((volatile uint8_t *) buf->buf)[off] = 0;
+
 	ret = ibv_dontfork_range(buf->buf, size);
 	if (ret)
 		munmap(buf->buf, buf->length);
@@ -64,3 +165,246 @@ void mlx4_free_buf(struct mlx4_buf *buf)
 		munmap(buf->buf, buf->length);
 	}
 }
+
+/*
+ * Zeroed memory for the objects with cache line aligned regions.
+ */
+void *mlx4_calloc_aligned(size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, MLX4_CACHELINE_SIZE, size))
+		return NULL;
+
+	memset(p, 0, size);
+
+	return p;
+}
+
+/*
+ * A free buffer in the cache, stored in the buffer's own first bytes.
+ */
+struct mlx4_cached_buf {
+	struct mlx4_cached_buf	       *next;
+	int				flags;
+	int				numa_node;
+};
+
+static int buf_order(size_t length)
+{
+	int order;
+
+	for (order = 0; (1UL << order) < length; ++order)
+		; /* nothing */
+
+	return order;
+}
+
+/*
+ * Round a buffer length up to its cache class.  Each power of two is
+ * split into MLX4_BUF_CACHE_STEPS classes, so rounding costs at most
+ * an eighth of the length; up to 16 pages, every page multiple is a
+ * class of its own.  Huge page multiples stay huge page multiples.
+ */
+static size_t buf_round(size_t length)
+{
+	int order = buf_order(length);
+
+	if (order < 4)
+		return length;
+
+	return align(length, 1UL << (order - 4));
+}
+
+/* Free list of a rounded length, and back */
+static int buf_class(size_t length)
+{
+	int order = buf_order(length);
+
+	return order * MLX4_BUF_CACHE_STEPS +
+		(length >> (order - 4)) - (MLX4_BUF_CACHE_STEPS + 1);
+}
+
+static size_t class_length(int class)
+{
+	int order = class / MLX4_BUF_CACHE_STEPS;
+
+	return (size_t) (class % MLX4_BUF_CACHE_STEPS +
+			 MLX4_BUF_CACHE_STEPS + 1) << (order - 4);
+}
+
+void mlx4_init_buf_cache(struct mlx4_context *context)
+{
+	struct mlx4_buf_cache *cache = &context->buf_cache;
+	char *env;
+	int i;
+
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->size = 0;
+	for (i = 0; i < MLX4_BUF_CACHE_CLASSES; ++i)
+		cache->free[i] = NULL;
+
+	env = getenv("MLX4_BUF_CACHE_SIZE");
+	cache->max_size = env ? strtoul(env, NULL, 0) : 0;
+}
+
+void mlx4_cleanup_buf_cache(struct mlx4_context *context)
+{
+	struct mlx4_buf_cache *cache = &context->buf_cache;
+	struct mlx4_cached_buf *cbuf;
+	struct mlx4_buf buf;
+	int i;
+
+	for (i = 0; i < MLX4_BUF_CACHE_CLASSES; ++i)
+		while (cache->free[i]) {
+			cbuf = cache->free[i];
+			cache->free[i] = cbuf->next;
+
+			buf.buf	   = cbuf;
+			buf.length = class_length(i);
+			mlx4_free_buf(&buf);
+		}
+
+	cache->size = 0;
+	pthread_mutex_destroy(&cache->lock);
+}
+
+/*
+ * Allocate a CQ, QP or SRQ buffer.  With a cache configured, lengths
+ * are rounded up by buf_round() and buffers freed by destroyed
+ * objects are reused as they are: already mapped, madvised and
+ * faulted in, but not zeroed: callers that rely on zero fill check
+ * for MLX4_BUF_ZEROED.
+ */
+int mlx4_alloc_queue_buf(struct mlx4_context *context, struct mlx4_buf *buf,
+			 size_t size, int flags, int numa_node)
+{
+	struct mlx4_buf_cache *cache = &context->buf_cache;
+	int page_size = to_mdev(context->ibv_ctx.device)->page_size;
+	struct mlx4_cached_buf **pcbuf;
+	struct mlx4_cached_buf *cbuf;
+	size_t length;
+	int huge = 0;
+	int class;
+
+	length = buf_round(align(size, page_size));
+	if (flags & MLX4_BUF_HUGE && length >= MLX4_HUGE_PAGE_SIZE / 2) {
+		huge = MLX4_BUF_HUGE;
+		length = buf_round(align(length, MLX4_HUGE_PAGE_SIZE));
+	}
+
+	if (length > cache->max_size)
+		return mlx4_alloc_buf(buf, size, page_size, flags, numa_node);
+
+	class = buf_class(length);
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (pcbuf = &cache->free[class]; *pcbuf; pcbuf = &(*pcbuf)->next)
+		if ((*pcbuf)->flags == huge && (*pcbuf)->numa_node == numa_node)
+			break;
+
+	cbuf = *pcbuf;
+	if (cbuf) {
+		*pcbuf = cbuf->next;
+		cache->size -= length;
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+
+	if (!cbuf)
+		return mlx4_alloc_buf(buf, length, page_size, flags, numa_node);
+
+	buf->buf       = cbuf;
+	buf->length    = length;
+	buf->flags     = huge;
+	buf->numa_node = numa_node;
+
+	return 0;
+}
+
+/*
+ * Allocate the buffers of several queues as one mapping, split on page
+ * boundaries, which saves a mmap() and a madvise() per queue.  Each
+ * buffer is still freed on its own with mlx4_free_queue_buf().  Huge
+ * page mappings can't be split that way, and buffers the cache may
+ * serve are better taken from it, so both are allocated one by one.
+ */
+int mlx4_alloc_queue_bufs(struct mlx4_context *context, struct mlx4_buf **bufs,
+			  size_t *sizes, int num, int flags, int numa_node)
+{
+	int page_size = to_mdev(context->ibv_ctx.device)->page_size;
+	struct mlx4_buf slab;
+	size_t total = 0;
+	int i;
+
+	if (flags & MLX4_BUF_HUGE || context->buf_cache.max_size) {
+		for (i = 0; i < num; ++i) {
+			bufs[i]->length = 0;
+			if (sizes[i] &&
+			    mlx4_alloc_queue_buf(context, bufs[i], sizes[i],
+						 flags, numa_node))
+				goto err;
+		}
+
+		return 0;
+	}
+
+	for (i = 0; i < num; ++i)
+		total += align(sizes[i], page_size);
+
+	if (!total) {
+		for (i = 0; i < num; ++i)
+			bufs[i]->length = 0;
+		return 0;
+	}
+
+	if (mlx4_alloc_buf(&slab, total, page_size, flags, numa_node))
+		return -1;
+
+	for (i = 0; i < num; ++i) {
+		bufs[i]->buf	   = slab.buf;
+		bufs[i]->length	   = align(sizes[i], page_size);
+		bufs[i]->flags	   = slab.flags;
+		bufs[i]->numa_node = numa_node;
+		slab.buf += bufs[i]->length;
+	}
+
+	return 0;
+
+err:
+	while (i--)
+		mlx4_free_queue_buf(context, bufs[i]);
+	return -1;
+}
+
+void mlx4_free_queue_buf(struct mlx4_context *context, struct mlx4_buf *buf)
+{
+	struct mlx4_buf_cache *cache = &context->buf_cache;
+	struct mlx4_cached_buf *cbuf = buf->buf;
+	int class;
+
+	if (!buf->length || buf_round(buf->length) != buf->length ||
+	    buf->length > cache->max_size) {
+		mlx4_free_buf(buf);
+		return;
+	}
+
+	class = buf_class(buf->length);
+
+	pthread_mutex_lock(&cache->lock);
+
+	if (cache->size + buf->length > cache->max_size) {
+		pthread_mutex_unlock(&cache->lock);
+		mlx4_free_buf(buf);
+		return;
+	}
+
+	cbuf->flags	  = buf->flags & MLX4_BUF_HUGE;
+	cbuf->numa_node	  = buf->numa_node;
+	cbuf->next	  = cache->free[class];
+	cache->free[class] = cbuf;
+	cache->size	 += buf->length;
+
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -46,6 +46,7 @@
 
 #include "mlx4.h"
 #include "doorbell.h"
+#include "wqe.h"
 
 enum {
 	MLX4_CQ_DOORBELL			= 0x20
@@ -182,6 +183,64 @@ static void mlx4_handle_error_cqe(struct mlx4_err_cqe *cqe,
 	*vendor_err = cqe->vendor_err;
 }
 
+/*
+ * Receive WQEs freed while polling are linked into a private chain
+ * under the CQ lock and returned to their SRQ in one go, so that a poll
+ * call takes the SRQ lock once instead of once per completion.
+ */
+static void mlx4_flush_srq_wqes(struct mlx4_cq *cq)
+{
+	struct mlx4_srq *srq = cq->free_srq;
+
+	if (!srq)
+		return;
+
+	mlx4_free_srq_wqes(srq, cq->free_first, cq->free_last, cq->free_cnt);
+	cq->free_srq = NULL;
+
+	if (srq->replenish)
+		mlx4_srq_check_replenish(srq);
+}
+
+static inline void mlx4_defer_free_srq_wqe(struct mlx4_cq *cq,
+					   struct mlx4_srq *srq, int ind)
+{
+	struct mlx4_wqe_srq_next_seg *next;
+
+	if (cq->free_srq == srq) {
+		next = srq->buf.buf + (cq->free_last << srq->wqe_shift);
+		next->next_wqe_index = htons(ind);
+		cq->free_last = ind;
+		++cq->free_cnt;
+		return;
+	}
+
+	mlx4_flush_srq_wqes(cq);
+
+	cq->free_srq   = srq;
+	cq->free_first = ind;
+	cq->free_last  = ind;
+	cq->free_cnt   = 1;
+}
+
+/*
+ * wr_id of the WQE at the tail of wq.  Completions retire wrid entries
+ * in order, so the next line of the array is prefetched on the way.
+ * QPs without wrid arrays report the WQE's position in the queue.
+ */
+static inline uint64_t mlx4_get_wrid(struct mlx4_wq *wq)
+{
+	unsigned ind = wq->tail & (wq->wqe_cnt - 1);
+
+	if (!wq->wrid)
+		return wq->tail;
+
+	__builtin_prefetch(&wq->wrid[(ind + MLX4_CACHELINE_SIZE /
+				      sizeof (uint64_t)) & (wq->wqe_cnt - 1)]);
+
+	return wq->wrid[ind];
+}
+
 static inline int mlx4_handle_cq(struct mlx4_cq *cq,
 				 struct mlx4_qp **cur_qp,
 				 uint64_t *wc_wr_id,
@@ -189,7 +248,8 @@ static inline int mlx4_handle_cq(struct mlx4_cq *cq,
 				 uint32_t *wc_vendor_err,
 				 struct mlx4_cqe **pcqe,
 				 uint32_t *pqpn,
-				 int *pis_send)
+				 int *pis_send,
+				 uint16_t *psq_retired)
 {
 	struct mlx4_wq *wq;
 	struct mlx4_cqe *cqe;
@@ -223,22 +283,14 @@ static inline int mlx4_handle_cq(struct mlx4_cq *cq,
 		MLX4_CQE_OPCODE_ERROR;
 
 	if ((qpn & MLX4_XRC_QPN_BIT) && !is_send) {
-		/*
-		 * We do not have to take the XSRQ table lock here,
-		 * because CQs will be locked while SRQs are removed
-		 * from the table.
-		 */
+		/* No lock needed: index lookups never wait, see index.c */
 		srq = mlx4_find_xsrq(&to_mctx(cq->ibv_cq.context)->xsrq_table,
 				     ntohl(cqe->g_mlpath_rqpn) & MLX4_CQE_QPN_MASK);
 		if (!srq)
 			return CQ_POLL_ERR;
 	} else {
 		if (!*cur_qp || (qpn != (*cur_qp)->verbs_qp.qp.qp_num)) {
-			/*
-			 * We do not have to take the QP table lock here,
-			 * because CQs will be locked while QPs are removed
-			 * from the table.
-			 */
+			/* No lock needed, see index.c */
 			*cur_qp = mlx4_find_qp(to_mctx(cq->ibv_cq.context), qpn);
 			if (!*cur_qp)
 				return CQ_POLL_ERR;
@@ -249,16 +301,30 @@ static inline int mlx4_handle_cq(struct mlx4_cq *cq,
 	if (is_send) {
 		wq = &(*cur_qp)->sq;
 		wqe_index = ntohs(cqe->wqe_index);
+		if (psq_retired)
+			*psq_retired = (uint16_t)(wqe_index -
+						  (uint16_t)wq->tail) + 1;
 		wq->tail += (uint16_t)(wqe_index - (uint16_t)wq->tail);
-		*wc_wr_id = wq->wrid[wq->tail & (wq->wqe_cnt - 1)];
+		*wc_wr_id = mlx4_get_wrid(wq);
 		++wq->tail;
 	} else if (srq) {
 		wqe_index = htons(cqe->wqe_index);
 		*wc_wr_id = srq->wrid[wqe_index];
-		mlx4_free_srq_wqe(srq, wqe_index);
+		/* Ring slots go back to the free list when released */
+		if (srq->recv_ring)
+			srq->recv_ring->state[wqe_index] = MLX4_RING_HELD;
+		else
+			mlx4_defer_free_srq_wqe(cq, srq, wqe_index);
+		if (srq->replenish)
+			mlx4_srq_replenish_hold(srq->replenish, *wc_wr_id);
 	} else {
 		wq = &(*cur_qp)->rq;
-		*wc_wr_id = wq->wrid[wq->tail & (wq->wqe_cnt - 1)];
+		*wc_wr_id = mlx4_get_wrid(wq);
+		/* Ring buffers are the application's until released */
+		if ((*cur_qp)->recv_ring) {
+			wqe_index = wq->tail & (wq->wqe_cnt - 1);
+			(*cur_qp)->recv_ring->state[wqe_index] = MLX4_RING_HELD;
+		}
 		++wq->tail;
 	}
 
@@ -288,7 +354,7 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 	int err;
 
 	err = mlx4_handle_cq(cq, cur_qp, &wc->wr_id, &wc->status,
-			     &wc->vendor_err, &cqe, &qpn, &is_send);
+			     &wc->vendor_err, &cqe, &qpn, &is_send, NULL);
 	if (err != CQ_CONTINUE)
 		return err;
 
@@ -311,10 +377,12 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 			wc->byte_len  = ntohl(cqe->byte_cnt);
 			break;
 		case MLX4_OPCODE_ATOMIC_CS:
+		case MLX4_OPCODE_MASKED_ATOMIC_CS:
 			wc->opcode    = IBV_WC_COMP_SWAP;
 			wc->byte_len  = 8;
 			break;
 		case MLX4_OPCODE_ATOMIC_FA:
+		case MLX4_OPCODE_MASKED_ATOMIC_FA:
 			wc->opcode    = IBV_WC_FETCH_ADD;
 			wc->byte_len  = 8;
 			break;
@@ -370,6 +438,34 @@ static int mlx4_poll_one(struct mlx4_cq *cq,
 	return CQ_OK;
 }
 
+static inline uint64_t mlx4_cqe_timestamp(struct mlx4_cqe *cqe)
+{
+	uint16_t timestamp_0_15 = cqe->timestamp_0_7 |
+		cqe->timestamp_8_15 << 8;
+
+	return (((uint64_t)ntohl(cqe->timestamp_16_47) + !timestamp_0_15) << 16) |
+		(uint64_t)timestamp_0_15;
+}
+
+/* Decode the CQE status word into enum mlx4dv_wc_pkt_type bits */
+static inline uint16_t mlx4_cqe_pkt_type(struct mlx4_cqe *cqe)
+{
+	uint32_t status = ntohl(cqe->status);
+
+	return (status & MLX4_CQE_STATUS_IPV4_PKT ? MLX4DV_WC_PKT_IPV4 : 0) |
+		(status & MLX4_CQE_STATUS_IPV4_FRAG ?
+		 MLX4DV_WC_PKT_IPV4_FRAG : 0) |
+		(status & MLX4_CQE_STATUS_IPV6_PKT ? MLX4DV_WC_PKT_IPV6 : 0) |
+		(status & MLX4_CQE_STATUS_IPV4_OPT ?
+		 MLX4DV_WC_PKT_IPV4_OPT : 0) |
+		(status & MLX4_CQE_STATUS_TCP_PKT ? MLX4DV_WC_PKT_TCP : 0) |
+		(status & MLX4_CQE_STATUS_UDP_PKT ? MLX4DV_WC_PKT_UDP : 0) |
+		(status & MLX4_CQE_STATUS_IP_HDR_CSUM_OK ?
+		 MLX4DV_WC_PKT_L3_CSUM_OK : 0) |
+		(status & MLX4_CQE_STATUS_TCP_UDP_CSUM_OK ?
+		 MLX4DV_WC_PKT_L4_CSUM_OK : 0);
+}
+
 union wc_buffer {
 	uint8_t		*b8;
 	uint16_t	*b16;
@@ -402,23 +498,20 @@ static inline int _mlx4_poll_one_ex(struct mlx4_cq *cq,
 	union wc_buffer wc_buffer;
 	int err;
 	uint64_t wc_flags_out = 0;
+	uint16_t sq_retired;
 
 	wc_buffer.b64 = (uint64_t *)&wc_ex->buffer;
 	wc_ex->reserved = 0;
 	err = mlx4_handle_cq(cq, cur_qp, &wc_ex->wr_id, &wc_ex->status,
-			     &wc_ex->vendor_err, &cqe, &qpn, &is_send);
+			     &wc_ex->vendor_err, &cqe, &qpn, &is_send,
+			     &sq_retired);
 	if (err != CQ_CONTINUE)
 		return err;
 
 	if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 			   IBV_WC_EX_WITH_COMPLETION_TIMESTAMP)) {
-		uint16_t timestamp_0_15 = cqe->timestamp_0_7 |
-			cqe->timestamp_8_15 << 8;
-
 		wc_flags_out |= IBV_WC_EX_WITH_COMPLETION_TIMESTAMP;
-		*wc_buffer.b64++ = (((uint64_t)ntohl(cqe->timestamp_16_47)
-					     + !timestamp_0_15) << 16) |
-					   (uint64_t)timestamp_0_15;
+		*wc_buffer.b64++ = mlx4_cqe_timestamp(cqe);
 	}
 
 	if (is_send) {
@@ -457,6 +550,7 @@ static inline int _mlx4_poll_one_ex(struct mlx4_cq *cq,
 				wc_buffer.b32++;
 			break;
 		case MLX4_OPCODE_ATOMIC_CS:
+		case MLX4_OPCODE_MASKED_ATOMIC_CS:
 			wc_ex->opcode    = IBV_WC_COMP_SWAP;
 			if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 					   IBV_WC_EX_WITH_BYTE_LEN)) {
@@ -468,6 +562,7 @@ static inline int _mlx4_poll_one_ex(struct mlx4_cq *cq,
 				wc_buffer.b32++;
 			break;
 		case MLX4_OPCODE_ATOMIC_FA:
+		case MLX4_OPCODE_MASKED_ATOMIC_FA:
 			wc_ex->opcode    = IBV_WC_FETCH_ADD;
 			if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 					   IBV_WC_EX_WITH_BYTE_LEN)) {
@@ -507,12 +602,30 @@ static inline int _mlx4_poll_one_ex(struct mlx4_cq *cq,
 		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 				   IBV_WC_EX_WITH_SRC_QP))
 			wc_buffer.b32++;
+		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+				   MLX4DV_WC_EX_WITH_FLOW_HASH))
+			wc_buffer.b32++;
 		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 				   IBV_WC_EX_WITH_PKEY_INDEX))
 			wc_buffer.b16++;
 		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 				   IBV_WC_EX_WITH_SLID))
 			wc_buffer.b16++;
+		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+				   MLX4DV_WC_EX_WITH_VLAN))
+			wc_buffer.b16++;
+		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+				   MLX4DV_WC_EX_WITH_PKT_TYPE))
+			wc_buffer.b16++;
+		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+				   MLX4DV_WC_EX_WITH_SQ_RETIRED)) {
+			if ((*cur_qp)->create_flags &
+			    MLX4DV_QP_CREATE_AUTO_SIGNAL) {
+				*wc_buffer.b16 = sq_retired;
+				wc_flags_out |= MLX4DV_WC_EX_WITH_SQ_RETIRED;
+			}
+			wc_buffer.b16++;
+		}
 		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 				   IBV_WC_EX_WITH_SL))
 			wc_buffer.b8++;
@@ -564,6 +677,15 @@ static inline int _mlx4_poll_one_ex(struct mlx4_cq *cq,
 			*wc_buffer.b32++  = g_mlpath_rqpn & 0xffffff;
 			wc_flags_out |= IBV_WC_EX_WITH_SRC_QP;
 		}
+		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+				   MLX4DV_WC_EX_WITH_FLOW_HASH)) {
+			if ((*cur_qp) &&
+			    (*cur_qp)->verbs_qp.qp.qp_type == IBV_QPT_RAW_PACKET) {
+				*wc_buffer.b32 = ntohl(cqe->immed_rss_invalid);
+				wc_flags_out |= MLX4DV_WC_EX_WITH_FLOW_HASH;
+			}
+			wc_buffer.b32++;
+		}
 		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 				   IBV_WC_EX_WITH_PKEY_INDEX)) {
 			*wc_buffer.b16++  = ntohl(cqe->immed_rss_invalid) & 0x7f;
@@ -574,6 +696,29 @@ static inline int _mlx4_poll_one_ex(struct mlx4_cq *cq,
 			*wc_buffer.b16++  = ntohs(cqe->rlid);
 			wc_flags_out |= IBV_WC_EX_WITH_SLID;
 		}
+		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+				   MLX4DV_WC_EX_WITH_VLAN)) {
+			/* Timestamping CQEs reuse sl_vid for the timestamp */
+			if (!IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+					    IBV_WC_EX_WITH_COMPLETION_TIMESTAMP) &&
+			    ntohl(cqe->vlan_my_qpn) & MLX4_CQE_VLAN_PRESENT_MASK) {
+				*wc_buffer.b16 = ntohs(cqe->sl_vid);
+				wc_flags_out |= MLX4DV_WC_EX_WITH_VLAN;
+			}
+			wc_buffer.b16++;
+		}
+		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+				   MLX4DV_WC_EX_WITH_PKT_TYPE)) {
+			if ((*cur_qp) &&
+			    (*cur_qp)->link_layer == IBV_LINK_LAYER_ETHERNET) {
+				*wc_buffer.b16 = mlx4_cqe_pkt_type(cqe);
+				wc_flags_out |= MLX4DV_WC_EX_WITH_PKT_TYPE;
+			}
+			wc_buffer.b16++;
+		}
+		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
+				   MLX4DV_WC_EX_WITH_SQ_RETIRED))
+			wc_buffer.b16++;
 		if (IS_IN_WC_FLAGS(wc_flags_yes, wc_flags_no, wc_flags,
 				   IBV_WC_EX_WITH_SL)) {
 			wc_flags_out |= IBV_WC_EX_WITH_SL;
@@ -612,15 +757,15 @@ int mlx4_poll_one_ex(struct mlx4_cq *cq,
 	return _mlx4_poll_one_ex(cq, cur_qp, pwc_ex, wc_flags, 0, 0);
 }
 
-#define MLX4_POLL_ONE_EX_WC_FLAGS_NAME(wc_flags_yes, wc_flags_no) \
-	mlx4_poll_one_ex_custom##wc_flags_yes ## _ ## wc_flags_no
+#define MLX4_POLL_ONE_EX_WC_FLAGS_NAME(name) \
+	mlx4_poll_one_ex_custom_ ## name
 
 /* The compiler will create one function per wc_flags combination. Since
  * _mlx4_poll_one_ex  is always inlined (for compilers that supports that),
  * the compiler drops the if statements and merge all wc_flags_out ORs/ANDs.
  */
-#define MLX4_POLL_ONE_EX_WC_FLAGS(wc_flags_yes, wc_flags_no)	\
-static int MLX4_POLL_ONE_EX_WC_FLAGS_NAME(wc_flags_yes, wc_flags_no)	       \
+#define MLX4_POLL_ONE_EX_WC_FLAGS(name, wc_flags_yes, wc_flags_no)	       \
+static int MLX4_POLL_ONE_EX_WC_FLAGS_NAME(name)				       \
 						   (struct mlx4_cq *cq,        \
 						    struct mlx4_qp **cur_qp,   \
 						    struct ibv_wc_ex **pwc_ex, \
@@ -631,8 +776,7 @@ static int MLX4_POLL_ONE_EX_WC_FLAGS_NAME(wc_flags_yes, wc_flags_no)	       \
 }
 
 /*
- *	Since we use the preprocessor here, we have to calculate the Or value
- *	ourselves:
+ *	The standard profiles spell out the Or value of these flags:
  *	IBV_WC_EX_GRH			= 1 << 0,
  *	IBV_WC_EX_IMM			= 1 << 1,
  *	IBV_WC_EX_WITH_BYTE_LEN		= 1 << 2,
@@ -655,35 +799,66 @@ static int MLX4_POLL_ONE_EX_WC_FLAGS_NAME(wc_flags_yes, wc_flags_no)	       \
  * in the legacy WC).
  */
 #define SUPPORTED_WC_STD_FLAGS  1020
-
-#define OPTIMIZE_POLL_CQ	/* No options */			    \
-				OP(0, SUPPORTED_WC_ALL_FLAGS)		SEP \
-				/* All options */			    \
-				OP(SUPPORTED_WC_ALL_FLAGS, 0)		SEP \
-				/* All standard options */		    \
-				OP(SUPPORTED_WC_STD_FLAGS, 1024)	SEP \
-				/* Just Bytelen - for DPDK */		    \
-				OP(4, 1016)				SEP \
-				/* Timestmap only, for FSI */		    \
-				OP(1024, 1020)				SEP
+/* Fields raw Ethernet receive profiles never report */
+#define UNSUPPORTED_WC_RAW_ETH_FLAGS	(IBV_WC_EX_WITH_IMM		| \
+					 IBV_WC_EX_WITH_QP_NUM		| \
+					 IBV_WC_EX_WITH_SRC_QP		| \
+					 IBV_WC_EX_WITH_PKEY_INDEX	| \
+					 IBV_WC_EX_WITH_SLID		| \
+					 IBV_WC_EX_WITH_SL		| \
+					 IBV_WC_EX_WITH_DLID_PATH_BITS	| \
+					 MLX4DV_WC_EX_WITH_SQ_RETIRED)
+/* Raw Ethernet receive */
+#define SUPPORTED_WC_RAW_ETH_FLAGS	(IBV_WC_EX_WITH_BYTE_LEN	| \
+					 MLX4DV_WC_EX_WITH_FLOW_HASH	| \
+					 MLX4DV_WC_EX_WITH_VLAN		| \
+					 MLX4DV_WC_EX_WITH_PKT_TYPE)
+#define SUPPORTED_WC_RAW_ETH_NO		(UNSUPPORTED_WC_RAW_ETH_FLAGS	| \
+					 IBV_WC_EX_WITH_COMPLETION_TIMESTAMP)
+/*
+ * The same with the completion timestamp in place of the VLAN tag,
+ * which timestamping CQs can't report.
+ */
+#define SUPPORTED_WC_RAW_ETH_TS_FLAGS	(IBV_WC_EX_WITH_BYTE_LEN	| \
+					 MLX4DV_WC_EX_WITH_FLOW_HASH	| \
+					 MLX4DV_WC_EX_WITH_PKT_TYPE	| \
+					 IBV_WC_EX_WITH_COMPLETION_TIMESTAMP)
+#define SUPPORTED_WC_RAW_ETH_TS_NO	(UNSUPPORTED_WC_RAW_ETH_FLAGS	| \
+					 MLX4DV_WC_EX_WITH_VLAN)
+
+#define OPTIMIZE_POLL_CQ	/* No options */				\
+				OP(none, 0, SUPPORTED_WC_ALL_FLAGS)	    SEP \
+				/* All options */				\
+				OP(all, SUPPORTED_WC_ALL_FLAGS, 0)	    SEP \
+				/* All standard options */			\
+				OP(std, SUPPORTED_WC_STD_FLAGS, 1024)	    SEP \
+				/* Just Bytelen - for DPDK */			\
+				OP(byte_len, 4, 1016)			    SEP \
+				/* Timestmap only, for FSI */			\
+				OP(timestamp, 1024, 1020)		    SEP \
+				/* Raw Ethernet receive */			\
+				OP(raw_eth, SUPPORTED_WC_RAW_ETH_FLAGS,		\
+				   SUPPORTED_WC_RAW_ETH_NO)		    SEP \
+				/* Raw Ethernet receive with timestamp */	\
+				OP(raw_eth_ts, SUPPORTED_WC_RAW_ETH_TS_FLAGS,	\
+				   SUPPORTED_WC_RAW_ETH_TS_NO)		    SEP
 
 #define OP	MLX4_POLL_ONE_EX_WC_FLAGS
 #define SEP	;
 
 /* Declare optimized poll_one function for popular scenarios. Each function
- * has a name of
- * mlx4_poll_one_ex_custom<supported_wc_flags>_<not_supported_wc_flags>.
+ * has a name of mlx4_poll_one_ex_custom_<profile name>.
  * Since the supported and not supported wc_flags are given beforehand,
  * the compiler could optimize the if and or statements and create optimized
  * code.
  */
 OPTIMIZE_POLL_CQ
 
-#define ADD_POLL_ONE(_wc_flags_yes, _wc_flags_no)			\
+#define ADD_POLL_ONE(_name, _wc_flags_yes, _wc_flags_no)		\
 				{.wc_flags_yes = _wc_flags_yes,		\
 				 .wc_flags_no = _wc_flags_no,		\
 				 .fn = MLX4_POLL_ONE_EX_WC_FLAGS_NAME(  \
-					_wc_flags_yes, _wc_flags_no)	\
+					_name)				\
 				}
 
 #undef OP
@@ -779,6 +954,8 @@ int mlx4_poll_cq(struct ibv_cq *ibcq, int ne, struct ibv_wc *wc)
 	if (npolled || err == CQ_POLL_ERR)
 		update_cons_index(cq);
 
+	mlx4_flush_srq_wqes(cq);
+
 	pthread_spin_unlock(&cq->lock);
 
 	return err == CQ_POLL_ERR ? err : npolled;
@@ -812,11 +989,96 @@ int mlx4_poll_cq_ex(struct ibv_cq *ibcq,
 	if (npolled || err == CQ_POLL_ERR)
 		update_cons_index(cq);
 
+	mlx4_flush_srq_wqes(cq);
+
 	pthread_spin_unlock(&cq->lock);
 
 	return err == CQ_POLL_ERR ? err : npolled;
 }
 
+int mlx4dv_rx_burst(struct ibv_qp *ibqp, struct mlx4dv_rx_pkt *pkts, int num,
+		    int *polled)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_cq *cq = to_mcq(ibqp->recv_cq);
+	struct mlx4_cqe *cqe;
+	struct mlx4dv_rx_pkt *pkt;
+	uint32_t vlan_my_qpn;
+	int timestamp = !!(cq->wc_flags & IBV_WC_EX_WITH_COMPLETION_TIMESTAMP);
+	int csum = !!(qp->qp_cap_cache & MLX4_RX_CSUM_VALID);
+	int n;
+
+	*polled = 0;
+
+	if (!qp->rx_pool || num < 0)
+		return EINVAL;
+
+	pthread_spin_lock(&cq->lock);
+
+	for (n = 0; n < num; ++n) {
+		cqe = next_cqe_sw(cq);
+		if (!cqe)
+			break;
+
+		if (cq->cqe_size == 64)
+			++cqe;
+
+		VALGRIND_MAKE_MEM_DEFINED(cqe, sizeof(*cqe));
+
+		/*
+		 * Make sure we read CQ entry contents after we've checked the
+		 * ownership bit.
+		 */
+		rmb();
+
+		/* Leave anything but this QP's receives to mlx4_poll_cq() */
+		vlan_my_qpn = ntohl(cqe->vlan_my_qpn);
+		if ((vlan_my_qpn & MLX4_CQE_QPN_MASK) != ibqp->qp_num ||
+		    cqe->owner_sr_opcode & MLX4_CQE_IS_SEND_MASK)
+			break;
+
+		++cq->cons_index;
+
+		pkt = &pkts[n];
+		pkt->buf = (void *) (uintptr_t)
+			qp->rq.wrid[qp->rq.tail & (qp->rq.wqe_cnt - 1)];
+		++qp->rq.tail;
+
+		if ((cqe->owner_sr_opcode & MLX4_CQE_OPCODE_MASK) ==
+		    MLX4_CQE_OPCODE_ERROR) {
+			pkt->len   = 0;
+			pkt->flags = MLX4DV_RX_PKT_ERROR;
+			continue;
+		}
+
+		pkt->len       = ntohl(cqe->byte_cnt);
+		pkt->flow_hash = ntohl(cqe->immed_rss_invalid);
+		pkt->pkt_type  = csum ? mlx4_cqe_pkt_type(cqe) : 0;
+		pkt->flags     = 0;
+
+		/* Timestamping CQEs reuse sl_vid for the timestamp */
+		if (timestamp) {
+			pkt->timestamp = mlx4_cqe_timestamp(cqe);
+			pkt->flags |= MLX4DV_RX_PKT_TIMESTAMP;
+		} else if (vlan_my_qpn & MLX4_CQE_VLAN_PRESENT_MASK) {
+			pkt->vlan_tci = ntohs(cqe->sl_vid);
+			pkt->flags |= MLX4DV_RX_PKT_VLAN;
+		}
+	}
+
+	if (n)
+		update_cons_index(cq);
+
+	pthread_spin_unlock(&cq->lock);
+
+	if (n)
+		mlx4_rx_refill(qp);
+
+	*polled = n;
+
+	return 0;
+}
+
 int mlx4_arm_cq(struct ibv_cq *ibvcq, int solicited)
 {
 	struct mlx4_cq *cq = to_mcq(ibvcq);
@@ -946,13 +1208,16 @@ void mlx4_cq_resize_copy_cqes(struct mlx4_cq *cq, void *buf, int old_cqe)
 	++cq->cons_index;
 }
 
-int mlx4_alloc_cq_buf(struct mlx4_device *dev, struct mlx4_buf *buf, int nent,
-		      int entry_size)
+int mlx4_alloc_cq_buf(struct mlx4_context *context, struct mlx4_buf *buf,
+		      int nent, int entry_size, int numa_node)
 {
-	if (mlx4_alloc_buf(buf, align(nent * entry_size, dev->page_size),
-			   dev->page_size))
+	if (mlx4_alloc_queue_buf(context, buf, nent * entry_size,
+				 context->buf_flags, numa_node))
 		return -1;
-	memset(buf->buf, 0, nent * entry_size);
+
+	/* A fresh mapping is already zero, no need to fault it all in */
+	if (!(buf->flags & MLX4_BUF_ZEROED))
+		memset(buf->buf, 0, nent * entry_size);
 
 	return 0;
 }
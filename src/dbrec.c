@@ -41,114 +41,224 @@
 
 #include "mlx4.h"
 
+/*
+ * Doorbell records are carved out of pages kept per record type.  Each
+ * type has its own lock and a list of the pages that still have a free
+ * record, so allocation never scans full pages.  The first records of
+ * every page hold a pointer back to its mlx4_db_page, which lets
+ * mlx4_free_db() find the page from the record's address alone.
+ */
 struct mlx4_db_page {
 	struct mlx4_db_page	       *prev, *next;
 	struct mlx4_buf			buf;
+	enum mlx4_db_type		type;
 	int				num_db;
 	int				use_cnt;
 	unsigned long			free[0];
 };
 
 static const int db_size[] = {
-	[MLX4_DB_TYPE_CQ] = 8,
-	[MLX4_DB_TYPE_RQ] = 4,
+	[MLX4_DB_TYPE_CQ]	   = 8,
+	[MLX4_DB_TYPE_RQ]	   = 4,
+	[MLX4_DB_TYPE_CQ_ISOLATED] = MLX4_CACHELINE_SIZE,
+	[MLX4_DB_TYPE_RQ_ISOLATED] = MLX4_CACHELINE_SIZE,
 };
 
+/* Records reserved at the start of each page for the back pointer */
+static int db_hdr_slots(enum mlx4_db_type type)
+{
+	return (sizeof (struct mlx4_db_page *) + db_size[type] - 1) /
+		db_size[type];
+}
+
+static void db_list_add(struct mlx4_db_pool *pool, struct mlx4_db_page *page)
+{
+	page->prev = NULL;
+	page->next = pool->partial;
+	pool->partial = page;
+	if (page->next)
+		page->next->prev = page;
+}
+
+static void db_list_del(struct mlx4_db_pool *pool, struct mlx4_db_page *page)
+{
+	if (page->prev)
+		page->prev->next = page->next;
+	else
+		pool->partial = page->next;
+	if (page->next)
+		page->next->prev = page->prev;
+}
+
 static struct mlx4_db_page *__add_page(struct mlx4_context *context,
 				       enum mlx4_db_type type)
 {
 	struct mlx4_db_page *page;
 	int ps = to_mdev(context->ibv_ctx.device)->page_size;
+	int hdr = db_hdr_slots(type);
 	int pp;
 	int i;
 
 	pp = ps / db_size[type];
 
-	page = malloc(sizeof *page + pp / 8);
+	/* The free bitmap is at least one long even for isolated records */
+	page = malloc(sizeof *page + align(pp, 8 * sizeof (long)) / 8);
 	if (!page)
 		return NULL;
 
-	if (mlx4_alloc_buf(&page->buf, ps, ps)) {
+	if (mlx4_alloc_buf(&page->buf, ps, ps, 0,
+			   to_mdev(context->ibv_ctx.device)->numa_node)) {
 		free(page);
 		return NULL;
 	}
 
-	page->num_db  = pp;
+	*(struct mlx4_db_page **) page->buf.buf = page;
+
+	page->type    = type;
+	page->num_db  = pp - hdr;
 	page->use_cnt = 0;
 	for (i = 0; i < pp / (sizeof (long) * 8); ++i)
 		page->free[i] = ~0;
+	if (pp % (sizeof (long) * 8))
+		page->free[i] = (1UL << (pp % (sizeof (long) * 8))) - 1;
+	page->free[0] &= ~((1UL << hdr) - 1);
 
-	page->prev = NULL;
-	page->next = context->db_list[type];
-	context->db_list[type] = page;
-	if (page->next)
-		page->next->prev = page;
+	db_list_add(&context->db_pool[type], page);
 
 	return page;
 }
 
-uint32_t *mlx4_alloc_db(struct mlx4_context *context, enum mlx4_db_type type)
+void mlx4_init_db_pools(struct mlx4_context *context)
+{
+	int i;
+
+	for (i = 0; i < MLX4_NUM_DB_TYPE; ++i) {
+		pthread_mutex_init(&context->db_pool[i].lock, NULL);
+		context->db_pool[i].partial   = NULL;
+		context->db_pool[i].num_empty = 0;
+	}
+}
+
+/*
+ * Free the pages left on the partial lists.  Pages whose records are
+ * all still in use belong to objects the application never destroyed.
+ */
+void mlx4_cleanup_db_pools(struct mlx4_context *context)
 {
 	struct mlx4_db_page *page;
-	uint32_t *db = NULL;
-	int i, j;
+	int i;
 
-	pthread_mutex_lock(&context->db_list_mutex);
+	for (i = 0; i < MLX4_NUM_DB_TYPE; ++i) {
+		while ((page = context->db_pool[i].partial)) {
+			context->db_pool[i].partial = page->next;
+			mlx4_free_buf(&page->buf);
+			free(page);
+		}
+		pthread_mutex_destroy(&context->db_pool[i].lock);
+	}
+}
 
-	for (page = context->db_list[type]; page; page = page->next)
-		if (page->use_cnt < page->num_db)
-			goto found;
+static uint32_t *__alloc_db(struct mlx4_context *context,
+			    enum mlx4_db_type type)
+{
+	struct mlx4_db_pool *pool = &context->db_pool[type];
+	struct mlx4_db_page *page;
+	int i, j;
 
-	page = __add_page(context, type);
-	if (!page)
-		goto out;
+	page = pool->partial;
+	if (!page) {
+		page = __add_page(context, type);
+		if (!page)
+			return NULL;
+	} else if (!page->use_cnt) {
+		--pool->num_empty;
+	}
 
-found:
-	++page->use_cnt;
+	if (++page->use_cnt == page->num_db)
+		db_list_del(pool, page);
 
 	for (i = 0; !page->free[i]; ++i)
 		/* nothing */;
 
 	j = ffsl(page->free[i]);
 	page->free[i] &= ~(1UL << (j - 1));
-	db = page->buf.buf + (i * 8 * sizeof (long) + (j - 1)) * db_size[type];
-
-out:
-	pthread_mutex_unlock(&context->db_list_mutex);
-
-	return db;
+	return page->buf.buf + (i * 8 * sizeof (long) + (j - 1)) * db_size[type];
 }
 
-void mlx4_free_db(struct mlx4_context *context, enum mlx4_db_type type, uint32_t *db)
+static void __free_db(struct mlx4_context *context, uint32_t *db)
 {
+	struct mlx4_db_pool *pool;
 	struct mlx4_db_page *page;
 	uintptr_t ps = to_mdev(context->ibv_ctx.device)->page_size;
 	int i;
 
-	pthread_mutex_lock(&context->db_list_mutex);
-
-	for (page = context->db_list[type]; page; page = page->next)
-		if (((uintptr_t) db & ~(ps - 1)) == (uintptr_t) page->buf.buf)
-			break;
-
-	if (!page)
-		goto out;
+	page = *(struct mlx4_db_page **) ((uintptr_t) db & ~(ps - 1));
+	pool = &context->db_pool[page->type];
 
-	i = ((void *) db - page->buf.buf) / db_size[type];
+	i = ((void *) db - page->buf.buf) / db_size[page->type];
 	page->free[i / (8 * sizeof (long))] |= 1UL << (i % (8 * sizeof (long)));
 
-	if (!--page->use_cnt) {
-		if (page->prev)
-			page->prev->next = page->next;
-		else
-			context->db_list[type] = page->next;
-		if (page->next)
-			page->next->prev = page->prev;
+	if (page->use_cnt-- == page->num_db)
+		db_list_add(pool, page);
 
+	/* Keep one empty page per type around for the next allocation */
+	if (!page->use_cnt && pool->num_empty++) {
+		--pool->num_empty;
+		db_list_del(pool, page);
 		mlx4_free_buf(&page->buf);
 		free(page);
 	}
+}
+
+uint32_t *mlx4_alloc_db(struct mlx4_context *context, enum mlx4_db_type type)
+{
+	struct mlx4_db_pool *pool = &context->db_pool[type];
+	uint32_t *db;
+
+	pthread_mutex_lock(&pool->lock);
+	db = __alloc_db(context, type);
+	pthread_mutex_unlock(&pool->lock);
+
+	return db;
+}
+
+/*
+ * Allocate num records of one type under a single lock acquisition,
+ * all or none.
+ */
+int mlx4_alloc_dbs(struct mlx4_context *context, enum mlx4_db_type type,
+		   uint32_t **dbs, int num)
+{
+	struct mlx4_db_pool *pool = &context->db_pool[type];
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (i = 0; i < num; ++i) {
+		dbs[i] = __alloc_db(context, type);
+		if (!dbs[i]) {
+			while (i--)
+				__free_db(context, dbs[i]);
+			pthread_mutex_unlock(&pool->lock);
+			return -1;
+		}
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+void mlx4_free_db(struct mlx4_context *context, uint32_t *db)
+{
+	uintptr_t ps = to_mdev(context->ibv_ctx.device)->page_size;
+	struct mlx4_db_page *page;
+	struct mlx4_db_pool *pool;
+
+	page = *(struct mlx4_db_page **) ((uintptr_t) db & ~(ps - 1));
+	pool = &context->db_pool[page->type];
 
-out:
-	pthread_mutex_unlock(&context->db_list_mutex);
+	pthread_mutex_lock(&pool->lock);
+	__free_db(context, db);
+	pthread_mutex_unlock(&pool->lock);
 }
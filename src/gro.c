@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2016 Mellanox Technologies Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <net/ethernet.h>
+
+#include "mlx4.h"
+
+/*
+ * Software GRO for raw packet QPs.  Packets come from mlx4dv_rx_burst();
+ * in order TCP segments of a flow are held and chained until the flow
+ * is flushed by size, by age, or by a segment that can't be merged.
+ */
+
+enum {
+	GRO_PKT_MERGEABLE = MLX4DV_WC_PKT_IPV4 | MLX4DV_WC_PKT_TCP |
+			    MLX4DV_WC_PKT_L3_CSUM_OK | MLX4DV_WC_PKT_L4_CSUM_OK,
+	GRO_MAX_IP_LEN	  = 65535,
+	GRO_PROBE	  = 4
+};
+
+struct gro_flow {
+	struct mlx4dv_gro_pkt		pkt;
+	uint32_t			saddr;
+	uint32_t			daddr;
+	uint16_t			sport;
+	uint16_t			dport;
+	uint32_t			ack_seq;
+	uint32_t			next_seq;
+	uint16_t			window;
+	uint8_t				psh;
+	uint8_t				in_use;
+	int				hdr_len;
+	int				ip_len;
+	uint64_t			start_ns;
+};
+
+struct mlx4dv_gro {
+	struct mlx4dv_gro_attr		attr;
+	struct mlx4dv_gro_stats		stats;
+	struct gro_flow		       *flows;
+	struct mlx4dv_gro_seg	       *flow_segs;
+	struct mlx4dv_gro_seg	       *out_segs;
+	struct mlx4dv_rx_pkt	       *rx;
+	int				num_held;
+};
+
+static uint64_t gro_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint16_t ip_csum(void *hdr, int len)
+{
+	uint16_t *p = hdr;
+	uint32_t sum = 0;
+
+	for (; len > 1; len -= 2)
+		sum += *p++;
+
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += sum >> 16;
+
+	return ~sum;
+}
+
+struct mlx4dv_gro *mlx4dv_gro_create(struct mlx4dv_gro_attr *attr)
+{
+	struct mlx4dv_gro *gro;
+	int i;
+
+	if (!attr->max_burst || !attr->max_flows || attr->max_segs < 2 ||
+	    !attr->max_size || attr->max_size > GRO_MAX_IP_LEN) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	gro = calloc(1, sizeof *gro);
+	if (!gro)
+		return NULL;
+
+	gro->attr      = *attr;
+	gro->attr.max_flows = align_queue_size(attr->max_flows);
+
+	gro->flows     = calloc(gro->attr.max_flows, sizeof *gro->flows);
+	gro->flow_segs = calloc(gro->attr.max_flows * attr->max_segs,
+				sizeof *gro->flow_segs);
+	gro->out_segs  = calloc(attr->max_burst * attr->max_segs,
+				sizeof *gro->out_segs);
+	gro->rx	       = calloc(attr->max_burst, sizeof *gro->rx);
+	if (!gro->flows || !gro->flow_segs || !gro->out_segs || !gro->rx) {
+		mlx4dv_gro_destroy(gro);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	for (i = 0; i < gro->attr.max_flows; ++i)
+		gro->flows[i].pkt.segs = gro->flow_segs + i * attr->max_segs;
+
+	return gro;
+}
+
+void mlx4dv_gro_destroy(struct mlx4dv_gro *gro)
+{
+	free(gro->rx);
+	free(gro->out_segs);
+	free(gro->flow_segs);
+	free(gro->flows);
+	free(gro);
+}
+
+void mlx4dv_gro_query_stats(struct mlx4dv_gro *gro,
+			    struct mlx4dv_gro_stats *stats)
+{
+	*stats = gro->stats;
+}
+
+/*
+ * Emit a packet made of a single segment into out.
+ */
+static void gro_emit_pkt(struct mlx4dv_gro *gro, struct mlx4dv_rx_pkt *pkt,
+			 struct mlx4dv_gro_pkt *out, int n)
+{
+	out->pkt	 = *pkt;
+	out->nsegs	 = 1;
+	out->segs	 = gro->out_segs + n * gro->attr.max_segs;
+	out->segs[0].buf = pkt->buf;
+	out->segs[0].off = 0;
+	out->segs[0].len = pkt->len;
+
+	++gro->stats.pkts_out;
+}
+
+/*
+ * Emit a held flow into out, fixing up the first segment's headers to
+ * describe the merged packet.
+ */
+static void gro_flush_flow(struct mlx4dv_gro *gro, struct gro_flow *flow,
+			   struct mlx4dv_gro_pkt *out, int n)
+{
+	struct iphdr *ip;
+	struct tcphdr *th;
+
+	if (flow->pkt.nsegs > 1) {
+		ip = flow->pkt.pkt.buf + ETH_HLEN;
+		th = (void *) ip + sizeof *ip;
+
+		ip->tot_len = htons(flow->ip_len);
+		ip->check   = 0;
+		ip->check   = ip_csum(ip, sizeof *ip);
+
+		th->window = flow->window;
+		th->psh	  |= flow->psh;
+	}
+
+	out->pkt   = flow->pkt.pkt;
+	out->nsegs = flow->pkt.nsegs;
+	out->segs  = gro->out_segs + n * gro->attr.max_segs;
+	memcpy(out->segs, flow->pkt.segs, flow->pkt.nsegs * sizeof *out->segs);
+
+	flow->in_use = 0;
+	--gro->num_held;
+	++gro->stats.pkts_out;
+}
+
+/*
+ * Parse an IPv4/TCP packet that the HCA already checksummed.  Returns
+ * the TCP payload length, or -1 if the packet can't be merged.
+ */
+static int gro_parse(struct mlx4dv_rx_pkt *pkt, struct iphdr **pip,
+		     struct tcphdr **pth, int *hdr_len)
+{
+	struct ether_header *eth = pkt->buf;
+	struct iphdr *ip;
+	struct tcphdr *th;
+	int ip_len;
+
+	if (pkt->flags & MLX4DV_RX_PKT_ERROR ||
+	    (pkt->pkt_type & (GRO_PKT_MERGEABLE | MLX4DV_WC_PKT_IPV4_FRAG |
+			      MLX4DV_WC_PKT_IPV4_OPT)) != GRO_PKT_MERGEABLE ||
+	    pkt->len < ETH_HLEN + sizeof *ip + sizeof *th ||
+	    eth->ether_type != htons(ETHERTYPE_IP))
+		return -1;
+
+	ip = (void *) eth + ETH_HLEN;
+	th = (void *) ip + sizeof *ip;
+	ip_len = ntohs(ip->tot_len);
+
+	if (ip->ihl != 5 || ip_len > pkt->len - ETH_HLEN ||
+	    th->doff < 5 || th->syn || th->fin || th->rst || th->urg ||
+	    !th->ack || ip_len < sizeof *ip + th->doff * 4)
+		return -1;
+
+	*pip	 = ip;
+	*pth	 = th;
+	*hdr_len = ETH_HLEN + sizeof *ip + th->doff * 4;
+
+	return ip_len - sizeof *ip - th->doff * 4;
+}
+
+/*
+ * Flows are kept in a table indexed by the RSS hash the HCA computed,
+ * each within GRO_PROBE slots of its hash's own.  Returns the packet's
+ * flow, or NULL with *slot set to where a new flow for it goes: a free
+ * slot if there is one, else the oldest flow, to be flushed first.
+ */
+static struct gro_flow *gro_find_flow(struct mlx4dv_gro *gro,
+				      struct mlx4dv_rx_pkt *pkt,
+				      struct iphdr *ip, struct tcphdr *th,
+				      struct gro_flow **slot)
+{
+	struct gro_flow *flow;
+	struct gro_flow *oldest = NULL;
+	int i;
+
+	*slot = NULL;
+
+	for (i = 0; i < GRO_PROBE; ++i) {
+		flow = &gro->flows[(pkt->flow_hash + i) &
+				   (gro->attr.max_flows - 1)];
+		if (!flow->in_use) {
+			if (!*slot)
+				*slot = flow;
+			continue;
+		}
+
+		if (flow->pkt.pkt.flow_hash == pkt->flow_hash &&
+		    flow->saddr == ip->saddr && flow->daddr == ip->daddr &&
+		    flow->sport == th->source && flow->dport == th->dest)
+			return flow;
+
+		if (!oldest || flow->start_ns < oldest->start_ns)
+			oldest = flow;
+	}
+
+	if (!*slot)
+		*slot = oldest;
+
+	return NULL;
+}
+
+static int gro_can_merge(struct mlx4dv_gro *gro, struct gro_flow *flow,
+			 struct mlx4dv_rx_pkt *pkt, struct tcphdr *th,
+			 int hdr_len, int payload)
+{
+	struct tcphdr *th0 = flow->pkt.pkt.buf + ETH_HLEN + sizeof (struct iphdr);
+
+	return payload > 0 &&
+		hdr_len == flow->hdr_len &&
+		ntohl(th->seq) == flow->next_seq &&
+		th->ack_seq == flow->ack_seq &&
+		(pkt->flags & MLX4DV_RX_PKT_VLAN) ==
+		(flow->pkt.pkt.flags & MLX4DV_RX_PKT_VLAN) &&
+		(!(pkt->flags & MLX4DV_RX_PKT_VLAN) ||
+		 pkt->vlan_tci == flow->pkt.pkt.vlan_tci) &&
+		flow->pkt.nsegs < gro->attr.max_segs &&
+		flow->ip_len + payload <= gro->attr.max_size &&
+		!memcmp(th + 1, th0 + 1, th->doff * 4 - sizeof *th);
+}
+
+static void gro_hold_flow(struct gro_flow *flow, struct mlx4dv_rx_pkt *pkt,
+			  struct iphdr *ip, struct tcphdr *th, int hdr_len,
+			  int payload, uint64_t now)
+{
+	flow->pkt.pkt	      = *pkt;
+	flow->pkt.nsegs	      = 1;
+	flow->pkt.segs[0].buf = pkt->buf;
+	flow->pkt.segs[0].off = 0;
+	flow->pkt.segs[0].len = hdr_len + payload;
+	flow->pkt.pkt.len     = hdr_len + payload;
+	flow->saddr	      = ip->saddr;
+	flow->daddr	      = ip->daddr;
+	flow->sport	      = th->source;
+	flow->dport	      = th->dest;
+	flow->ack_seq	      = th->ack_seq;
+	flow->next_seq	      = ntohl(th->seq) + payload;
+	flow->window	      = th->window;
+	flow->psh	      = th->psh;
+	flow->hdr_len	      = hdr_len;
+	flow->ip_len	      = ntohs(ip->tot_len);
+	flow->start_ns	      = now;
+	flow->in_use	      = 1;
+}
+
+int mlx4dv_gro_rx_burst(struct mlx4dv_gro *gro, struct ibv_qp *qp,
+			struct mlx4dv_gro_pkt *pkts, int num, int *polled)
+{
+	struct gro_flow *flow;
+	struct gro_flow *slot;
+	struct mlx4dv_rx_pkt *pkt;
+	struct mlx4dv_gro_seg *seg;
+	struct iphdr *ip;
+	struct tcphdr *th;
+	uint64_t now;
+	int hdr_len;
+	int payload;
+	int nrx;
+	int ret;
+	int n = 0;
+	int i;
+
+	*polled = 0;
+
+	if (num > gro->attr.max_burst)
+		num = gro->attr.max_burst;
+
+	now = gro_now();
+
+	/* Flows that have been held too long go out first */
+	if (gro->attr.flush_ns)
+		for (i = 0; i < gro->attr.max_flows && n < num; ++i)
+			if (gro->flows[i].in_use &&
+			    now - gro->flows[i].start_ns >= gro->attr.flush_ns) {
+				gro_flush_flow(gro, &gro->flows[i], pkts + n, n);
+				++n;
+				++gro->stats.flush_time;
+			}
+
+	/*
+	 * Every packet read may push at most one packet out, and the
+	 * flows still held need room to be flushed at the end.
+	 */
+	nrx = num - n - gro->num_held;
+	if (nrx <= 0)
+		goto flush;
+
+	/* Flows flushed above are still handed out */
+	ret = mlx4dv_rx_burst(qp, gro->rx, nrx, &nrx);
+	if (ret) {
+		*polled = n;
+		return ret;
+	}
+
+	gro->stats.pkts_in += nrx;
+
+	for (i = 0; i < nrx; ++i) {
+		pkt = &gro->rx[i];
+
+		payload = gro_parse(pkt, &ip, &th, &hdr_len);
+		if (payload < 0) {
+			gro_emit_pkt(gro, pkt, pkts + n, n);
+			++n;
+			continue;
+		}
+
+		flow = gro_find_flow(gro, pkt, ip, th, &slot);
+		if (flow && gro_can_merge(gro, flow, pkt, th, hdr_len, payload)) {
+			seg = &flow->pkt.segs[flow->pkt.nsegs++];
+			seg->buf = pkt->buf;
+			seg->off = hdr_len;
+			seg->len = payload;
+
+			flow->pkt.pkt.len += payload;
+			flow->ip_len	  += payload;
+			flow->next_seq	  += payload;
+			flow->window	   = th->window;
+			flow->psh	  |= th->psh;
+			++gro->stats.merged;
+
+			if (flow->pkt.nsegs == gro->attr.max_segs) {
+				gro_flush_flow(gro, flow, pkts + n, n);
+				++n;
+				++gro->stats.flush_size;
+			}
+			continue;
+		}
+
+		/* Keep the flow in order: what was held goes out first */
+		if (flow) {
+			gro_flush_flow(gro, flow, pkts + n, n);
+			++n;
+			slot = flow;
+		}
+
+		if (!payload) {
+			gro_emit_pkt(gro, pkt, pkts + n, n);
+			++n;
+			continue;
+		}
+
+		if (slot->in_use) {
+			gro_flush_flow(gro, slot, pkts + n, n);
+			++n;
+		}
+
+		gro_hold_flow(slot, pkt, ip, th, hdr_len, payload, now);
+		++gro->num_held;
+	}
+
+flush:
+	if (!gro->attr.flush_ns)
+		for (i = 0; i < gro->attr.max_flows; ++i)
+			if (gro->flows[i].in_use) {
+				gro_flush_flow(gro, &gro->flows[i], pkts + n, n);
+				++n;
+			}
+
+	*polled = n;
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2016 Mellanox Technologies Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <errno.h>
+
+#include "mlx4.h"
+
+/*
+ * Objects by QPN or SRQN.  The root has one slot per 2^12 numbers and
+ * two levels of 64 slot nodes below it are allocated only where
+ * objects have lived, so memory follows the numbers in use rather than
+ * the size of the QPN space.
+ *
+ * Writers are serialized by the caller.  Readers take no lock and
+ * never wait, whether or not their key is present: nodes are published
+ * only once initialized, and stay linked until the index is cleaned up
+ * with the context.  Without a grace period readers could be waiting
+ * on, an emptied node can't be freed or reused for other numbers while
+ * a lookup may still be inside it.  The kernel hands out numbers from
+ * a compact range and reuses them, so the nodes an application leaves
+ * behind are those of its peak.
+ */
+
+static int root_index(uint32_t key)
+{
+	return key >> (2 * MLX4_INDEX_NODE_BITS);
+}
+
+static int mid_index(uint32_t key)
+{
+	return (key >> MLX4_INDEX_NODE_BITS) & MLX4_INDEX_NODE_MASK;
+}
+
+int mlx4_index_init(struct mlx4_index *index, int size)
+{
+	index->mask = size - 1;
+	index->root = calloc(root_index(index->mask) + 1, sizeof *index->root);
+
+	return index->root ? 0 : ENOMEM;
+}
+
+void mlx4_index_cleanup(struct mlx4_index *index)
+{
+	struct mlx4_index_node *mid;
+	int i, j;
+
+	for (i = 0; i <= root_index(index->mask); ++i) {
+		mid = index->root[i];
+		if (!mid)
+			continue;
+
+		for (j = 0; j < MLX4_INDEX_NODE_SIZE; ++j)
+			free(mid->slot[j]);
+		free(mid);
+	}
+
+	free(index->root);
+}
+
+static struct mlx4_index_node *get_node(void **slot)
+{
+	struct mlx4_index_node *node = *slot;
+
+	if (node)
+		return node;
+
+	node = calloc(1, sizeof *node);
+	if (!node)
+		return NULL;
+
+	/* Readers may follow the pointer as soon as it is stored */
+	wmb();
+	*slot = node;
+
+	return node;
+}
+
+int mlx4_index_insert(struct mlx4_index *index, uint32_t key, void *obj)
+{
+	struct mlx4_index_node *mid;
+	struct mlx4_index_node *leaf;
+
+	key &= index->mask;
+
+	mid = get_node((void **) &index->root[root_index(key)]);
+	if (!mid)
+		return -1;
+
+	leaf = get_node(&mid->slot[mid_index(key)]);
+	if (!leaf)
+		return -1;
+
+	/* The object is initialized before readers can find it */
+	wmb();
+	leaf->slot[key & MLX4_INDEX_NODE_MASK] = obj;
+
+	return 0;
+}
+
+void mlx4_index_remove(struct mlx4_index *index, uint32_t key)
+{
+	struct mlx4_index_node *mid;
+	struct mlx4_index_node *leaf;
+
+	key &= index->mask;
+	mid = index->root[root_index(key)];
+	if (!mid)
+		return;
+
+	leaf = mid->slot[mid_index(key)];
+	if (leaf)
+		leaf->slot[key & MLX4_INDEX_NODE_MASK] = NULL;
+}
@@ -114,7 +114,8 @@ static struct ibv_context_ops mlx4_ctx_ops = {
 	.create_ah     = mlx4_create_ah,
 	.destroy_ah    = mlx4_destroy_ah,
 	.attach_mcast  = ibv_cmd_attach_mcast,
-	.detach_mcast  = ibv_cmd_detach_mcast
+	.detach_mcast  = ibv_cmd_detach_mcast,
+	.async_event   = mlx4_async_event
 };
 
 static int mlx4_map_internal_clock(struct mlx4_device *dev,
@@ -145,7 +146,6 @@ static int mlx4_init_context(struct verbs_device *v_device,
 	struct mlx4_context	       *context;
 	struct ibv_get_context		cmd;
 	struct mlx4_alloc_ucontext_resp resp;
-	int				i;
 	struct mlx4_alloc_ucontext_resp_v3 resp_v3;
 	__u16				bf_reg_size;
 	struct mlx4_device              *dev = to_mdev(&v_device->device);
@@ -154,6 +154,7 @@ static int mlx4_init_context(struct verbs_device *v_device,
 	struct ibv_device_attr_ex	dev_attrs;
 	uint32_t			dev_attrs_comp_mask;
 	int				err;
+	char			       *env;
 
 	/* memory footprint of mlx4_context and verbs_context share
 	* struct ibv_context.
@@ -182,20 +183,17 @@ static int mlx4_init_context(struct verbs_device *v_device,
 			context->cqe_size = sizeof (struct mlx4_cqe);
 	}
 
-	context->qp_table_shift = ffs(context->num_qps) - 1 - MLX4_QP_TABLE_BITS;
-	context->qp_table_mask	= (1 << context->qp_table_shift) - 1;
-	for (i = 0; i < MLX4_PORTS_NUM; ++i)
-		context->port_query_cache[i].valid = 0;
+	mlx4_init_attr_cache(context);
 
 	pthread_mutex_init(&context->qp_table_mutex, NULL);
-	for (i = 0; i < MLX4_QP_TABLE_SIZE; ++i)
-		context->qp_table[i].refcnt = 0;
+	pthread_cond_init(&context->qp_table_cond, NULL);
+	if (mlx4_index_init(&context->qp_table, context->num_qps))
+		return ENOMEM;
 
-	for (i = 0; i < MLX4_NUM_DB_TYPE; ++i)
-		context->db_list[i] = NULL;
+	mlx4_init_db_pools(context);
 
-	mlx4_init_xsrq_table(&context->xsrq_table, context->num_qps);
-	pthread_mutex_init(&context->db_list_mutex, NULL);
+	if (mlx4_init_xsrq_table(&context->xsrq_table, context->num_qps))
+		return ENOMEM;
 
 	context->uar = mmap(NULL, dev->page_size, PROT_WRITE,
 			    MAP_SHARED, cmd_fd, 0);
@@ -221,6 +219,20 @@ static int mlx4_init_context(struct verbs_device *v_device,
 		context->bf_buf_size = 0;
 	}
 
+	mlx4_init_buf_cache(context);
+	mlx4_init_mr_cache(context);
+
+	context->buf_flags = 0;
+	env = getenv("MLX4_HUGE_BUF");
+	if (env && atoi(env))
+		context->buf_flags |= MLX4_BUF_HUGE;
+	env = getenv("MLX4_POPULATE_BUF");
+	if (env && atoi(env))
+		context->buf_flags |= MLX4_BUF_POPULATE;
+
+	env = getenv("MLX4_ISOLATED_DB");
+	context->db_isolated = env && atoi(env);
+
 	context->hca_core_clock = NULL;
 	err = _mlx4_query_device_ex(ibv_ctx, &input_query_device, &dev_attrs,
 				    sizeof(dev_attrs), &dev_attrs_comp_mask);
@@ -254,6 +266,12 @@ static void mlx4_uninit_context(struct verbs_device *v_device,
 {
 	struct mlx4_context *context = to_mctx(ibv_ctx);
 
+	mlx4_cleanup_attr_cache(context);
+	mlx4_cleanup_mr_cache(context);
+	mlx4_cleanup_buf_cache(context);
+	mlx4_cleanup_db_pools(context);
+	mlx4_cleanup_xsrq_table(&context->xsrq_table);
+	mlx4_index_cleanup(&context->qp_table);
 	munmap(context->uar, to_mdev(&v_device->device)->page_size);
 	if (context->bf_page)
 		munmap(context->bf_page, to_mdev(&v_device->device)->page_size);
@@ -308,6 +326,13 @@ found:
 	dev->page_size   = sysconf(_SC_PAGESIZE);
 	dev->abi_version = abi_version;
 
+	/* Older kernels don't report a node, "-1" means none */
+	if (ibv_read_sysfs_file(uverbs_sys_path, "device/numa_node",
+				value, sizeof value) > 0)
+		dev->numa_node = strtol(value, NULL, 10);
+	else
+		dev->numa_node = -1;
+
 	dev->verbs_dev.sz = sizeof(*dev);
 	dev->verbs_dev.size_of_context =
 		sizeof(struct mlx4_context) - sizeof(struct ibv_context);
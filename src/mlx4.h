@@ -40,6 +40,8 @@
 #include <infiniband/arch.h>
 #include <infiniband/verbs.h>
 
+#include "mlx4dv.h"
+
 #define MLX4_PORTS_NUM 2
 
 #ifdef HAVE_VALGRIND_MEMCHECK_H
@@ -94,42 +96,63 @@
 #define ALWAYS_INLINE
 #endif
 
-enum {
-	CREATE_CQ_SUPPORTED_WC_FLAGS = IBV_WC_STANDARD_FLAGS	|
-				       IBV_WC_EX_WITH_COMPLETION_TIMESTAMP
-};
+#define CREATE_CQ_SUPPORTED_WC_FLAGS	(IBV_WC_STANDARD_FLAGS			| \
+					 IBV_WC_EX_WITH_COMPLETION_TIMESTAMP	| \
+					 MLX4DV_WC_EX_WITH_FLOW_HASH		| \
+					 MLX4DV_WC_EX_WITH_VLAN			| \
+					 MLX4DV_WC_EX_WITH_PKT_TYPE		| \
+					 MLX4DV_WC_EX_WITH_SQ_RETIRED)
 
 enum {
 	MLX4_STAT_RATE_OFFSET		= 5
 };
 
 enum {
-	MLX4_QP_TABLE_BITS		= 8,
-	MLX4_QP_TABLE_SIZE		= 1 << MLX4_QP_TABLE_BITS,
-	MLX4_QP_TABLE_MASK		= MLX4_QP_TABLE_SIZE - 1
+	MLX4_INDEX_NODE_BITS		= 6,
+	MLX4_INDEX_NODE_SIZE		= 1 << MLX4_INDEX_NODE_BITS,
+	MLX4_INDEX_NODE_MASK		= MLX4_INDEX_NODE_SIZE - 1
 };
 
-#define MLX4_REMOTE_SRQN_FLAGS(wr) htonl(wr->qp_type.xrc.remote_srqn << 8)
+/*
+ * Radix tree of QPs or XRC SRQs by number, see index.c.
+ */
+struct mlx4_index_node {
+	void			       *slot[MLX4_INDEX_NODE_SIZE];
+};
 
-enum {
-	MLX4_XSRQ_TABLE_BITS = 8,
-	MLX4_XSRQ_TABLE_SIZE = 1 << MLX4_XSRQ_TABLE_BITS,
-	MLX4_XSRQ_TABLE_MASK = MLX4_XSRQ_TABLE_SIZE - 1
+struct mlx4_index {
+	struct mlx4_index_node	      **root;
+	uint32_t			mask;
 };
 
-struct mlx4_xsrq_table {
-	struct {
-		struct mlx4_srq **table;
-		int		  refcnt;
-	} xsrq_table[MLX4_XSRQ_TABLE_SIZE];
+int mlx4_index_init(struct mlx4_index *index, int size);
+void mlx4_index_cleanup(struct mlx4_index *index);
+int mlx4_index_insert(struct mlx4_index *index, uint32_t key, void *obj);
+void mlx4_index_remove(struct mlx4_index *index, uint32_t key);
 
+static inline void *mlx4_index_lookup(struct mlx4_index *index, uint32_t key)
+{
+	struct mlx4_index_node *node;
+
+	key &= index->mask;
+	node = index->root[key >> (2 * MLX4_INDEX_NODE_BITS)];
+	if (!node)
+		return NULL;
+	node = node->slot[(key >> MLX4_INDEX_NODE_BITS) & MLX4_INDEX_NODE_MASK];
+	if (!node)
+		return NULL;
+	return node->slot[key & MLX4_INDEX_NODE_MASK];
+}
+
+#define MLX4_REMOTE_SRQN_FLAGS(wr) htonl(wr->qp_type.xrc.remote_srqn << 8)
+
+struct mlx4_xsrq_table {
+	struct mlx4_index	  index;
 	pthread_mutex_t		  mutex;
-	int			  num_xsrq;
-	int			  shift;
-	int			  mask;
 };
 
-void mlx4_init_xsrq_table(struct mlx4_xsrq_table *xsrq_table, int size);
+int mlx4_init_xsrq_table(struct mlx4_xsrq_table *xsrq_table, int size);
+void mlx4_cleanup_xsrq_table(struct mlx4_xsrq_table *xsrq_table);
 struct mlx4_srq *mlx4_find_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn);
 int mlx4_store_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn,
 		    struct mlx4_srq *srq);
@@ -142,9 +165,25 @@ enum {
 enum mlx4_db_type {
 	MLX4_DB_TYPE_CQ,
 	MLX4_DB_TYPE_RQ,
+	/* One record per cache line, so no two objects share a line */
+	MLX4_DB_TYPE_CQ_ISOLATED,
+	MLX4_DB_TYPE_RQ_ISOLATED,
 	MLX4_NUM_DB_TYPE
 };
 
+enum {
+	MLX4_CACHELINE_SIZE		= 64
+};
+
+#define MLX4_CACHELINE_ALIGNED	__attribute__((aligned(MLX4_CACHELINE_SIZE)))
+
+/* Cache line of a field, for the layout assertions below */
+#define MLX4_CACHELINE(type, field) \
+	(offsetof(type, field) / MLX4_CACHELINE_SIZE)
+
+#define MLX4_STATIC_ASSERT(name, cond) \
+	typedef char mlx4_static_assert_##name[(cond) ? 1 : -1]
+
 enum {
 	MLX4_OPCODE_NOP			= 0x00,
 	MLX4_OPCODE_SEND_INVAL		= 0x01,
@@ -176,46 +215,154 @@ struct mlx4_device {
 	struct verbs_device		verbs_dev;
 	int				page_size;
 	int				abi_version;
+	/* NUMA node of the HCA, -1 if unknown */
+	int				numa_node;
 };
 
 struct mlx4_db_page;
 
+struct mlx4_db_pool {
+	pthread_mutex_t			lock;
+	/* Pages with at least one free record */
+	struct mlx4_db_page	       *partial;
+	int				num_empty;
+};
+struct mlx4_cached_buf;
+
+enum {
+	/* Free lists per power of two of buffer length, see buf_round() */
+	MLX4_BUF_CACHE_STEPS		= 8,
+	MLX4_BUF_CACHE_CLASSES		= 8 * sizeof (long) * MLX4_BUF_CACHE_STEPS
+};
+
+/*
+ * Queue buffers kept mapped and madvised after their object is
+ * destroyed, see mlx4_alloc_queue_buf().  max_size 0 disables it.
+ */
+struct mlx4_buf_cache {
+	pthread_mutex_t			lock;
+	size_t				max_size;
+	size_t				size;
+	struct mlx4_cached_buf	       *free[MLX4_BUF_CACHE_CLASSES];
+};
+
+struct mlx4_mr_entry;
+
+enum {
+	MLX4_MR_CACHE_PENDING		= 32
+};
+
+struct mlx4_mr_range {
+	uintptr_t			start;
+	uintptr_t			end;
+};
+
+/*
+ * Registered MRs kept for reuse, see mr_cache.c.  index holds the
+ * entries that can still be hit, sorted by pd, access and start;
+ * entries of the same pd and access never overlap.  Idle entries are
+ * also on the LRU list, most recently released first.
+ *
+ * Idle entries are only kept when the cache is tracked, that is on the
+ * list of the userfaultfd tracker, which queues the ranges it sees
+ * unmapped in pending under its event lock.
+ */
+struct mlx4_mr_cache {
+	pthread_mutex_t			lock;
+	size_t				max_size;
+	size_t				size;
+	struct mlx4_mr_entry	      **index;
+	int				num;
+	int				max;
+	struct mlx4_mr_entry	       *lru_head;
+	struct mlx4_mr_entry	       *lru_tail;
+	struct mlx4dv_mr_cache_stats	stats;
+	int				tracked;
+	struct mlx4_mr_cache	       *next_tracked;
+	struct mlx4_mr_range		pending[MLX4_MR_CACHE_PENDING];
+	int				num_pending;
+	/* More ranges went away than pending holds: drop everything */
+	int				pending_overflow;
+};
+
+struct mlx4_port_cache {
+	int				valid;
+	unsigned			gen;
+	struct ibv_port_attr		attr;
+	/* attr.gid_tbl_len entries, each filled on first use */
+	union ibv_gid		       *gid;
+	uint8_t			       *gid_valid;
+};
+
+struct mlx4_attr_cache {
+	int				device_valid;
+	unsigned			device_gen;
+	struct ibv_device_attr		device_attr;
+	struct mlx4_port_cache		port[MLX4_PORTS_NUM];
+};
+
 struct mlx4_context {
 	struct ibv_context		ibv_ctx;
 
+	/* Read-mostly, used on the data path */
 	void			       *uar;
-	pthread_spinlock_t		uar_lock;
-
 	void			       *bf_page;
 	int				bf_buf_size;
-	int				bf_offset;
-	pthread_spinlock_t		bf_lock;
-
-	struct {
-		struct mlx4_qp	      **table;
-		int			refcnt;
-	}				qp_table[MLX4_QP_TABLE_SIZE];
-	pthread_mutex_t			qp_table_mutex;
-	int				num_qps;
-	int				qp_table_shift;
-	int				qp_table_mask;
-
-	struct mlx4_db_page	       *db_list[MLX4_NUM_DB_TYPE];
-	pthread_mutex_t			db_list_mutex;
 	int				cqe_size;
-	struct mlx4_xsrq_table		xsrq_table;
-	struct {
-		uint8_t                 valid;
-		uint8_t                 link_layer;
-		enum ibv_port_cap_flags caps;
-	} port_query_cache[MLX4_PORTS_NUM];
+	int				num_qps;
 	uint64_t			core_clock_offset;
 	void			       *hca_core_clock;
+	struct mlx4_index		qp_table;
+	struct mlx4_xsrq_table		xsrq_table;
+
+	/* Control path */
+	pthread_spinlock_t		uar_lock;
+	/* Only held to update qp_table, never across a kernel command */
+	pthread_mutex_t			qp_table_mutex;
+	pthread_cond_t			qp_table_cond;
+	struct mlx4_db_pool		db_pool[MLX4_NUM_DB_TYPE];
+	/* Attributes for modify_qp and create_ah, see get_port_attr() */
+	pthread_mutex_t			attr_cache_lock;
+	struct mlx4_attr_cache		attr_cache;
+	/* MLX4_BUF_* defaults from the environment */
+	int				buf_flags;
+	/* Use the _ISOLATED doorbell types for every object */
+	int				db_isolated;
+	struct mlx4_buf_cache		buf_cache;
+	struct mlx4_mr_cache		mr_cache;
+
+	/*
+	 * Written by every BlueFlame post.  libibverbs allocates the
+	 * context, so a line of padding rather than alignment keeps it
+	 * off the lines above.
+	 */
+	char				bf_pad[MLX4_CACHELINE_SIZE];
+	pthread_spinlock_t		bf_lock;
+	int				bf_offset;
+};
+
+MLX4_STATIC_ASSERT(context_bf_last,
+		   offsetof(struct mlx4_context, bf_lock) >=
+		   offsetof(struct mlx4_context, mr_cache) +
+		   sizeof (struct mlx4_mr_cache) + MLX4_CACHELINE_SIZE);
+
+enum {
+	MLX4_BUF_HUGE			= 1 << 0,
+	MLX4_BUF_POPULATE		= 1 << 1,
+	MLX4_BUF_ZEROED			= 1 << 2
 };
 
+#define MLX4_HUGE_PAGE_SIZE		(2UL * 1024 * 1024)
+
 struct mlx4_buf {
 	void			       *buf;
 	size_t				length;
+	/*
+	 * MLX4_BUF_HUGE if the buffer really is on huge pages,
+	 * MLX4_BUF_ZEROED if it is freshly mapped rather than reused.
+	 */
+	int				flags;
+	int				numa_node;
 };
 
 struct mlx4_pd {
@@ -223,39 +370,169 @@ struct mlx4_pd {
 	uint32_t			pdn;
 };
 
+struct mlx4_mr {
+	struct ibv_mr			ibv_mr;
+	/* Cache entry whose registration this MR uses, or NULL */
+	struct mlx4_mr_entry	       *entry;
+};
+
+struct mlx4_qp;
+
+/*
+ * mlx4_cq, mlx4_srq and mlx4_qp are laid out in cache line aligned
+ * regions so that the threads posting and polling don't write to each
+ * other's lines.  They must be allocated with mlx4_calloc_aligned().
+ */
 struct mlx4_cq {
 	struct ibv_cq			ibv_cq;
+
+	/* Read-mostly, used on every poll */
 	uint64_t			wc_flags;
 	int (*mlx4_poll_one)(struct mlx4_cq *cq, struct mlx4_qp **cur_qp,
 			     struct ibv_wc_ex **wc_ex, uint64_t wc_flags);
 	struct mlx4_buf			buf;
-	struct mlx4_buf			resize_buf;
-	pthread_spinlock_t		lock;
 	uint32_t			cqn;
-	uint32_t			cons_index;
+	int				cqe_size;
+	int				creation_flags;
 	uint32_t		       *set_ci_db;
 	uint32_t		       *arm_db;
+
+	/* Consumer, written on every poll */
+	pthread_spinlock_t		lock MLX4_CACHELINE_ALIGNED;
+	uint32_t			cons_index;
 	int				arm_sn;
-	int				cqe_size;
-	int				creation_flags;
+	/* SRQ WQEs freed during the current poll call, not yet returned */
+	struct mlx4_srq		       *free_srq;
+	int				free_first;
+	int				free_last;
+	int				free_cnt;
+
+	/* Cold: resize and creation */
+	struct mlx4_buf			resize_buf MLX4_CACHELINE_ALIGNED;
+	/* Node the buffer is bound to, -1 for first touch */
+	int				numa_node;
+};
+
+MLX4_STATIC_ASSERT(cq_consumer_line,
+		   MLX4_CACHELINE(struct mlx4_cq, lock) ==
+		   MLX4_CACHELINE(struct mlx4_cq, free_cnt) &&
+		   MLX4_CACHELINE(struct mlx4_cq, cons_index) !=
+		   MLX4_CACHELINE(struct mlx4_cq, arm_db) &&
+		   MLX4_CACHELINE(struct mlx4_cq, cons_index) !=
+		   MLX4_CACHELINE(struct mlx4_cq, resize_buf));
+
+/*
+ * Receive ring slot states.  A slot is held from the poll of its
+ * completion until the application releases it.  SRQ rings leave
+ * released slots on the free list, which posts them, so only QP rings
+ * use MLX4_RING_POSTED.
+ */
+enum {
+	MLX4_RING_HELD		= 0,
+	MLX4_RING_RELEASED	= 1,
+	MLX4_RING_POSTED	= 2
+};
+
+struct mlx4_recv_ring {
+	uint64_t			addr;
+	uint32_t			stride;
+	int				num_bufs;
+	uint8_t			       *state;
 };
 
+/* Buffer slot of a receive ring completion's wr_id, or -1 */
+static inline int mlx4_recv_ring_slot(struct mlx4_recv_ring *ring,
+				      uint64_t wr_id)
+{
+	uint64_t off = wr_id - ring->addr;
+
+	if (wr_id < ring->addr || off % ring->stride ||
+	    off / ring->stride >= ring->num_bufs)
+		return -1;
+
+	return off / ring->stride;
+}
+
+struct mlx4_rx_pool {
+	uint64_t			addr;
+	uint32_t			stride;
+	int				num_bufs;
+	int				num_free;
+	uint32_t		       *free_bufs;
+	/* Buffers on free_bufs, to catch a buffer freed twice */
+	uint8_t			       *is_free;
+};
+
+struct mlx4_srq_replenish {
+	struct mlx4_srq		       *srq;
+	uint64_t			addr;
+	uint32_t			stride;
+	uint32_t			length;
+	uint32_t			lkey;
+	int				watermark;
+	uint32_t		       *free_bufs;
+	/* Buffers the application holds, from poll to release */
+	uint8_t			       *held;
+	int				num_free;
+	int				num_bufs;
+	uint64_t			below_since;
+	struct mlx4dv_srq_replenish_stats stats;
+	int				use_thread;
+	pthread_t			thread;
+	pthread_mutex_t			mutex;
+	pthread_cond_t			cond;
+	int				kick;
+	int				stop;
+};
+
+/* Called as the completion of a replenished buffer is polled */
+static inline void mlx4_srq_replenish_hold(struct mlx4_srq_replenish *rep,
+					   uint64_t wr_id)
+{
+	uint64_t off = wr_id - rep->addr;
+
+	if (wr_id >= rep->addr && off / rep->stride < rep->num_bufs)
+		rep->held[off / rep->stride] = 1;
+}
+
 struct mlx4_srq {
 	struct verbs_srq		verbs_srq;
+
+	/* Read-mostly */
 	struct mlx4_buf			buf;
-	pthread_spinlock_t		lock;
 	uint64_t		       *wrid;
 	uint32_t			srqn;
 	int				max;
 	int				max_gs;
 	int				wqe_shift;
-	int				head;
-	int				tail;
 	uint32_t		       *db;
-	uint16_t			counter;
 	uint8_t				ext_srq;
+	uint32_t			create_flags;
+	struct mlx4_srq_replenish      *replenish;
+	struct mlx4_recv_ring	       *recv_ring;
+
+	/* Producer, posting receives */
+	pthread_spinlock_t		lock MLX4_CACHELINE_ALIGNED;
+	int				head;
+	/* First WQE never posted, see srq_next_head() */
+	int				unlinked;
+	uint16_t			counter;
+
+	/* Consumer, returning WQEs freed by CQ polling */
+	int				tail MLX4_CACHELINE_ALIGNED;
+	/* WQEs returned to the free list, see mlx4_free_srq_wqes() */
+	uint16_t			completed;
+
+	/* Cold */
+	int				numa_node;
 };
 
+MLX4_STATIC_ASSERT(srq_head_tail,
+		   MLX4_CACHELINE(struct mlx4_srq, head) !=
+		   MLX4_CACHELINE(struct mlx4_srq, tail) &&
+		   MLX4_CACHELINE(struct mlx4_srq, head) !=
+		   MLX4_CACHELINE(struct mlx4_srq, recv_ring));
+
 struct mlx4_wq {
 	uint64_t		       *wrid;
 	pthread_spinlock_t		lock;
@@ -268,24 +545,53 @@ struct mlx4_wq {
 	int				offset;
 };
 
+/*
+ * Header of the allocation holding the QPs of one
+ * mlx4dv_create_qp_bulk() call, freed along with the last of them.
+ * refcnt is protected by qp_table_mutex.
+ */
+struct mlx4_qp_slab {
+	int				refcnt;
+};
+
 struct mlx4_qp {
 	struct verbs_qp			verbs_qp;
+
+	/* Read-mostly, used by the post and poll paths */
 	struct mlx4_buf			buf;
 	int				max_inline_data;
-	int				buf_size;
-
 	uint32_t			doorbell_qpn;
 	uint32_t			sq_signal_bits;
 	int				sq_spare_wqes;
-	struct mlx4_wq			sq;
-
+	unsigned			sq_signal_period;
 	uint32_t		       *db;
-	struct mlx4_wq			rq;
-
 	uint8_t				link_layer;
 	uint32_t			qp_cap_cache;
+	uint32_t			create_flags;
+	struct mlx4_recv_ring	       *recv_ring;
+	struct mlx4_rx_pool	       *rx_pool;
+
+	/* Send producer */
+	struct mlx4_wq			sq MLX4_CACHELINE_ALIGNED;
+	unsigned			sq_next_signal;
+
+	/* Receive producer */
+	struct mlx4_wq			rq MLX4_CACHELINE_ALIGNED;
+
+	/* Cold, never written after creation */
+	int				buf_size;
+	int				numa_node;
+	struct mlx4_qp_slab	       *slab;
 };
 
+MLX4_STATIC_ASSERT(qp_sq_rq_lines,
+		   MLX4_CACHELINE(struct mlx4_qp, sq) ==
+		   MLX4_CACHELINE(struct mlx4_qp, sq_next_signal) &&
+		   MLX4_CACHELINE(struct mlx4_qp, sq) !=
+		   MLX4_CACHELINE(struct mlx4_qp, rq) &&
+		   MLX4_CACHELINE(struct mlx4_qp, sq) !=
+		   MLX4_CACHELINE(struct mlx4_qp, rx_pool));
+
 struct mlx4_av {
 	uint32_t			port_pd;
 	uint8_t				reserved1;
@@ -316,6 +622,11 @@ enum {
 enum mlx4_cqe_status {
 	MLX4_CQE_STATUS_TCP_UDP_CSUM_OK	= (1 <<  2),
 	MLX4_CQE_STATUS_IPV4_PKT	= (1 << 22),
+	MLX4_CQE_STATUS_IPV4_FRAG	= (1 << 23),
+	MLX4_CQE_STATUS_IPV6_PKT	= (1 << 24),
+	MLX4_CQE_STATUS_IPV4_OPT	= (1 << 25),
+	MLX4_CQE_STATUS_TCP_PKT		= (1 << 26),
+	MLX4_CQE_STATUS_UDP_PKT		= (1 << 27),
 	MLX4_CQE_STATUS_IP_HDR_CSUM_OK	= (1 << 28),
 	MLX4_CQE_STATUS_IPV4_CSUM_OK	= MLX4_CQE_STATUS_IPV4_PKT |
 					MLX4_CQE_STATUS_IP_HDR_CSUM_OK |
@@ -330,8 +641,7 @@ struct mlx4_cqe {
 		struct {
 			union {
 				struct {
-					uint8_t   sl_vid;
-					uint8_t   reserved1;
+					uint16_t  sl_vid;
 					uint16_t  rlid;
 				};
 				uint32_t  timestamp_16_47;
@@ -380,6 +690,11 @@ static inline struct mlx4_pd *to_mpd(struct ibv_pd *ibpd)
 	return to_mxxx(pd, pd);
 }
 
+static inline struct mlx4_mr *to_mmr(struct ibv_mr *ibmr)
+{
+	return to_mxxx(mr, mr);
+}
+
 static inline struct mlx4_cq *to_mcq(struct ibv_cq *ibcq)
 {
 	return to_mxxx(cq, cq);
@@ -402,11 +717,38 @@ static inline struct mlx4_ah *to_mah(struct ibv_ah *ibah)
 	return to_mxxx(ah, ah);
 }
 
-int mlx4_alloc_buf(struct mlx4_buf *buf, size_t size, int page_size);
+int mlx4_alloc_buf(struct mlx4_buf *buf, size_t size, int page_size,
+		   int flags, int numa_node);
 void mlx4_free_buf(struct mlx4_buf *buf);
+void *mlx4_calloc_aligned(size_t size);
+
+void mlx4_init_mr_cache(struct mlx4_context *context);
+void mlx4_cleanup_mr_cache(struct mlx4_context *context);
+void mlx4_mr_cache_flush_pd(struct ibv_pd *pd);
+int mlx4_mr_cache_get(struct ibv_pd *pd, void *addr, size_t length,
+		      int access, struct mlx4_mr *mr);
+void mlx4_mr_cache_put(struct mlx4_context *context, struct mlx4_mr *mr);
+void mlx4_init_buf_cache(struct mlx4_context *context);
+void mlx4_cleanup_buf_cache(struct mlx4_context *context);
+int mlx4_alloc_queue_buf(struct mlx4_context *context, struct mlx4_buf *buf,
+			 size_t size, int flags, int numa_node);
+int mlx4_alloc_queue_bufs(struct mlx4_context *context, struct mlx4_buf **bufs,
+			  size_t *sizes, int num, int flags, int numa_node);
+void mlx4_free_queue_buf(struct mlx4_context *context, struct mlx4_buf *buf);
+
+void mlx4_init_db_pools(struct mlx4_context *context);
+void mlx4_cleanup_db_pools(struct mlx4_context *context);
+static inline enum mlx4_db_type mlx4_rq_db_type(struct mlx4_context *context,
+						int isolated)
+{
+	return isolated || context->db_isolated ? MLX4_DB_TYPE_RQ_ISOLATED :
+						  MLX4_DB_TYPE_RQ;
+}
 
 uint32_t *mlx4_alloc_db(struct mlx4_context *context, enum mlx4_db_type type);
-void mlx4_free_db(struct mlx4_context *context, enum mlx4_db_type type, uint32_t *db);
+int mlx4_alloc_dbs(struct mlx4_context *context, enum mlx4_db_type type,
+		   uint32_t **dbs, int num);
+void mlx4_free_db(struct mlx4_context *context, uint32_t *db);
 
 int mlx4_query_device(struct ibv_context *context,
 		       struct ibv_device_attr *attr);
@@ -421,6 +763,9 @@ int mlx4_query_values(struct ibv_context *context,
 		      struct ibv_values_ex *values);
 int mlx4_query_port(struct ibv_context *context, uint8_t port,
 		     struct ibv_port_attr *attr);
+void mlx4_init_attr_cache(struct mlx4_context *context);
+void mlx4_cleanup_attr_cache(struct mlx4_context *context);
+void mlx4_async_event(struct ibv_async_event *event);
 
 struct ibv_pd *mlx4_alloc_pd(struct ibv_context *context);
 int mlx4_free_pd(struct ibv_pd *pd);
@@ -439,8 +784,8 @@ struct ibv_cq *mlx4_create_cq(struct ibv_context *context, int cqe,
 			       int comp_vector);
 struct ibv_cq *mlx4_create_cq_ex(struct ibv_context *context,
 				 struct ibv_cq_init_attr_ex *cq_attr);
-int mlx4_alloc_cq_buf(struct mlx4_device *dev, struct mlx4_buf *buf, int nent,
-		      int entry_size);
+int mlx4_alloc_cq_buf(struct mlx4_context *context, struct mlx4_buf *buf,
+		      int nent, int entry_size, int numa_node);
 int mlx4_resize_cq(struct ibv_cq *cq, int cqe);
 int mlx4_destroy_cq(struct ibv_cq *cq);
 int mlx4_poll_cq(struct ibv_cq *cq, int ne, struct ibv_wc *wc);
@@ -477,12 +822,10 @@ int mlx4_destroy_srq(struct ibv_srq *srq);
 int mlx4_destroy_xrc_srq(struct ibv_srq *srq);
 int mlx4_alloc_srq_buf(struct ibv_pd *pd, struct ibv_srq_attr *attr,
 			struct mlx4_srq *srq);
-void mlx4_init_xsrq_table(struct mlx4_xsrq_table *xsrq_table, int size);
-struct mlx4_srq *mlx4_find_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn);
-int mlx4_store_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn,
-		    struct mlx4_srq *srq);
-void mlx4_clear_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn);
 void mlx4_free_srq_wqe(struct mlx4_srq *srq, int ind);
+void mlx4_free_srq_wqes(struct mlx4_srq *srq, int first, int last, int n);
+void mlx4_srq_check_replenish(struct mlx4_srq *srq);
+void mlx4_srq_stop_replenish(struct mlx4_srq *srq);
 int mlx4_post_srq_recv(struct ibv_srq *ibsrq,
 		       struct ibv_recv_wr *wr,
 		       struct ibv_recv_wr **bad_wr);
@@ -498,6 +841,7 @@ int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 		    int attr_mask);
 int mlx4_destroy_qp(struct ibv_qp *qp);
 void mlx4_init_qp_indices(struct mlx4_qp *qp);
+void mlx4_rx_refill(struct mlx4_qp *qp);
 void mlx4_qp_init_sq_ownership(struct mlx4_qp *qp);
 int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			  struct ibv_send_wr **bad_wr);
@@ -507,6 +851,9 @@ void mlx4_calc_sq_wqe_size(struct ibv_qp_cap *cap, enum ibv_qp_type type,
 			   struct mlx4_qp *qp);
 int mlx4_alloc_qp_buf(struct ibv_context *context, struct ibv_qp_cap *cap,
 		       enum ibv_qp_type type, struct mlx4_qp *qp);
+int mlx4_alloc_qp_bufs(struct ibv_context *context,
+		       struct ibv_qp_init_attr_ex *attrs, struct mlx4_qp *qps,
+		       int num);
 void mlx4_set_sq_sizes(struct mlx4_qp *qp, struct ibv_qp_cap *cap,
 		       enum ibv_qp_type type);
 struct mlx4_qp *mlx4_find_qp(struct mlx4_context *ctx, uint32_t qpn);
@@ -0,0 +1,576 @@
+/*
+ * Copyright (c) 2016 Mellanox Technologies Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef MLX4DV_H
+#define MLX4DV_H
+
+#include <stdint.h>
+
+#include <infiniband/verbs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * mlx4 specific QP creation attributes, see mlx4dv_create_qp().
+ */
+enum mlx4dv_qp_init_attr_mask {
+	MLX4DV_QP_INIT_ATTR_MASK_CREATE_FLAGS	= 1 << 0,
+	MLX4DV_QP_INIT_ATTR_MASK_SIGNAL_PERIOD	= 1 << 1,
+	MLX4DV_QP_INIT_ATTR_MASK_NUMA_NODE	= 1 << 2,
+	MLX4DV_QP_INIT_ATTR_MASK_RESERVED	= 1 << 3
+};
+
+enum mlx4dv_qp_create_flags {
+	/* Size the SQ WQEs so that masked atomic WRs can be posted */
+	MLX4DV_QP_CREATE_MASKED_ATOMIC		= 1 << 0,
+	/*
+	 * Let the driver request send completions by itself: every
+	 * signal_period-th send WQE (max_send_wr / 4 by default) is
+	 * signaled even if the WR wasn't, so the SQ can't fill up with
+	 * unsignaled WRs.  Explicitly signaled WRs restart the period.
+	 * MLX4DV_WC_EX_WITH_SQ_RETIRED reports how many SQ entries each
+	 * send completion of such a QP retired, and
+	 * mlx4dv_qp_query_sq_retired() does for ibv_poll_cq() users.
+	 */
+	MLX4DV_QP_CREATE_AUTO_SIGNAL		= 1 << 1,
+	/*
+	 * Back the WQE buffer with 2MB pages (hugetlb if reserved, else
+	 * THP) and prefault it at creation.  Defaults for all objects
+	 * come from MLX4_HUGE_BUF=1 and MLX4_POPULATE_BUF=1.
+	 */
+	MLX4DV_QP_CREATE_HUGE_BUF		= 1 << 2,
+	MLX4DV_QP_CREATE_POPULATE_BUF		= 1 << 3,
+	/*
+	 * Give the RQ doorbell record a cache line of its own instead of
+	 * sharing it with up to 15 other queues' records.  MLX4_ISOLATED_DB=1
+	 * does this for every CQ, QP and SRQ.
+	 */
+	MLX4DV_QP_CREATE_ISOLATED_DB		= 1 << 4,
+	/*
+	 * Don't keep wr_ids.  Completions of the QP report in wr_id the
+	 * number of WRs posted to the same queue before the completed one
+	 * since creation or the last reset, and the application finds its
+	 * context from that.  Receive rings and pools need wr_ids and
+	 * can't be started on such a QP.
+	 */
+	MLX4DV_QP_CREATE_NO_WRID		= 1 << 5
+};
+
+struct mlx4dv_qp_init_attr {
+	uint64_t			comp_mask;
+	uint32_t			create_flags;
+	uint32_t			signal_period;
+	/*
+	 * Node to place the WQE buffer on instead of the HCA's node, -1
+	 * to leave it to first touch.
+	 */
+	int				numa_node;
+};
+
+struct ibv_qp *mlx4dv_create_qp(struct ibv_context *context,
+				struct ibv_qp_init_attr_ex *attr,
+				struct mlx4dv_qp_init_attr *mlx4_attr);
+
+/*
+ * Create num QPs, one per entry of attrs, sharing mlx4_attr (which may
+ * be NULL).  Driver memory is allocated for all of them at once and
+ * they enter the QP table together, which makes bringing up thousands
+ * of connections much cheaper than as many mlx4dv_create_qp() calls.
+ * The QPs are destroyed one by one with ibv_destroy_qp().
+ *
+ * Returns 0 with the QPs in qps, or an errno value with none created.
+ */
+int mlx4dv_create_qp_bulk(struct ibv_context *context, int num,
+			  struct ibv_qp_init_attr_ex *attrs,
+			  struct mlx4dv_qp_init_attr *mlx4_attr,
+			  struct ibv_qp **qps);
+
+/*
+ * The number of SQ entries retired by the send completions polled so
+ * far, modulo 2^32, restarting from 0 when the QP goes through RESET.
+ * The difference between two reads is how many entries, signaled or
+ * not, the completions polled in between retired.  Returns 0, or
+ * EINVAL if the QP has no SQ.
+ */
+int mlx4dv_qp_query_sq_retired(struct ibv_qp *qp, uint32_t *retired);
+
+/*
+ * mlx4 specific CQ creation attributes, see mlx4dv_create_cq().
+ * numa_node places the CQ buffer, usually on the node of the thread
+ * polling it, instead of the HCA's node; -1 leaves it to first touch.
+ */
+enum mlx4dv_cq_init_attr_mask {
+	MLX4DV_CQ_INIT_ATTR_MASK_NUMA_NODE	= 1 << 0,
+	MLX4DV_CQ_INIT_ATTR_MASK_CREATE_FLAGS	= 1 << 1,
+	MLX4DV_CQ_INIT_ATTR_MASK_RESERVED	= 1 << 2
+};
+
+enum mlx4dv_cq_create_flags {
+	/* As MLX4DV_QP_CREATE_ISOLATED_DB, for the consumer index record */
+	MLX4DV_CQ_CREATE_ISOLATED_DB		= 1 << 0
+};
+
+struct mlx4dv_cq_init_attr {
+	uint64_t			comp_mask;
+	int				numa_node;
+	uint32_t			create_flags;
+};
+
+struct ibv_cq *mlx4dv_create_cq(struct ibv_context *context,
+				struct ibv_cq_init_attr_ex *attr,
+				struct mlx4dv_cq_init_attr *mlx4_attr);
+
+/*
+ * Masked atomic operations.  A masked compare and swap only compares
+ * the bits set in compare_mask and only swaps the bits set in
+ * swap_mask.  A masked fetch and add splits the 64 bit operand into
+ * independent fields: every bit set in field_boundary marks the most
+ * significant bit of a field, and carries out of that bit are
+ * dropped instead of propagating into the next field.
+ *
+ * The original remote value is returned to the single 8 byte entry in
+ * sg_list; num_sge must be 1 and its length 8, or the WR fails with
+ * EINVAL.  Only RC QPs created with MLX4DV_QP_CREATE_MASKED_ATOMIC
+ * accept these WRs.
+ */
+enum mlx4dv_atomic_opcode {
+	MLX4DV_WR_MASKED_ATOMIC_CMP_AND_SWP,
+	MLX4DV_WR_MASKED_ATOMIC_FETCH_AND_ADD
+};
+
+struct mlx4dv_atomic_wr {
+	uint64_t			wr_id;
+	struct mlx4dv_atomic_wr	       *next;
+	struct ibv_sge		       *sg_list;
+	int				num_sge;
+	enum mlx4dv_atomic_opcode	opcode;
+	int				send_flags;
+	uint64_t			remote_addr;
+	uint32_t			rkey;
+	union {
+		struct {
+			uint64_t	compare;
+			uint64_t	compare_mask;
+			uint64_t	swap;
+			uint64_t	swap_mask;
+		} cmp_swap;
+		struct {
+			uint64_t	add;
+			uint64_t	field_boundary;
+		} fetch_add;
+	} op;
+};
+
+int mlx4dv_post_atomic(struct ibv_qp *qp, struct mlx4dv_atomic_wr *wr,
+		       struct mlx4dv_atomic_wr **bad_wr);
+
+/*
+ * Send one datagram to many destinations over a UD QP.  The payload
+ * (sg_list, inline if IBV_SEND_INLINE is set) is built once and copied
+ * into one WQE per destination, and a single doorbell is rung for the
+ * whole batch.  Only the WQE for the last destination requests a
+ * completion, so at most one CQE carrying wr_id is generated.
+ *
+ * opcode must be IBV_WR_SEND or IBV_WR_SEND_WITH_IMM.  Either all
+ * destinations are posted or none are; the return value is 0 or an
+ * errno value.
+ */
+struct mlx4dv_ud_dest {
+	struct ibv_ah		       *ah;
+	uint32_t			remote_qpn;
+	uint32_t			remote_qkey;
+};
+
+struct mlx4dv_ud_fanout_wr {
+	uint64_t			wr_id;
+	struct ibv_sge		       *sg_list;
+	int				num_sge;
+	enum ibv_wr_opcode		opcode;
+	int				send_flags;
+	uint32_t			imm_data;
+	struct mlx4dv_ud_dest	       *dest;
+	int				num_dest;
+};
+
+int mlx4dv_post_ud_fanout(struct ibv_qp *qp, struct mlx4dv_ud_fanout_wr *wr);
+
+/*
+ * Post send WRs to several QPs at once.  The WQEs of every entry are
+ * built first and a single store barrier orders all of them before
+ * the doorbells, which are then rung back to back, instead of paying
+ * a barrier and a doorbell per QP.  Entries are independent: a
+ * failure on one doesn't stop the others.  bad_wr is set to the first
+ * WR of the entry that wasn't posted, or NULL if all of them were.
+ * Returns 0, or the errno of the first failing entry.
+ */
+struct mlx4dv_send_batch {
+	struct ibv_qp		       *qp;
+	struct ibv_send_wr	       *wr;
+	struct ibv_send_wr	       *bad_wr;
+};
+
+int mlx4dv_post_send_many(struct mlx4dv_send_batch *batch, int num);
+
+/*
+ * Extra ibv_wc_ex fields for receive completions on Ethernet ports,
+ * requested through the CQ wc_flags.  Like the standard fields they
+ * are laid out by size: the flow hash follows IBV_WC_EX_WITH_SRC_QP,
+ * and the VLAN tag and packet type follow IBV_WC_EX_WITH_SLID.  The
+ * matching bit in the completion's wc_flags tells whether a field is
+ * valid.
+ */
+/* uint32_t: RSS hash computed by the HCA, raw packet QPs only */
+#define MLX4DV_WC_EX_WITH_FLOW_HASH	(1ULL << 32)
+/*
+ * uint16_t: 802.1Q tag control information stripped from the packet.
+ * Not available on CQs with completion timestamps, whose CQEs carry
+ * the timestamp in its place.
+ */
+#define MLX4DV_WC_EX_WITH_VLAN		(1ULL << 33)
+/* uint16_t: enum mlx4dv_wc_pkt_type bits */
+#define MLX4DV_WC_EX_WITH_PKT_TYPE	(1ULL << 34)
+/*
+ * uint16_t, after the packet type: the number of SQ entries a send
+ * completion of an MLX4DV_QP_CREATE_AUTO_SIGNAL QP retired, including
+ * its own, so that the unsignaled WRs it covers can be reclaimed.
+ */
+#define MLX4DV_WC_EX_WITH_SQ_RETIRED	(1ULL << 35)
+
+enum mlx4dv_wc_pkt_type {
+	MLX4DV_WC_PKT_IPV4		= 1 << 0,
+	MLX4DV_WC_PKT_IPV4_FRAG		= 1 << 1,
+	MLX4DV_WC_PKT_IPV6		= 1 << 2,
+	MLX4DV_WC_PKT_IPV4_OPT		= 1 << 3,
+	MLX4DV_WC_PKT_TCP		= 1 << 4,
+	MLX4DV_WC_PKT_UDP		= 1 << 5,
+	MLX4DV_WC_PKT_L3_CSUM_OK	= 1 << 6,
+	MLX4DV_WC_PKT_L4_CSUM_OK	= 1 << 7
+};
+
+/*
+ * Raw Ethernet transmit burst.  Each packet is sent as its headers,
+ * copied inline into the WQE, followed by an optional payload gather
+ * entry.  hdr_len may not exceed the QP's max_inline_data.  One
+ * doorbell, or BlueFlame write for a lone fully inline packet, covers
+ * the burst.  The number of packets posted, which are always the first
+ * ones, is returned in posted.  The return value is 0 if that is all
+ * of them, ENOMEM if the SQ filled up, and EINVAL if pkts[*posted]
+ * can't be sent as described.
+ */
+enum mlx4dv_tx_pkt_flags {
+	MLX4DV_TX_PKT_SIGNALED		= 1 << 0,
+	/* Fill in the IP header and TCP/UDP checksums */
+	MLX4DV_TX_PKT_IP_CSUM		= 1 << 1,
+	/* Insert an 802.1Q tag with vlan_tci */
+	MLX4DV_TX_PKT_INS_VLAN		= 1 << 2
+};
+
+struct mlx4dv_tx_pkt {
+	uint64_t			wr_id;
+	void			       *hdr;
+	uint32_t			hdr_len;
+	uint32_t			flags;
+	struct ibv_sge			payload;
+	uint16_t			vlan_tci;
+};
+
+int mlx4dv_tx_burst(struct ibv_qp *qp, struct mlx4dv_tx_pkt *pkts, int num,
+		    int *posted);
+
+/*
+ * Raw Ethernet receive burst.  mlx4dv_qp_start_rx() gives a QP's RQ a
+ * pool of num_bufs receive buffers of length bytes at addr + i *
+ * stride and fills the RQ from it.  mlx4dv_rx_burst() then reads up to
+ * num completed packets of that QP from its receive CQ, which must not
+ * be shared, and refills the consumed RQ slots from the pool with one
+ * doorbell record update.  The number of packets read is returned in
+ * polled, and the return value is 0, or EINVAL if the QP has no pool.  Buffers handed out in packets belong to the
+ * caller until they are given back with mlx4dv_rx_free(), which fails
+ * with EINVAL at the first buffer that is already free.  Resetting
+ * the QP returns the buffers still posted to the pool, and the RQ is
+ * filled again when the QP moves to INIT.
+ */
+struct mlx4dv_rx_pool_attr {
+	uint64_t			addr;
+	uint32_t			stride;
+	uint32_t			length;
+	uint32_t			lkey;
+	uint32_t			num_bufs;
+};
+
+enum mlx4dv_rx_pkt_flags {
+	/* Completed in error, buf holds no packet */
+	MLX4DV_RX_PKT_ERROR		= 1 << 0,
+	MLX4DV_RX_PKT_VLAN		= 1 << 1,
+	MLX4DV_RX_PKT_TIMESTAMP		= 1 << 2
+};
+
+struct mlx4dv_rx_pkt {
+	void			       *buf;
+	uint32_t			len;
+	uint32_t			flow_hash;
+	uint16_t			vlan_tci;
+	/* enum mlx4dv_wc_pkt_type, when the port reports rx checksums */
+	uint16_t			pkt_type;
+	uint32_t			flags;
+	uint64_t			timestamp;
+};
+
+int mlx4dv_qp_start_rx(struct ibv_qp *qp, struct mlx4dv_rx_pool_attr *attr);
+int mlx4dv_rx_burst(struct ibv_qp *qp, struct mlx4dv_rx_pkt *pkts, int num,
+		    int *polled);
+int mlx4dv_rx_free(struct ibv_qp *qp, void **bufs, int num);
+
+/*
+ * Software GRO on top of mlx4dv_rx_burst().  In order TCP/IPv4
+ * segments of a flow whose checksums the HCA verified are chained into
+ * one packet: the first segment keeps its headers, which are rewritten
+ * to cover the whole packet, and later segments contribute only their
+ * payload.  A flow is flushed when it reaches max_segs or max_size
+ * bytes of IP packet, when it has been held for flush_ns (0 flushes
+ * every flow before returning), or when a segment can't be merged.
+ * Flows are found by the HCA's RSS hash in a table of max_flows slots,
+ * rounded up to a power of two; a new flow with no free slot near its
+ * hash's own pushes the oldest flow there out.
+ * Every segment buffer must be given back with mlx4dv_rx_free().
+ * mlx4dv_gro_rx_burst() returns the number of packets in pkts through
+ * polled, and 0 or the error of mlx4dv_rx_burst().
+ */
+struct mlx4dv_gro_attr {
+	/* Most packets returned by one mlx4dv_gro_rx_burst() */
+	uint32_t			max_burst;
+	uint32_t			max_flows;
+	uint32_t			max_segs;
+	uint32_t			max_size;
+	uint64_t			flush_ns;
+};
+
+struct mlx4dv_gro_seg {
+	void			       *buf;
+	uint32_t			off;
+	uint32_t			len;
+};
+
+struct mlx4dv_gro_pkt {
+	/* len is the length of the merged packet */
+	struct mlx4dv_rx_pkt		pkt;
+	uint32_t			nsegs;
+	/* Valid until the next mlx4dv_gro_rx_burst() */
+	struct mlx4dv_gro_seg	       *segs;
+};
+
+/* pkts_in / pkts_out is the merge ratio */
+struct mlx4dv_gro_stats {
+	uint64_t			pkts_in;
+	uint64_t			pkts_out;
+	uint64_t			merged;
+	uint64_t			flush_size;
+	uint64_t			flush_time;
+};
+
+struct mlx4dv_gro;
+
+struct mlx4dv_gro *mlx4dv_gro_create(struct mlx4dv_gro_attr *attr);
+void mlx4dv_gro_destroy(struct mlx4dv_gro *gro);
+int mlx4dv_gro_rx_burst(struct mlx4dv_gro *gro, struct ibv_qp *qp,
+			struct mlx4dv_gro_pkt *pkts, int num, int *polled);
+void mlx4dv_gro_query_stats(struct mlx4dv_gro *gro,
+			    struct mlx4dv_gro_stats *stats);
+
+/*
+ * Registration cache.  With MLX4_MR_CACHE_SIZE set to a number of
+ * bytes, ibv_reg_mr() returns MRs backed by an existing registration of
+ * the same pd and access flags that covers the range, and
+ * ibv_dereg_mr() keeps the registration until it is evicted, least
+ * recently used first, to keep the registered bytes under that limit.
+ * A miss overlapping cached registrations replaces them with one
+ * covering all of them.  Registrations with remote access or
+ * IBV_ACCESS_MW_BIND are never cached.
+ *
+ * Idle registrations are dropped when their memory is unmapped, seen
+ * through a userfaultfd.  When one can't be opened, the cache only
+ * shares registrations that are still in use and ibv_dereg_mr() of the
+ * last one deregisters it.  mlx4dv_mr_cache_invalidate() drops the
+ * cached registrations of a range explicitly.
+ */
+struct mlx4dv_mr_cache_stats {
+	uint64_t			hits;
+	uint64_t			misses;
+	uint64_t			evictions;
+	uint64_t			invalidations;
+	/* Bytes currently registered through the cache */
+	uint64_t			size;
+};
+
+int mlx4dv_mr_cache_invalidate(struct ibv_context *context, void *addr,
+			       size_t length);
+void mlx4dv_mr_cache_query(struct ibv_context *context,
+			   struct mlx4dv_mr_cache_stats *stats);
+
+/*
+ * mlx4 specific SRQ creation attributes, see mlx4dv_create_srq().
+ */
+enum mlx4dv_srq_init_attr_mask {
+	MLX4DV_SRQ_INIT_ATTR_MASK_CREATE_FLAGS	= 1 << 0,
+	MLX4DV_SRQ_INIT_ATTR_MASK_NUMA_NODE	= 1 << 1,
+	MLX4DV_SRQ_INIT_ATTR_MASK_RESERVED	= 1 << 2
+};
+
+enum mlx4dv_srq_create_flags {
+	/*
+	 * A single thread posts receives to the SRQ.  WQEs freed by
+	 * polling the CQs its receives complete to, from any number of
+	 * threads, are then returned to the SRQ without taking its lock.
+	 * max_wr must be below 32768.
+	 */
+	MLX4DV_SRQ_CREATE_SINGLE_PRODUCER	= 1 << 0,
+	/* As MLX4DV_QP_CREATE_HUGE_BUF and _POPULATE_BUF */
+	MLX4DV_SRQ_CREATE_HUGE_BUF		= 1 << 1,
+	MLX4DV_SRQ_CREATE_POPULATE_BUF		= 1 << 2,
+	MLX4DV_SRQ_CREATE_ISOLATED_DB		= 1 << 3
+};
+
+struct mlx4dv_srq_init_attr {
+	uint64_t			comp_mask;
+	uint32_t			create_flags;
+	/* As in struct mlx4dv_qp_init_attr */
+	int				numa_node;
+};
+
+struct ibv_srq *mlx4dv_create_srq(struct ibv_pd *pd,
+				  struct ibv_srq_init_attr *attr,
+				  struct mlx4dv_srq_init_attr *mlx4_attr);
+
+/*
+ * SRQ replenishing.  The driver carves num_bufs receive buffers of
+ * length bytes out of the slab at addr (buffer i at addr + i * stride,
+ * registered with lkey) and keeps the SRQ filled from them: whenever
+ * fewer than watermark receives are posted it posts every free buffer
+ * that fits, either from the polling thread or, with
+ * MLX4DV_SRQ_REPLENISH_THREAD, from a helper thread.  Completions carry
+ * the buffer address as wr_id; hand the buffer back with
+ * mlx4dv_srq_release_buf() once it has been consumed.  Releasing a
+ * buffer whose completion wasn't polled, or releasing one twice, fails
+ * with EINVAL.  The replenisher stays attached until the SRQ is
+ * destroyed.
+ */
+enum mlx4dv_srq_replenish_flags {
+	MLX4DV_SRQ_REPLENISH_THREAD		= 1 << 0
+};
+
+struct mlx4dv_srq_replenish_attr {
+	uint32_t			flags;
+	uint32_t			watermark;
+	uint64_t			addr;
+	uint32_t			stride;
+	uint32_t			length;
+	uint32_t			lkey;
+	uint32_t			num_bufs;
+};
+
+struct mlx4dv_srq_replenish_stats {
+	uint64_t			refills;
+	uint64_t			bufs_posted;
+	/* times the SRQ dropped below the watermark, and for how long */
+	uint64_t			below_watermark;
+	uint64_t			below_watermark_ns;
+	/* refills that ran out of free buffers before the watermark */
+	uint64_t			starved;
+};
+
+int mlx4dv_srq_start_replenish(struct ibv_srq *srq,
+			       struct mlx4dv_srq_replenish_attr *attr);
+int mlx4dv_srq_release_buf(struct ibv_srq *srq, uint64_t wr_id);
+int mlx4dv_srq_query_replenish(struct ibv_srq *srq,
+			       struct mlx4dv_srq_replenish_stats *stats);
+
+/*
+ * Receive rings.  Every RQ or SRQ slot gets its own buffer, of length
+ * bytes at addr + slot * stride, written into the slot's WQE once when
+ * the ring is started; all slots are then posted.  Completions carry
+ * the buffer address as wr_id.  Releasing a buffer reposts its slot
+ * without rebuilding the WQE, and one doorbell update covers all the
+ * buffers released by a call.  num_bufs gives the capacity of the slab
+ * and returns the number of buffers the ring uses.  The queue must be
+ * empty when the ring is started.  After a QP went through RESET its
+ * ring is reposted by releasing zero buffers: buffers posted but not
+ * completed are released again, those the application holds stay
+ * with it, and posting restarts at the first slot.  Releasing a buffer
+ * the application doesn't hold, such as one released twice, fails with
+ * EINVAL and leaves it and the following ones alone.
+ */
+struct mlx4dv_recv_ring_attr {
+	uint64_t			addr;
+	uint32_t			stride;
+	uint32_t			length;
+	uint32_t			lkey;
+	uint32_t			num_bufs;
+};
+
+int mlx4dv_qp_start_recv_ring(struct ibv_qp *qp,
+			      struct mlx4dv_recv_ring_attr *attr);
+int mlx4dv_qp_release_recv(struct ibv_qp *qp, uint64_t *wr_id, int num);
+int mlx4dv_srq_start_recv_ring(struct ibv_srq *srq,
+			       struct mlx4dv_recv_ring_attr *attr);
+int mlx4dv_srq_release_recv(struct ibv_srq *srq, uint64_t *wr_id, int num);
+
+/*
+ * Post num receive buffers of length bytes each, carved from one
+ * memory region: buffer i starts at addr + i * stride and gets wr_id
+ * wr_id + i.  The doorbell record is written once for the burst.
+ * The number of buffers posted, which are always the first ones, is
+ * returned in posted.  The return value is 0 if that is all of them,
+ * ENOMEM if the queue filled up, and EINVAL if num is negative or the
+ * QP has no RQ.
+ */
+struct mlx4dv_recv_burst {
+	uint64_t			addr;
+	uint32_t			stride;
+	uint32_t			length;
+	uint32_t			lkey;
+	uint64_t			wr_id;
+	int				num;
+};
+
+int mlx4dv_post_recv_burst(struct ibv_qp *qp, struct mlx4dv_recv_burst *burst,
+			   int *posted);
+int mlx4dv_post_srq_recv_burst(struct ibv_srq *srq,
+			       struct mlx4dv_recv_burst *burst, int *posted);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MLX4DV_H */
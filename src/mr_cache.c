@@ -0,0 +1,779 @@
+/*
+ * Copyright (c) 2016 Mellanox Technologies Ltd.  All rights reserved.
+ *
+ * This software is available to you under a choice of one of two
+ * licenses.  You may choose to be licensed under the terms of the GNU
+ * General Public License (GPL) Version 2, available from the file
+ * COPYING in the main directory of this source tree, or the
+ * OpenIB.org BSD license below:
+ *
+ *     Redistribution and use in source and binary forms, with or
+ *     without modification, are permitted provided that the following
+ *     conditions are met:
+ *
+ *      - Redistributions of source code must retain the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer.
+ *
+ *      - Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following
+ *        disclaimer in the documentation and/or other materials
+ *        provided with the distribution.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#if HAVE_CONFIG_H
+#  include <config.h>
+#endif /* HAVE_CONFIG_H */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+
+#ifdef HAVE_LINUX_USERFAULTFD_H
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
+
+#include "mlx4.h"
+
+#if defined(HAVE_LINUX_USERFAULTFD_H) && defined(__NR_userfaultfd) && \
+    defined(UFFD_FEATURE_EVENT_UNMAP)
+#define MLX4_MR_TRACKER 1
+#endif
+
+/*
+ * Registrations with remote access are never cached: their rkey would
+ * stay valid after ibv_dereg_mr(), and a merged entry would expose more
+ * memory than was registered.
+ */
+enum {
+	MLX4_MR_CACHE_NO_ACCESS	= IBV_ACCESS_REMOTE_WRITE |
+				  IBV_ACCESS_REMOTE_READ  |
+				  IBV_ACCESS_REMOTE_ATOMIC |
+				  IBV_ACCESS_MW_BIND
+};
+
+/*
+ * A registration owned by the cache.  MRs handed out for it share its
+ * lkey and rkey and hold a reference; the kernel MR is only
+ * deregistered when the entry is evicted, invalidated or replaced by
+ * a larger one with no references left.
+ */
+struct mlx4_mr_entry {
+	struct ibv_mr			mr;
+	struct ibv_pd		       *pd;
+	int				access;
+	uintptr_t			start;
+	uintptr_t			end;
+	int				refcnt;
+	/* Out of the index, deregistered when the last reference goes */
+	int				stale;
+	struct mlx4_mr_entry	       *lru_prev;
+	struct mlx4_mr_entry	       *lru_next;
+};
+
+#ifdef MLX4_MR_TRACKER
+
+/*
+ * An idle registration can only be kept while something says when its
+ * memory goes away.  A single userfaultfd for the process is registered
+ * over every cached range, and a thread reads its unmap, remove and
+ * remap events and queues the ranges on every tracked cache, which
+ * drops the entries they overlap before its next lookup.
+ *
+ * The unmapping thread is woken as soon as its event is read, so the
+ * event lock is held from the read until the range is queued: a lookup
+ * taking it after munmap() returned always sees the range.  The thread
+ * never takes a cache lock, since a registration holding one may be
+ * waiting on it to resolve a fault.
+ */
+static struct {
+	/* Protects users, fd and the thread */
+	pthread_mutex_t		lock;
+	int			users;
+	int			fd;
+	int			stop_fd[2];
+	long			page_size;
+	pthread_t		thread;
+	/* Protects caches and their pending ranges */
+	pthread_mutex_t		event_lock;
+	struct mlx4_mr_cache   *caches;
+} tracker = {
+	.lock		= PTHREAD_MUTEX_INITIALIZER,
+	.fd		= -1,
+	.event_lock	= PTHREAD_MUTEX_INITIALIZER
+};
+
+static void tracker_queue(uintptr_t start, uintptr_t end)
+{
+	struct mlx4_mr_cache *cache;
+
+	for (cache = tracker.caches; cache; cache = cache->next_tracked) {
+		if (cache->num_pending == MLX4_MR_CACHE_PENDING) {
+			cache->pending_overflow = 1;
+			continue;
+		}
+		cache->pending[cache->num_pending].start = start;
+		cache->pending[cache->num_pending].end	 = end;
+		++cache->num_pending;
+	}
+}
+
+/* Also wakes threads faulting in the range */
+static void tracker_unregister(uintptr_t start, uintptr_t end)
+{
+	struct uffdio_range range;
+
+	range.start = start;
+	range.len   = end - start;
+
+	/* Fails for whatever was already unmapped, which is fine */
+	ioctl(tracker.fd, UFFDIO_UNREGISTER, &range);
+}
+
+static void tracker_read_events(void)
+{
+	struct uffd_msg msg[16];
+	uintptr_t start;
+	ssize_t n;
+	int i;
+
+	pthread_mutex_lock(&tracker.event_lock);
+
+	while ((n = read(tracker.fd, msg, sizeof msg)) > 0) {
+		for (i = 0; i < n / sizeof *msg; ++i) {
+			switch (msg[i].event) {
+			case UFFD_EVENT_UNMAP:
+				tracker_queue(msg[i].arg.remove.start,
+					      msg[i].arg.remove.end);
+				break;
+
+			case UFFD_EVENT_REMOVE:
+				tracker_queue(msg[i].arg.remove.start,
+					      msg[i].arg.remove.end);
+				tracker_unregister(msg[i].arg.remove.start,
+						   msg[i].arg.remove.end);
+				break;
+
+			case UFFD_EVENT_REMAP:
+				tracker_queue(msg[i].arg.remap.from,
+					      msg[i].arg.remap.from +
+					      msg[i].arg.remap.len);
+				tracker_unregister(msg[i].arg.remap.to,
+						   msg[i].arg.remap.to +
+						   msg[i].arg.remap.len);
+				break;
+
+			case UFFD_EVENT_PAGEFAULT:
+				/*
+				 * A page of a tracked range was dropped
+				 * without an event, e.g. by a hole punched
+				 * in its shmem file.
+				 */
+				start = msg[i].arg.pagefault.address &
+					~(tracker.page_size - 1);
+				tracker_queue(start, start + tracker.page_size);
+				tracker_unregister(start,
+						   start + tracker.page_size);
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&tracker.event_lock);
+}
+
+static void *tracker_thread(void *arg)
+{
+	struct pollfd fds[2];
+
+	fds[0].fd     = tracker.fd;
+	fds[0].events = POLLIN;
+	fds[1].fd     = tracker.stop_fd[0];
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (poll(fds, 2, -1) < 0)
+			continue;
+		if (fds[1].revents)
+			break;
+		if (fds[0].revents)
+			tracker_read_events();
+	}
+
+	return NULL;
+}
+
+static int tracker_start(void)
+{
+	struct uffdio_api api;
+	sigset_t all, old;
+	int ret;
+
+	/* Without privileges this fails for faults taken in the kernel */
+	tracker.fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (tracker.fd < 0)
+		return errno;
+
+	memset(&api, 0, sizeof api);
+	api.api	     = UFFD_API;
+	api.features = UFFD_FEATURE_EVENT_REMAP | UFFD_FEATURE_EVENT_REMOVE |
+		       UFFD_FEATURE_EVENT_UNMAP;
+	if (ioctl(tracker.fd, UFFDIO_API, &api) ||
+	    pipe2(tracker.stop_fd, O_CLOEXEC)) {
+		ret = errno;
+		goto err;
+	}
+
+	tracker.page_size = sysconf(_SC_PAGESIZE);
+
+	/* Signal handlers must not run on the thread unmapping depends on */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	ret = pthread_create(&tracker.thread, NULL, tracker_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (!ret)
+		return 0;
+
+	close(tracker.stop_fd[0]);
+	close(tracker.stop_fd[1]);
+err:
+	close(tracker.fd);
+	tracker.fd = -1;
+	return ret;
+}
+
+static void tracker_add(struct mlx4_mr_cache *cache)
+{
+	pthread_mutex_lock(&tracker.lock);
+
+	if (tracker.users || !tracker_start()) {
+		++tracker.users;
+		pthread_mutex_lock(&tracker.event_lock);
+		cache->next_tracked = tracker.caches;
+		tracker.caches	    = cache;
+		pthread_mutex_unlock(&tracker.event_lock);
+		cache->tracked = 1;
+	}
+
+	pthread_mutex_unlock(&tracker.lock);
+}
+
+static void tracker_del(struct mlx4_mr_cache *cache)
+{
+	struct mlx4_mr_cache **prev;
+
+	if (!cache->tracked)
+		return;
+
+	pthread_mutex_lock(&tracker.lock);
+
+	pthread_mutex_lock(&tracker.event_lock);
+	for (prev = &tracker.caches; *prev != cache; prev = &(*prev)->next_tracked)
+		; /* nothing */
+	*prev = cache->next_tracked;
+	pthread_mutex_unlock(&tracker.event_lock);
+
+	if (!--tracker.users) {
+		if (write(tracker.stop_fd[1], "", 1) == 1)
+			pthread_join(tracker.thread, NULL);
+		close(tracker.stop_fd[0]);
+		close(tracker.stop_fd[1]);
+		/* Unregisters every range left */
+		close(tracker.fd);
+		tracker.fd = -1;
+	}
+
+	pthread_mutex_unlock(&tracker.lock);
+}
+
+/*
+ * Start getting events for the pages of [start, end).  Ranges stay
+ * registered when their entry goes, until they are unmapped.
+ */
+static int tracker_register(uintptr_t start, uintptr_t end)
+{
+	struct uffdio_register reg;
+
+	start &= ~(tracker.page_size - 1);
+	end    = (end + tracker.page_size - 1) & ~(tracker.page_size - 1);
+
+	memset(&reg, 0, sizeof reg);
+	reg.range.start = start;
+	reg.range.len	= end - start;
+	reg.mode	= UFFDIO_REGISTER_MODE_MISSING;
+
+	return ioctl(tracker.fd, UFFDIO_REGISTER, &reg) ? errno : 0;
+}
+
+/* Take the ranges queued for cache since the last call */
+static int tracker_take_pending(struct mlx4_mr_cache *cache,
+				struct mlx4_mr_range *pending, int *overflow)
+{
+	int num;
+
+	pthread_mutex_lock(&tracker.event_lock);
+
+	num	  = cache->num_pending;
+	*overflow = cache->pending_overflow;
+	memcpy(pending, cache->pending, num * sizeof *pending);
+	cache->num_pending	= 0;
+	cache->pending_overflow = 0;
+
+	pthread_mutex_unlock(&tracker.event_lock);
+
+	return num;
+}
+
+#else /* MLX4_MR_TRACKER */
+
+static void tracker_add(struct mlx4_mr_cache *cache)
+{
+}
+
+static void tracker_del(struct mlx4_mr_cache *cache)
+{
+}
+
+static int tracker_register(uintptr_t start, uintptr_t end)
+{
+	return ENOSYS;
+}
+
+static int tracker_take_pending(struct mlx4_mr_cache *cache,
+				struct mlx4_mr_range *pending, int *overflow)
+{
+	*overflow = 0;
+	return 0;
+}
+
+#endif /* MLX4_MR_TRACKER */
+
+void mlx4_init_mr_cache(struct mlx4_context *context)
+{
+	struct mlx4_mr_cache *cache = &context->mr_cache;
+	char *env;
+
+	memset(cache, 0, sizeof *cache);
+	pthread_mutex_init(&cache->lock, NULL);
+
+	env = getenv("MLX4_MR_CACHE_SIZE");
+	cache->max_size = env ? strtoull(env, NULL, 0) : 0;
+
+	if (cache->max_size)
+		tracker_add(cache);
+}
+
+static int entry_cmp(struct mlx4_mr_entry *entry, struct ibv_pd *pd,
+		     int access, uintptr_t start)
+{
+	if (entry->pd != pd)
+		return (uintptr_t) entry->pd < (uintptr_t) pd ? -1 : 1;
+	if (entry->access != access)
+		return entry->access < access ? -1 : 1;
+	if (entry->start != start)
+		return entry->start < start ? -1 : 1;
+	return 0;
+}
+
+/* Index of the first entry sorting after (pd, access, start) */
+static int index_upper(struct mlx4_mr_cache *cache, struct ibv_pd *pd,
+		       int access, uintptr_t start)
+{
+	int lo = 0;
+	int hi = cache->num;
+	int mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (entry_cmp(cache->index[mid], pd, access, start) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static int index_insert(struct mlx4_mr_cache *cache,
+			struct mlx4_mr_entry *entry)
+{
+	struct mlx4_mr_entry **index;
+	int i;
+
+	if (cache->num == cache->max) {
+		index = realloc(cache->index, (cache->max ? cache->max * 2 : 64) *
+				sizeof *index);
+		if (!index)
+			return ENOMEM;
+		cache->index = index;
+		cache->max   = cache->max ? cache->max * 2 : 64;
+	}
+
+	i = index_upper(cache, entry->pd, entry->access, entry->start);
+	memmove(cache->index + i + 1, cache->index + i,
+		(cache->num - i) * sizeof *cache->index);
+	cache->index[i] = entry;
+	++cache->num;
+
+	return 0;
+}
+
+static void index_remove(struct mlx4_mr_cache *cache, int i)
+{
+	--cache->num;
+	memmove(cache->index + i, cache->index + i + 1,
+		(cache->num - i) * sizeof *cache->index);
+}
+
+static void lru_add(struct mlx4_mr_cache *cache, struct mlx4_mr_entry *entry)
+{
+	entry->lru_prev = NULL;
+	entry->lru_next = cache->lru_head;
+	if (cache->lru_head)
+		cache->lru_head->lru_prev = entry;
+	else
+		cache->lru_tail = entry;
+	cache->lru_head = entry;
+}
+
+static void lru_del(struct mlx4_mr_cache *cache, struct mlx4_mr_entry *entry)
+{
+	if (entry->lru_prev)
+		entry->lru_prev->lru_next = entry->lru_next;
+	else
+		cache->lru_head = entry->lru_next;
+	if (entry->lru_next)
+		entry->lru_next->lru_prev = entry->lru_prev;
+	else
+		cache->lru_tail = entry->lru_prev;
+}
+
+static void entry_destroy(struct mlx4_mr_cache *cache,
+			  struct mlx4_mr_entry *entry)
+{
+	ibv_cmd_dereg_mr(&entry->mr);
+	ibv_dofork_range((void *) entry->start, entry->end - entry->start);
+	cache->size -= entry->end - entry->start;
+	cache->stats.size = cache->size;
+	free(entry);
+}
+
+/*
+ * Take the entry at index i out of the index: an idle entry is
+ * deregistered now, a referenced one when it is released.
+ */
+static void entry_retire(struct mlx4_mr_cache *cache, int i)
+{
+	struct mlx4_mr_entry *entry = cache->index[i];
+
+	index_remove(cache, i);
+
+	if (entry->refcnt) {
+		entry->stale = 1;
+	} else {
+		lru_del(cache, entry);
+		entry_destroy(cache, entry);
+	}
+}
+
+static void invalidate(struct mlx4_mr_cache *cache, uintptr_t start,
+		       uintptr_t end)
+{
+	int i;
+
+	for (i = 0; i < cache->num; )
+		if (cache->index[i]->start < end && cache->index[i]->end > start) {
+			entry_retire(cache, i);
+			++cache->stats.invalidations;
+		} else {
+			++i;
+		}
+}
+
+/*
+ * Drop the entries over memory the tracker saw go away.  Called with
+ * the cache lock held before looking anything up.
+ */
+static void invalidate_pending(struct mlx4_mr_cache *cache)
+{
+	struct mlx4_mr_range pending[MLX4_MR_CACHE_PENDING];
+	int overflow;
+	int num;
+	int i;
+
+	if (!cache->tracked)
+		return;
+
+	num = tracker_take_pending(cache, pending, &overflow);
+
+	if (overflow) {
+		invalidate(cache, 0, UINTPTR_MAX);
+		return;
+	}
+
+	for (i = 0; i < num; ++i)
+		invalidate(cache, pending[i].start, pending[i].end);
+}
+
+static void evict(struct mlx4_mr_cache *cache)
+{
+	struct mlx4_mr_entry *entry;
+	int i;
+
+	while (cache->size > cache->max_size && cache->lru_tail) {
+		entry = cache->lru_tail;
+		i = index_upper(cache, entry->pd, entry->access,
+				entry->start) - 1;
+		entry_retire(cache, i);
+		++cache->stats.evictions;
+	}
+}
+
+static void mr_set_keys(struct mlx4_mr *mr, struct mlx4_mr_entry *entry)
+{
+	mr->ibv_mr.handle = entry->mr.handle;
+	mr->ibv_mr.lkey	  = entry->mr.lkey;
+	mr->ibv_mr.rkey	  = entry->mr.rkey;
+	mr->entry	  = entry;
+}
+
+static struct mlx4_mr_entry *entry_reg(struct ibv_pd *pd, int access,
+				       uintptr_t start, uintptr_t end)
+{
+	struct mlx4_mr_entry *entry;
+	struct ibv_reg_mr cmd;
+	struct ibv_reg_mr_resp resp;
+
+	entry = calloc(1, sizeof *entry);
+	if (!entry)
+		return NULL;
+
+	/*
+	 * ibv_dereg_mr() of each MR handed out from the entry undoes
+	 * only its own range, so the entry keeps the pages out of
+	 * fork() itself for as long as it stays registered.
+	 */
+	if (ibv_dontfork_range((void *) start, end - start))
+		goto err;
+
+	if (ibv_cmd_reg_mr(pd, (void *) start, end - start, start, access,
+			   &entry->mr, &cmd, sizeof cmd, &resp, sizeof resp)) {
+		ibv_dofork_range((void *) start, end - start);
+		goto err;
+	}
+
+	entry->mr.context = pd->context;
+	entry->mr.pd	  = pd;
+	entry->mr.addr	  = (void *) start;
+	entry->mr.length  = end - start;
+	entry->pd	  = pd;
+	entry->access	  = access;
+	entry->start	  = start;
+	entry->end	  = end;
+	entry->refcnt	  = 1;
+
+	return entry;
+
+err:
+	free(entry);
+	return NULL;
+}
+
+/*
+ * Fill in mr from a cached registration covering the range, creating
+ * one if needed.  Returns ENOENT when the range can't be cached, and
+ * the caller registers it by itself.  A registration the tracker can't
+ * watch is handed out stale, shared by nobody.
+ */
+int mlx4_mr_cache_get(struct ibv_pd *pd, void *addr, size_t length,
+		      int access, struct mlx4_mr *mr)
+{
+	struct mlx4_mr_cache *cache = &to_mctx(pd->context)->mr_cache;
+	struct mlx4_mr_entry *entry;
+	uintptr_t start = (uintptr_t) addr;
+	uintptr_t end = start + length;
+	uintptr_t ustart = start;
+	uintptr_t uend = end;
+	int first;
+	int i;
+
+	if (!cache->max_size || length > cache->max_size ||
+	    access & MLX4_MR_CACHE_NO_ACCESS)
+		return ENOENT;
+
+	pthread_mutex_lock(&cache->lock);
+
+	invalidate_pending(cache);
+
+	first = i = index_upper(cache, pd, access, start);
+
+	/* The entry starting at or before addr is the only one that can cover it */
+	entry = i ? cache->index[i - 1] : NULL;
+	if (entry && entry->pd == pd && entry->access == access) {
+		if (entry->end >= end) {
+			if (!entry->refcnt++)
+				lru_del(cache, entry);
+			++cache->stats.hits;
+			mr_set_keys(mr, entry);
+			pthread_mutex_unlock(&cache->lock);
+			return 0;
+		}
+		if (entry->end > start) {
+			ustart = entry->start;
+			first  = i - 1;
+		}
+	}
+
+	++cache->stats.misses;
+
+	/* Register the union of the range and everything it overlaps */
+	for (; i < cache->num; ++i) {
+		entry = cache->index[i];
+		if (entry->pd != pd || entry->access != access ||
+		    entry->start >= end)
+			break;
+		if (entry->end > uend)
+			uend = entry->end;
+	}
+
+	if (uend - ustart > cache->max_size) {
+		pthread_mutex_unlock(&cache->lock);
+		return ENOENT;
+	}
+
+	entry = entry_reg(pd, access, ustart, uend);
+	if (!entry) {
+		pthread_mutex_unlock(&cache->lock);
+		return ENOENT;
+	}
+
+	if (cache->tracked && tracker_register(ustart, uend)) {
+		/*
+		 * No events for this memory (file backed, or another
+		 * userfaultfd has it): hand the entry out uncached.
+		 */
+		entry->stale = 1;
+	} else {
+		while (i-- > first)
+			entry_retire(cache, first);
+
+		if (index_insert(cache, entry)) {
+			ibv_cmd_dereg_mr(&entry->mr);
+			free(entry);
+			pthread_mutex_unlock(&cache->lock);
+			return ENOENT;
+		}
+	}
+
+	cache->size += uend - ustart;
+	cache->stats.size = cache->size;
+	evict(cache);
+
+	mr_set_keys(mr, entry);
+
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+void mlx4_mr_cache_put(struct mlx4_context *context, struct mlx4_mr *mr)
+{
+	struct mlx4_mr_cache *cache = &context->mr_cache;
+	struct mlx4_mr_entry *entry = mr->entry;
+
+	pthread_mutex_lock(&cache->lock);
+
+	invalidate_pending(cache);
+
+	if (!--entry->refcnt) {
+		if (entry->stale) {
+			entry_destroy(cache, entry);
+		} else if (!cache->tracked) {
+			/* Nothing would tell us when its memory is unmapped */
+			index_remove(cache, index_upper(cache, entry->pd,
+							entry->access,
+							entry->start) - 1);
+			entry_destroy(cache, entry);
+		} else {
+			lru_add(cache, entry);
+			evict(cache);
+		}
+	}
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+/*
+ * Drop the idle registrations of a pd so that it can be deallocated.
+ */
+void mlx4_mr_cache_flush_pd(struct ibv_pd *pd)
+{
+	struct mlx4_mr_cache *cache = &to_mctx(pd->context)->mr_cache;
+	int i;
+
+	pthread_mutex_lock(&cache->lock);
+
+	for (i = index_upper(cache, pd, -1, 0);
+	     i < cache->num && cache->index[i]->pd == pd; )
+		if (cache->index[i]->refcnt)
+			++i;
+		else
+			entry_retire(cache, i);
+
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void mlx4_cleanup_mr_cache(struct mlx4_context *context)
+{
+	struct mlx4_mr_cache *cache = &context->mr_cache;
+
+	tracker_del(cache);
+
+	while (cache->lru_tail)
+		entry_retire(cache, index_upper(cache, cache->lru_tail->pd,
+						cache->lru_tail->access,
+						cache->lru_tail->start) - 1);
+
+	free(cache->index);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+int mlx4dv_mr_cache_invalidate(struct ibv_context *context, void *addr,
+			       size_t length)
+{
+	struct mlx4_mr_cache *cache = &to_mctx(context)->mr_cache;
+
+	pthread_mutex_lock(&cache->lock);
+	invalidate(cache, (uintptr_t) addr, (uintptr_t) addr + length);
+	pthread_mutex_unlock(&cache->lock);
+
+	return 0;
+}
+
+void mlx4dv_mr_cache_query(struct ibv_context *context,
+			   struct mlx4dv_mr_cache_stats *stats)
+{
+	struct mlx4_mr_cache *cache = &to_mctx(context)->mr_cache;
+
+	pthread_mutex_lock(&cache->lock);
+	*stats = cache->stats;
+	pthread_mutex_unlock(&cache->lock);
+}
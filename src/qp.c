@@ -71,9 +71,8 @@ static void *get_send_wqe(struct mlx4_qp *qp, int n)
  * first four bytes of every 64 byte chunk with 0xffffffff, except for
  * the very first chunk of the WQE.
  */
-static void stamp_send_wqe(struct mlx4_qp *qp, int n)
+static void stamp_wqe_chunks(uint32_t *wqe)
 {
-	uint32_t *wqe = get_send_wqe(qp, n);
 	int i;
 	int ds = (((struct mlx4_wqe_ctrl_seg *)wqe)->fence_size & 0x3f) << 2;
 
@@ -81,14 +80,79 @@ static void stamp_send_wqe(struct mlx4_qp *qp, int n)
 		wqe[i] = 0xffffffff;
 }
 
+static void init_send_wqe(struct mlx4_qp *qp, int n)
+{
+	struct mlx4_wqe_ctrl_seg *ctrl = get_send_wqe(qp, n);
+
+	ctrl->owner_opcode = htonl(1 << 31);
+	ctrl->fence_size = 1 << (qp->sq.wqe_shift - 4);
+
+	stamp_wqe_chunks((uint32_t *) ctrl);
+}
+
+/*
+ * A WQE with a zero size has never been written: the SQ is set up
+ * lazily, see mlx4_qp_init_sq_ownership().  When n or the WQE after it
+ * is the first one past the initialized part, initialize it along with
+ * the spare WQEs behind it.  Looking one WQE ahead keeps n + 1 set up
+ * once n is stamped, so the WQE a spare past the last one of a batch,
+ * whose stamp is deferred until after the doorbell, is never still
+ * zeroed when the HCA may prefetch it.
+ */
+static void stamp_send_wqe(struct mlx4_qp *qp, int n)
+{
+	struct mlx4_wqe_ctrl_seg *ctrl = get_send_wqe(qp, n);
+	int end;
+	int i = n;
+
+	if (ctrl->fence_size) {
+		stamp_wqe_chunks((uint32_t *) ctrl);
+		i = n + 1;
+	}
+
+	if (i == qp->sq.wqe_cnt ||
+	    ((struct mlx4_wqe_ctrl_seg *) get_send_wqe(qp, i))->fence_size)
+		return;
+
+	for (end = i + qp->sq_spare_wqes; i < qp->sq.wqe_cnt && i <= end; ++i)
+		init_send_wqe(qp, i);
+}
+
 void mlx4_init_qp_indices(struct mlx4_qp *qp)
 {
+	struct mlx4_rx_pool *pool = qp->rx_pool;
+	uint32_t buf;
+	int ind;
+
+	/*
+	 * Buffers still posted go back to the pool, or are released
+	 * again in a ring.  Those the application holds stay with it.
+	 */
+	for (; qp->rq.tail != qp->rq.head; ++qp->rq.tail) {
+		ind = qp->rq.tail & (qp->rq.wqe_cnt - 1);
+		if (pool) {
+			buf = (qp->rq.wrid[ind] - pool->addr) / pool->stride;
+			pool->free_bufs[pool->num_free++] = buf;
+			pool->is_free[buf] = 1;
+		} else if (qp->recv_ring)
+			qp->recv_ring->state[ind] = MLX4_RING_RELEASED;
+	}
+
 	qp->sq.head	 = 0;
 	qp->sq.tail	 = 0;
 	qp->rq.head	 = 0;
 	qp->rq.tail	 = 0;
+
+	qp->sq_next_signal = qp->sq_signal_period - 1;
 }
 
+/*
+ * Give the SQ WQEs to software before the QP moves to INIT.  Only the
+ * WQEs the HCA may prefetch ahead of the first post are set up here,
+ * plus any written during earlier use of the QP: the SQ starts out
+ * zeroed, and stamp_send_wqe() initializes the rest as posting
+ * reaches them, instead of touching every page of a large SQ up front.
+ */
 void mlx4_qp_init_sq_ownership(struct mlx4_qp *qp)
 {
 	struct mlx4_wqe_ctrl_seg *ctrl;
@@ -96,10 +160,10 @@ void mlx4_qp_init_sq_ownership(struct mlx4_qp *qp)
 
 	for (i = 0; i < qp->sq.wqe_cnt; ++i) {
 		ctrl = get_send_wqe(qp, i);
-		ctrl->owner_opcode = htonl(1 << 31);
-		ctrl->fence_size = 1 << (qp->sq.wqe_shift - 4);
+		if (i > 2 * qp->sq_spare_wqes && !ctrl->fence_size)
+			break;
 
-		stamp_send_wqe(qp, i);
+		init_send_wqe(qp, i);
 	}
 }
 
@@ -118,6 +182,44 @@ static int wq_overflow(struct mlx4_wq *wq, int nreq, struct mlx4_cq *cq)
 	return cur + nreq >= wq->max_post;
 }
 
+/*
+ * With MLX4DV_QP_CREATE_AUTO_SIGNAL, ask for a completion on every
+ * sq_signal_period-th WQE so that the SQ gets reclaimed even if the
+ * application never signals.  A WQE the application signaled itself
+ * restarts the period.
+ */
+static inline uint32_t sq_auto_signal(struct mlx4_qp *qp, unsigned ind,
+				      int signaled)
+{
+	if (!signaled && (int) (ind - qp->sq_next_signal) < 0)
+		return 0;
+
+	qp->sq_next_signal = ind + qp->sq_signal_period;
+
+	return htonl(MLX4_WQE_CTRL_CQ_UPDATE);
+}
+
+/*
+ * Like wq_overflow(), but returns how many of nreq new WQEs fit.
+ */
+static int wq_room(struct mlx4_wq *wq, int nreq, struct mlx4_cq *cq)
+{
+	unsigned cur;
+
+	cur = wq->head - wq->tail;
+	if (cur + nreq <= wq->max_post)
+		return nreq;
+
+	pthread_spin_lock(&cq->lock);
+	cur = wq->head - wq->tail;
+	pthread_spin_unlock(&cq->lock);
+
+	if (cur >= wq->max_post)
+		return 0;
+
+	return cur + nreq <= wq->max_post ? nreq : wq->max_post - cur;
+}
+
 static inline void set_raddr_seg(struct mlx4_wqe_raddr_seg *rseg,
 				 uint64_t remote_addr, uint32_t rkey)
 {
@@ -138,14 +240,31 @@ static void set_atomic_seg(struct mlx4_wqe_atomic_seg *aseg, struct ibv_send_wr
 
 }
 
+static void set_masked_atomic_seg(struct mlx4_wqe_masked_atomic_seg *aseg,
+				  struct mlx4dv_atomic_wr *wr)
+{
+	aseg->swap_add	    = htonll(wr->op.cmp_swap.swap);
+	aseg->compare	    = htonll(wr->op.cmp_swap.compare);
+	aseg->swap_add_mask = htonll(wr->op.cmp_swap.swap_mask);
+	aseg->compare_mask  = htonll(wr->op.cmp_swap.compare_mask);
+}
+
+static void set_masked_fetch_add_seg(struct mlx4_wqe_atomic_seg *aseg,
+				     struct mlx4dv_atomic_wr *wr)
+{
+	aseg->swap_add = htonll(wr->op.fetch_add.add);
+	aseg->compare  = htonll(wr->op.fetch_add.field_boundary);
+}
+
 static void set_datagram_seg(struct mlx4_wqe_datagram_seg *dseg,
-			     struct ibv_send_wr *wr)
+			     struct mlx4_ah *ah, uint32_t remote_qpn,
+			     uint32_t remote_qkey)
 {
-	memcpy(dseg->av, &to_mah(wr->wr.ud.ah)->av, sizeof (struct mlx4_av));
-	dseg->dqpn = htonl(wr->wr.ud.remote_qpn);
-	dseg->qkey = htonl(wr->wr.ud.remote_qkey);
-	dseg->vlan = htons(to_mah(wr->wr.ud.ah)->vlan);
-	memcpy(dseg->mac, to_mah(wr->wr.ud.ah)->mac, 6);
+	memcpy(dseg->av, &ah->av, sizeof (struct mlx4_av));
+	dseg->dqpn = htonl(remote_qpn);
+	dseg->qkey = htonl(remote_qkey);
+	dseg->vlan = htons(ah->vlan);
+	memcpy(dseg->mac, ah->mac, 6);
 }
 
 static void __set_data_seg(struct mlx4_wqe_data_seg *dseg, struct ibv_sge *sg)
@@ -173,22 +292,133 @@ static void set_data_seg(struct mlx4_wqe_data_seg *dseg, struct ibv_sge *sg)
 	dseg->byte_count = htonl(sg->length);
 }
 
-int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
-			  struct ibv_send_wr **bad_wr)
+/*
+ * Copy the scatter list into the WQE as inline data segments.
+ * Returns the number of 16 byte units used in *sz and the number of
+ * inline bytes in *inl, or ENOMEM if the data doesn't fit.
+ */
+static int set_inline_data(struct mlx4_qp *qp, void *wqe,
+			   struct ibv_sge *sg_list, int num_sge,
+			   int *inl, int *sz)
+{
+	struct mlx4_wqe_inline_seg *seg;
+	void *addr;
+	int len, seg_len;
+	int num_seg;
+	int off, to_copy;
+	int i;
+
+	*inl = 0;
+
+	seg = wqe;
+	wqe += sizeof *seg;
+	off = ((uintptr_t) wqe) & (MLX4_INLINE_ALIGN - 1);
+	num_seg = 0;
+	seg_len = 0;
+
+	for (i = 0; i < num_sge; ++i) {
+		addr = (void *) (uintptr_t) sg_list[i].addr;
+		len  = sg_list[i].length;
+		*inl += len;
+
+		if (*inl > qp->max_inline_data) {
+			*inl = 0;
+			return ENOMEM;
+		}
+
+		while (len >= MLX4_INLINE_ALIGN - off) {
+			to_copy = MLX4_INLINE_ALIGN - off;
+			memcpy(wqe, addr, to_copy);
+			len -= to_copy;
+			wqe += to_copy;
+			addr += to_copy;
+			seg_len += to_copy;
+			wmb(); /* see comment below */
+			seg->byte_count = htonl(MLX4_INLINE_SEG | seg_len);
+			seg_len = 0;
+			seg = wqe;
+			wqe += sizeof *seg;
+			off = sizeof *seg;
+			++num_seg;
+		}
+
+		memcpy(wqe, addr, len);
+		wqe += len;
+		seg_len += len;
+		off += len;
+	}
+
+	if (seg_len) {
+		++num_seg;
+		/*
+		 * Need a barrier here to make sure
+		 * all the data is visible before the
+		 * byte_count field is set.  Otherwise
+		 * the HCA prefetcher could grab the
+		 * 64-byte chunk with this inline
+		 * segment and get a valid (!=
+		 * 0xffffffff) byte count but stale
+		 * data, and end up sending the wrong
+		 * data.
+		 */
+		wmb();
+		seg->byte_count = htonl(MLX4_INLINE_SEG | seg_len);
+	}
+
+	*sz = (*inl + num_seg * sizeof *seg + 15) / 16;
+
+	return 0;
+}
+
+/*
+ * Copy len bytes of already built data segments from one WQE to
+ * another.  Both start on a 64 byte boundary, so the first dword of
+ * every chunk is a byte count that is written only after the rest of
+ * the chunk is visible, for the same reason as in set_data_seg().
+ */
+static void copy_wqe_data(void *dst, void *src, int len)
+{
+	int off;
+
+	for (off = 0; off < len; off += MLX4_INLINE_ALIGN)
+		memcpy(dst + off + 4, src + off + 4,
+		       (len - off < MLX4_INLINE_ALIGN ?
+			len - off : MLX4_INLINE_ALIGN) - 4);
+
+	wmb();
+
+	for (off = 0; off < len; off += MLX4_INLINE_ALIGN)
+		*(uint32_t *) (dst + off) = *(uint32_t *) (src + off);
+}
+
+/*
+ * Build the WQEs for a list of send WRs, without advancing sq.head or
+ * ringing the doorbell.  Must be called with the SQ lock held.  On
+ * return *pnreq is the number of WQEs built, and *pctrl, *pinl and
+ * *psize describe the last one, which is what the BlueFlame path
+ * needs.  Unless stamp_last is set, the WQE following the last one is
+ * left for the caller to stamp after ringing the doorbell.
+ */
+static inline int build_send_wqes(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				  struct ibv_send_wr **bad_wr, int *pnreq,
+				  struct mlx4_wqe_ctrl_seg **pctrl, int *pinl,
+				  int *psize, int stamp_last)
+	ALWAYS_INLINE;
+static inline int build_send_wqes(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+				  struct ibv_send_wr **bad_wr, int *pnreq,
+				  struct mlx4_wqe_ctrl_seg **pctrl, int *pinl,
+				  int *psize, int stamp_last)
 {
-	struct mlx4_context *ctx;
 	struct mlx4_qp *qp = to_mqp(ibqp);
 	void *wqe;
-	struct mlx4_wqe_ctrl_seg *ctrl;
+	struct mlx4_wqe_ctrl_seg *ctrl = NULL;
 	int ind;
 	int nreq;
 	int inl = 0;
 	int ret = 0;
-	int size;
+	int size = 0;
 	int i;
 
-	pthread_spin_lock(&qp->sq.lock);
-
 	/* XXX check that state is OK to post send */
 
 	ind = qp->sq.head;
@@ -213,7 +443,8 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		}
 
 		ctrl = wqe = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
-		qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = wr->wr_id;
+		if (qp->sq.wrid)
+			qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = wr->wr_id;
 
 		ctrl->srcrb_flags =
 			(wr->send_flags & IBV_SEND_SIGNALED ?
@@ -221,6 +452,10 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			(wr->send_flags & IBV_SEND_SOLICITED ?
 			 htonl(MLX4_WQE_CTRL_SOLICIT) : 0)   |
 			qp->sq_signal_bits;
+		if (qp->create_flags & MLX4DV_QP_CREATE_AUTO_SIGNAL)
+			ctrl->srcrb_flags |=
+				sq_auto_signal(qp, ind,
+					       wr->send_flags & IBV_SEND_SIGNALED);
 
 		if (wr->opcode == IBV_WR_SEND_WITH_IMM ||
 		    wr->opcode == IBV_WR_RDMA_WRITE_WITH_IMM)
@@ -272,7 +507,9 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			break;
 
 		case IBV_QPT_UD:
-			set_datagram_seg(wqe, wr);
+			set_datagram_seg(wqe, to_mah(wr->wr.ud.ah),
+					 wr->wr.ud.remote_qpn,
+					 wr->wr.ud.remote_qkey);
 			wqe  += sizeof (struct mlx4_wqe_datagram_seg);
 			size += sizeof (struct mlx4_wqe_datagram_seg) / 16;
 
@@ -291,6 +528,9 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 			/* For raw eth, the MLX4_WQE_CTRL_SOLICIT flag is used
 			 * to indicate that no icrc should be calculated */
 			ctrl->srcrb_flags |= htonl(MLX4_WQE_CTRL_SOLICIT);
+			/* Don't inherit a VLAN from mlx4dv_tx_burst() */
+			ctrl->vlan_tag = 0;
+			ctrl->ins_vlan = 0;
 			if (wr->send_flags & IBV_SEND_IP_CSUM) {
 				if (!(qp->qp_cap_cache & MLX4_CSUM_SUPPORT_RAW_OVER_ETH)) {
 					ret = EINVAL;
@@ -307,72 +547,16 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		}
 
 		if (wr->send_flags & IBV_SEND_INLINE && wr->num_sge) {
-			struct mlx4_wqe_inline_seg *seg;
-			void *addr;
-			int len, seg_len;
-			int num_seg;
-			int off, to_copy;
-
-			inl = 0;
-
-			seg = wqe;
-			wqe += sizeof *seg;
-			off = ((uintptr_t) wqe) & (MLX4_INLINE_ALIGN - 1);
-			num_seg = 0;
-			seg_len = 0;
-
-			for (i = 0; i < wr->num_sge; ++i) {
-				addr = (void *) (uintptr_t) wr->sg_list[i].addr;
-				len  = wr->sg_list[i].length;
-				inl += len;
-
-				if (inl > qp->max_inline_data) {
-					inl = 0;
-					ret = ENOMEM;
-					*bad_wr = wr;
-					goto out;
-				}
-
-				while (len >= MLX4_INLINE_ALIGN - off) {
-					to_copy = MLX4_INLINE_ALIGN - off;
-					memcpy(wqe, addr, to_copy);
-					len -= to_copy;
-					wqe += to_copy;
-					addr += to_copy;
-					seg_len += to_copy;
-					wmb(); /* see comment below */
-					seg->byte_count = htonl(MLX4_INLINE_SEG | seg_len);
-					seg_len = 0;
-					seg = wqe;
-					wqe += sizeof *seg;
-					off = sizeof *seg;
-					++num_seg;
-				}
-
-				memcpy(wqe, addr, len);
-				wqe += len;
-				seg_len += len;
-				off += len;
-			}
+			int sz;
 
-			if (seg_len) {
-				++num_seg;
-				/*
-				 * Need a barrier here to make sure
-				 * all the data is visible before the
-				 * byte_count field is set.  Otherwise
-				 * the HCA prefetcher could grab the
-				 * 64-byte chunk with this inline
-				 * segment and get a valid (!=
-				 * 0xffffffff) byte count but stale
-				 * data, and end up sending the wrong
-				 * data.
-				 */
-				wmb();
-				seg->byte_count = htonl(MLX4_INLINE_SEG | seg_len);
+			ret = set_inline_data(qp, wqe, wr->sg_list,
+					      wr->num_sge, &inl, &sz);
+			if (ret) {
+				*bad_wr = wr;
+				goto out;
 			}
 
-			size += (inl + num_seg * sizeof * seg + 15) / 16;
+			size += sz;
 		} else {
 			struct mlx4_wqe_data_seg *seg = wqe;
 
@@ -400,7 +584,7 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 		 * send queue WQE until after ringing the doorbell, so
 		 * only stamp here if there are still more WQEs to post.
 		 */
-		if (wr->next)
+		if (wr->next || stamp_last)
 			stamp_send_wqe(qp, (ind + qp->sq_spare_wqes) &
 				       (qp->sq.wqe_cnt - 1));
 
@@ -408,28 +592,61 @@ int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
 	}
 
 out:
-	ctx = to_mctx(ibqp->context);
+	*pnreq = nreq;
+	*pctrl = ctrl;
+	*pinl  = inl;
+	*psize = size;
 
-	if (nreq == 1 && inl && size > 1 && size <= ctx->bf_buf_size / 16) {
-		ctrl->owner_opcode |= htonl((qp->sq.head & 0xffff) << 8);
-		*(uint32_t *) ctrl->reserved |= qp->doorbell_qpn;
-		/*
-		 * Make sure that descriptor is written to memory
-		 * before writing to BlueFlame page.
-		 */
-		wmb();
+	return ret;
+}
+
+/*
+ * Hand the single WQE at the SQ head to the HCA by writing it to the
+ * BlueFlame page instead of ringing the doorbell.
+ */
+static void post_send_bf(struct mlx4_context *ctx, struct mlx4_qp *qp,
+			 struct mlx4_wqe_ctrl_seg *ctrl, int size)
+{
+	ctrl->owner_opcode |= htonl((qp->sq.head & 0xffff) << 8);
+	ctrl->bf_qpn |= qp->doorbell_qpn;
+	/*
+	 * Make sure that descriptor is written to memory
+	 * before writing to BlueFlame page.
+	 */
+	wmb();
 
-		++qp->sq.head;
+	++qp->sq.head;
 
-		pthread_spin_lock(&ctx->bf_lock);
+	pthread_spin_lock(&ctx->bf_lock);
 
-		mlx4_bf_copy(ctx->bf_page + ctx->bf_offset, (unsigned long *) ctrl,
-			     align(size * 16, 64));
-		wc_wmb();
+	mlx4_bf_copy(ctx->bf_page + ctx->bf_offset, (unsigned long *) ctrl,
+		     align(size * 16, 64));
+	wc_wmb();
 
-		ctx->bf_offset ^= ctx->bf_buf_size;
+	ctx->bf_offset ^= ctx->bf_buf_size;
 
-		pthread_spin_unlock(&ctx->bf_lock);
+	pthread_spin_unlock(&ctx->bf_lock);
+}
+
+int mlx4_post_send(struct ibv_qp *ibqp, struct ibv_send_wr *wr,
+			  struct ibv_send_wr **bad_wr)
+{
+	struct mlx4_context *ctx;
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_wqe_ctrl_seg *ctrl;
+	int nreq;
+	int inl;
+	int ret;
+	int size;
+
+	pthread_spin_lock(&qp->sq.lock);
+
+	ret = build_send_wqes(ibqp, wr, bad_wr, &nreq, &ctrl, &inl, &size, 0);
+
+	ctx = to_mctx(ibqp->context);
+
+	if (nreq == 1 && inl && size > 1 && size <= ctx->bf_buf_size / 16) {
+		post_send_bf(ctx, qp, ctrl, size);
 	} else if (nreq) {
 		qp->sq.head += nreq;
 
@@ -444,7 +661,7 @@ out:
 	}
 
 	if (nreq)
-		stamp_send_wqe(qp, (ind + qp->sq_spare_wqes - 1) &
+		stamp_send_wqe(qp, (qp->sq.head + qp->sq_spare_wqes - 1) &
 			       (qp->sq.wqe_cnt - 1));
 
 	pthread_spin_unlock(&qp->sq.lock);
@@ -452,67 +669,928 @@ out:
 	return ret;
 }
 
-int mlx4_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
-		   struct ibv_recv_wr **bad_wr)
+int mlx4dv_post_send_many(struct mlx4dv_send_batch *batch, int num)
 {
-	struct mlx4_qp *qp = to_mqp(ibqp);
-	struct mlx4_wqe_data_seg *scat;
-	int ret = 0;
+	struct mlx4_wqe_ctrl_seg *ctrl;
+	struct mlx4_qp *qp;
 	int nreq;
-	int ind;
+	int inl;
+	int size;
+	int err;
+	int ret = 0;
 	int i;
 
-	pthread_spin_lock(&qp->rq.lock);
+	/*
+	 * Build and hand over the WQEs of every QP first.  Ownership
+	 * bits are only set on complete descriptors, so it doesn't
+	 * matter if another thread rings a doorbell for one of these
+	 * QPs before we do; all we need is for the doorbells below to
+	 * come after every descriptor.
+	 */
+	for (i = 0; i < num; ++i) {
+		qp = to_mqp(batch[i].qp);
+		batch[i].bad_wr = NULL;
 
-	/* XXX check that state is OK to post receive */
+		pthread_spin_lock(&qp->sq.lock);
 
-	ind = qp->rq.head & (qp->rq.wqe_cnt - 1);
+		err = build_send_wqes(batch[i].qp, batch[i].wr,
+				      &batch[i].bad_wr, &nreq, &ctrl,
+				      &inl, &size, 1);
+		qp->sq.head += nreq;
+
+		pthread_spin_unlock(&qp->sq.lock);
+
+		if (err && !ret)
+			ret = err;
+	}
+
+	/*
+	 * Make sure that all descriptors are written before
+	 * any of the doorbells.
+	 */
+	wmb();
+
+	for (i = 0; i < num; ++i) {
+		/* Skip entries where nothing at all was posted */
+		if (!batch[i].wr || batch[i].bad_wr == batch[i].wr)
+			continue;
+
+		qp = to_mqp(batch[i].qp);
+		mmio_writel((unsigned long)(to_mctx(batch[i].qp->context)->uar +
+					    MLX4_SEND_DOORBELL),
+			    qp->doorbell_qpn);
+	}
+
+	return ret;
+}
+
+int mlx4dv_qp_query_sq_retired(struct ibv_qp *ibqp, uint32_t *retired)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_cq *cq = to_mcq(ibqp->send_cq);
+
+	if (!qp->sq.wqe_cnt)
+		return EINVAL;
+
+	/* The tail moves as send completions are polled */
+	pthread_spin_lock(&cq->lock);
+	*retired = qp->sq.tail;
+	pthread_spin_unlock(&cq->lock);
+
+	return 0;
+}
+
+int mlx4dv_post_atomic(struct ibv_qp *ibqp, struct mlx4dv_atomic_wr *wr,
+		       struct mlx4dv_atomic_wr **bad_wr)
+{
+	struct mlx4_context *ctx;
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	void *wqe;
+	struct mlx4_wqe_ctrl_seg *ctrl;
+	struct mlx4_wqe_data_seg *seg;
+	uint32_t opcode;
+	int ind;
+	int nreq;
+	int ret = 0;
+	int size;
+
+	pthread_spin_lock(&qp->sq.lock);
+
+	ind = qp->sq.head;
 
 	for (nreq = 0; wr; ++nreq, wr = wr->next) {
-		if (wq_overflow(&qp->rq, nreq, to_mcq(ibqp->recv_cq))) {
-			ret = ENOMEM;
+		if (ibqp->qp_type != IBV_QPT_RC ||
+		    !(qp->create_flags & MLX4DV_QP_CREATE_MASKED_ATOMIC)) {
+			ret = EINVAL;
 			*bad_wr = wr;
 			goto out;
 		}
 
-		if (wr->num_sge > qp->rq.max_gs) {
+		if (wq_overflow(&qp->sq, nreq, to_mcq(ibqp->send_cq))) {
 			ret = ENOMEM;
 			*bad_wr = wr;
 			goto out;
 		}
 
-		scat = get_recv_wqe(qp, ind);
+		/* The original value goes to exactly one 8 byte entry */
+		if (wr->num_sge != 1 || wr->sg_list->length != 8) {
+			ret = EINVAL;
+			*bad_wr = wr;
+			goto out;
+		}
 
-		for (i = 0; i < wr->num_sge; ++i)
-			__set_data_seg(scat + i, wr->sg_list + i);
+		ctrl = wqe = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
+		if (qp->sq.wrid)
+			qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = wr->wr_id;
 
-		if (i < qp->rq.max_gs) {
-			scat[i].byte_count = 0;
-			scat[i].lkey       = htonl(MLX4_INVALID_LKEY);
-			scat[i].addr       = 0;
-		}
+		ctrl->srcrb_flags =
+			(wr->send_flags & IBV_SEND_SIGNALED ?
+			 htonl(MLX4_WQE_CTRL_CQ_UPDATE) : 0) |
+			(wr->send_flags & IBV_SEND_SOLICITED ?
+			 htonl(MLX4_WQE_CTRL_SOLICIT) : 0)   |
+			qp->sq_signal_bits;
+		if (qp->create_flags & MLX4DV_QP_CREATE_AUTO_SIGNAL)
+			ctrl->srcrb_flags |=
+				sq_auto_signal(qp, ind,
+					       wr->send_flags & IBV_SEND_SIGNALED);
+		ctrl->imm = 0;
+
+		wqe += sizeof *ctrl;
+		size = sizeof *ctrl / 16;
 
-		qp->rq.wrid[ind] = wr->wr_id;
+		set_raddr_seg(wqe, wr->remote_addr, wr->rkey);
+		wqe  += sizeof (struct mlx4_wqe_raddr_seg);
+		size += sizeof (struct mlx4_wqe_raddr_seg) / 16;
 
-		ind = (ind + 1) & (qp->rq.wqe_cnt - 1);
-	}
+		switch (wr->opcode) {
+		case MLX4DV_WR_MASKED_ATOMIC_CMP_AND_SWP:
+			opcode = MLX4_OPCODE_MASKED_ATOMIC_CS;
+			set_masked_atomic_seg(wqe, wr);
+			wqe  += sizeof (struct mlx4_wqe_masked_atomic_seg);
+			size += sizeof (struct mlx4_wqe_masked_atomic_seg) / 16;
+			break;
 
-out:
-	if (nreq) {
-		qp->rq.head += nreq;
+		case MLX4DV_WR_MASKED_ATOMIC_FETCH_AND_ADD:
+			opcode = MLX4_OPCODE_MASKED_ATOMIC_FA;
+			set_masked_fetch_add_seg(wqe, wr);
+			wqe  += sizeof (struct mlx4_wqe_atomic_seg);
+			size += sizeof (struct mlx4_wqe_atomic_seg) / 16;
+			break;
+
+		default:
+			ret = EINVAL;
+			*bad_wr = wr;
+			goto out;
+		}
+
+		seg = wqe;
+		set_data_seg(seg, wr->sg_list);
+		size += sizeof *seg / 16;
+
+		ctrl->fence_size = (wr->send_flags & IBV_SEND_FENCE ?
+				    MLX4_WQE_CTRL_FENCE : 0) | size;
 
 		/*
-		 * Make sure that descriptors are written before
-		 * doorbell record.
+		 * Make sure descriptor is fully written before
+		 * setting ownership bit (because HW can start
+		 * executing as soon as we do).
 		 */
 		wmb();
 
-		*qp->db = htonl(qp->rq.head & 0xffff);
-	}
+		ctrl->owner_opcode = htonl(opcode) |
+			(ind & qp->sq.wqe_cnt ? htonl(1 << 31) : 0);
 
-	pthread_spin_unlock(&qp->rq.lock);
+		if (wr->next)
+			stamp_send_wqe(qp, (ind + qp->sq_spare_wqes) &
+				       (qp->sq.wqe_cnt - 1));
 
-	return ret;
+		++ind;
+	}
+
+out:
+	ctx = to_mctx(ibqp->context);
+
+	if (nreq) {
+		qp->sq.head += nreq;
+
+		/*
+		 * Make sure that descriptors are written before
+		 * doorbell record.
+		 */
+		wmb();
+
+		mmio_writel((unsigned long)(ctx->uar + MLX4_SEND_DOORBELL),
+			    qp->doorbell_qpn);
+
+		stamp_send_wqe(qp, (ind + qp->sq_spare_wqes - 1) &
+			       (qp->sq.wqe_cnt - 1));
+	}
+
+	pthread_spin_unlock(&qp->sq.lock);
+
+	return ret;
+}
+
+int mlx4dv_post_ud_fanout(struct ibv_qp *ibqp, struct mlx4dv_ud_fanout_wr *wr)
+{
+	struct mlx4_context *ctx = to_mctx(ibqp->context);
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_wqe_ctrl_seg *ctrl;
+	struct mlx4dv_ud_dest *dest;
+	uint32_t srcrb_flags;
+	uint32_t imm;
+	void *payload = NULL;
+	void *wqe;
+	int payload_len = 0;
+	int ind;
+	int inl;
+	int ret = 0;
+	int size;
+	int i;
+
+	if (ibqp->qp_type != IBV_QPT_UD || wr->num_dest < 1 ||
+	    (wr->opcode != IBV_WR_SEND && wr->opcode != IBV_WR_SEND_WITH_IMM))
+		return EINVAL;
+
+	if (wr->num_sge > qp->sq.max_gs)
+		return ENOMEM;
+
+	srcrb_flags = (wr->send_flags & IBV_SEND_SOLICITED ?
+		       htonl(MLX4_WQE_CTRL_SOLICIT) : 0);
+
+	if (wr->send_flags & IBV_SEND_IP_CSUM) {
+		if (!(qp->qp_cap_cache & MLX4_CSUM_SUPPORT_UD_OVER_IB))
+			return EINVAL;
+		srcrb_flags |= htonl(MLX4_WQE_CTRL_IP_HDR_CSUM |
+				     MLX4_WQE_CTRL_TCP_UDP_CSUM);
+	}
+
+	imm = wr->opcode == IBV_WR_SEND_WITH_IMM ? wr->imm_data : 0;
+
+	pthread_spin_lock(&qp->sq.lock);
+
+	/* The fan-out is posted as a whole or not at all */
+	if (wq_overflow(&qp->sq, wr->num_dest - 1, to_mcq(ibqp->send_cq))) {
+		ret = ENOMEM;
+		goto out;
+	}
+
+	ind = qp->sq.head;
+
+	for (i = 0; i < wr->num_dest; ++i, ++ind) {
+		dest = &wr->dest[i];
+
+		ctrl = wqe = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
+		if (qp->sq.wrid)
+			qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = wr->wr_id;
+
+		/*
+		 * The fan-out is one logical send, so only its last
+		 * WQE asks for a completion.  The CQE's wqe_index
+		 * retires all of the earlier ones.
+		 */
+		ctrl->srcrb_flags = srcrb_flags;
+		if (i == wr->num_dest - 1) {
+			ctrl->srcrb_flags |=
+				(wr->send_flags & IBV_SEND_SIGNALED ?
+				 htonl(MLX4_WQE_CTRL_CQ_UPDATE) : 0) |
+				qp->sq_signal_bits;
+			if (qp->create_flags & MLX4DV_QP_CREATE_AUTO_SIGNAL)
+				ctrl->srcrb_flags |=
+					sq_auto_signal(qp, ind,
+						       wr->send_flags & IBV_SEND_SIGNALED);
+		}
+		ctrl->imm = imm;
+
+		wqe += sizeof *ctrl;
+		set_datagram_seg(wqe, to_mah(dest->ah), dest->remote_qpn,
+				 dest->remote_qkey);
+		wqe += sizeof (struct mlx4_wqe_datagram_seg);
+
+		if (!payload) {
+			size = (sizeof *ctrl +
+				sizeof (struct mlx4_wqe_datagram_seg)) / 16;
+
+			if (wr->send_flags & IBV_SEND_INLINE && wr->num_sge) {
+				int sz;
+
+				ret = set_inline_data(qp, wqe, wr->sg_list,
+						      wr->num_sge, &inl, &sz);
+				if (ret)
+					goto out;
+
+				size += sz;
+			} else {
+				struct mlx4_wqe_data_seg *seg = wqe;
+				int j;
+
+				for (j = wr->num_sge - 1; j >= 0; --j)
+					set_data_seg(seg + j, wr->sg_list + j);
+
+				size += wr->num_sge * (sizeof *seg / 16);
+			}
+
+			payload = wqe;
+			payload_len = size * 16 - (sizeof *ctrl +
+				sizeof (struct mlx4_wqe_datagram_seg));
+		} else {
+			copy_wqe_data(wqe, payload, payload_len);
+		}
+
+		ctrl->fence_size = size;
+
+		/*
+		 * Make sure descriptor is fully written before
+		 * setting ownership bit (because HW can start
+		 * executing as soon as we do).
+		 */
+		wmb();
+
+		ctrl->owner_opcode = htonl(mlx4_ib_opcode[wr->opcode]) |
+			(ind & qp->sq.wqe_cnt ? htonl(1 << 31) : 0);
+
+		if (i != wr->num_dest - 1)
+			stamp_send_wqe(qp, (ind + qp->sq_spare_wqes) &
+				       (qp->sq.wqe_cnt - 1));
+	}
+
+	qp->sq.head += wr->num_dest;
+
+	/*
+	 * Make sure that descriptors are written before
+	 * doorbell record.
+	 */
+	wmb();
+
+	mmio_writel((unsigned long)(ctx->uar + MLX4_SEND_DOORBELL),
+		    qp->doorbell_qpn);
+
+	stamp_send_wqe(qp, (ind + qp->sq_spare_wqes - 1) &
+		       (qp->sq.wqe_cnt - 1));
+
+out:
+	pthread_spin_unlock(&qp->sq.lock);
+
+	return ret;
+}
+
+int mlx4dv_tx_burst(struct ibv_qp *ibqp, struct mlx4dv_tx_pkt *pkts, int num,
+		    int *posted)
+{
+	struct mlx4_context *ctx = to_mctx(ibqp->context);
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_wqe_ctrl_seg *ctrl;
+	struct mlx4_wqe_ctrl_seg *first = NULL;
+	struct mlx4_wqe_data_seg *dseg;
+	struct mlx4dv_tx_pkt *pkt;
+	struct ibv_sge hdr;
+	uint32_t srcrb_flags;
+	void *wqe;
+	unsigned ind;
+	int max_size = (1 << qp->sq.wqe_shift) / 16;
+	int first_size = 0;
+	int size;
+	int room;
+	int inl;
+	int sz;
+	int ret = 0;
+	int n;
+
+	*posted = 0;
+
+	if (ibqp->qp_type != IBV_QPT_RAW_PACKET || num < 0)
+		return EINVAL;
+
+	pthread_spin_lock(&qp->sq.lock);
+
+	room = wq_room(&qp->sq, num, to_mcq(ibqp->send_cq));
+	if (room < num)
+		ret = ENOMEM;
+	ind = qp->sq.head;
+
+	for (n = 0; n < room; ++n, ++ind) {
+		pkt = &pkts[n];
+
+		if (pkt->flags & MLX4DV_TX_PKT_IP_CSUM &&
+		    !(qp->qp_cap_cache & MLX4_CSUM_SUPPORT_RAW_OVER_ETH)) {
+			ret = EINVAL;
+			break;
+		}
+
+		ctrl = wqe = get_send_wqe(qp, ind & (qp->sq.wqe_cnt - 1));
+		if (qp->sq.wrid)
+			qp->sq.wrid[ind & (qp->sq.wqe_cnt - 1)] = pkt->wr_id;
+
+		/* SOLICIT tells the HCA not to calculate an ICRC */
+		srcrb_flags = htonl(MLX4_WQE_CTRL_SOLICIT) |
+			(pkt->flags & MLX4DV_TX_PKT_SIGNALED ?
+			 htonl(MLX4_WQE_CTRL_CQ_UPDATE) : 0) |
+			(pkt->flags & MLX4DV_TX_PKT_IP_CSUM ?
+			 htonl(MLX4_WQE_CTRL_IP_HDR_CSUM |
+			       MLX4_WQE_CTRL_TCP_UDP_CSUM) : 0) |
+			qp->sq_signal_bits;
+		if (qp->create_flags & MLX4DV_QP_CREATE_AUTO_SIGNAL)
+			srcrb_flags |=
+				sq_auto_signal(qp, ind,
+					       pkt->flags & MLX4DV_TX_PKT_SIGNALED);
+		ctrl->srcrb_flags = srcrb_flags;
+		ctrl->imm = 0;
+
+		if (pkt->flags & MLX4DV_TX_PKT_INS_VLAN) {
+			ctrl->vlan_tag = htons(pkt->vlan_tci);
+			ctrl->ins_vlan = MLX4_WQE_CTRL_INS_VLAN;
+		} else {
+			ctrl->vlan_tag = 0;
+			ctrl->ins_vlan = 0;
+		}
+
+		wqe += sizeof *ctrl;
+		size = sizeof *ctrl / 16;
+
+		if (pkt->hdr_len) {
+			hdr.addr   = (uintptr_t) pkt->hdr;
+			hdr.length = pkt->hdr_len;
+
+			if (set_inline_data(qp, wqe, &hdr, 1, &inl, &sz)) {
+				ret = EINVAL;
+				break;
+			}
+
+			wqe  += sz * 16;
+			size += sz;
+		}
+
+		if (pkt->payload.length) {
+			if (size >= max_size) {
+				ret = EINVAL;
+				break;
+			}
+
+			/*
+			 * Only a segment that starts a 64 byte chunk
+			 * needs its byte count written last.
+			 */
+			dseg = wqe;
+			if ((uintptr_t) dseg & (MLX4_INLINE_ALIGN - 1))
+				__set_data_seg(dseg, &pkt->payload);
+			else
+				set_data_seg(dseg, &pkt->payload);
+
+			size += sizeof *dseg / 16;
+		}
+
+		ctrl->fence_size = size;
+
+		/*
+		 * Make sure descriptor is fully written before
+		 * setting ownership bit (because HW can start
+		 * executing as soon as we do).
+		 */
+		wmb();
+
+		ctrl->owner_opcode = htonl(MLX4_OPCODE_SEND) |
+			(ind & qp->sq.wqe_cnt ? htonl(1 << 31) : 0);
+
+		if (!n) {
+			first = ctrl;
+			first_size = size;
+		}
+
+		if (n != room - 1)
+			stamp_send_wqe(qp, (ind + qp->sq_spare_wqes) &
+				       (qp->sq.wqe_cnt - 1));
+	}
+
+	if (n == 1 && first_size > 1 && !pkts[0].payload.length &&
+	    !(pkts[0].flags & MLX4DV_TX_PKT_INS_VLAN) &&
+	    first_size <= ctx->bf_buf_size / 16) {
+		post_send_bf(ctx, qp, first, first_size);
+	} else if (n) {
+		qp->sq.head += n;
+
+		/*
+		 * Make sure that descriptors are written before
+		 * doorbell record.
+		 */
+		wmb();
+
+		mmio_writel((unsigned long)(ctx->uar + MLX4_SEND_DOORBELL),
+			    qp->doorbell_qpn);
+	}
+
+	if (n)
+		stamp_send_wqe(qp, (qp->sq.head + qp->sq_spare_wqes - 1) &
+			       (qp->sq.wqe_cnt - 1));
+
+	pthread_spin_unlock(&qp->sq.lock);
+
+	*posted = n;
+
+	return ret;
+}
+
+int mlx4_post_recv(struct ibv_qp *ibqp, struct ibv_recv_wr *wr,
+		   struct ibv_recv_wr **bad_wr)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_wqe_data_seg *scat;
+	int ret = 0;
+	int nreq;
+	int ind;
+	int i;
+
+	pthread_spin_lock(&qp->rq.lock);
+
+	/* XXX check that state is OK to post receive */
+
+	ind = qp->rq.head & (qp->rq.wqe_cnt - 1);
+
+	for (nreq = 0; wr; ++nreq, wr = wr->next) {
+		if (wq_overflow(&qp->rq, nreq, to_mcq(ibqp->recv_cq))) {
+			ret = ENOMEM;
+			*bad_wr = wr;
+			goto out;
+		}
+
+		if (wr->num_sge > qp->rq.max_gs) {
+			ret = ENOMEM;
+			*bad_wr = wr;
+			goto out;
+		}
+
+		scat = get_recv_wqe(qp, ind);
+
+		for (i = 0; i < wr->num_sge; ++i)
+			__set_data_seg(scat + i, wr->sg_list + i);
+
+		if (i < qp->rq.max_gs) {
+			scat[i].byte_count = 0;
+			scat[i].lkey       = htonl(MLX4_INVALID_LKEY);
+			scat[i].addr       = 0;
+		}
+
+		if (qp->rq.wrid)
+			qp->rq.wrid[ind] = wr->wr_id;
+
+		ind = (ind + 1) & (qp->rq.wqe_cnt - 1);
+	}
+
+out:
+	if (nreq) {
+		qp->rq.head += nreq;
+
+		/*
+		 * Make sure that descriptors are written before
+		 * doorbell record.
+		 */
+		wmb();
+
+		*qp->db = htonl(qp->rq.head & 0xffff);
+	}
+
+	pthread_spin_unlock(&qp->rq.lock);
+
+	return ret;
+}
+
+static inline void set_recv_burst(struct mlx4_qp *qp,
+				  struct mlx4dv_recv_burst *burst,
+				  int ind, int n, int term)
+	ALWAYS_INLINE;
+static inline void set_recv_burst(struct mlx4_qp *qp,
+				  struct mlx4dv_recv_burst *burst,
+				  int ind, int n, int term)
+{
+	struct mlx4_wqe_data_seg *scat;
+	uint32_t byte_count = htonl(burst->length);
+	uint32_t lkey = htonl(burst->lkey);
+	uint64_t addr = burst->addr;
+	int i;
+
+	for (i = 0; i < n; ++i) {
+		scat = get_recv_wqe(qp, ind);
+
+		scat->byte_count = byte_count;
+		scat->lkey	 = lkey;
+		scat->addr	 = htonll(addr);
+
+		if (term) {
+			scat[1].byte_count = 0;
+			scat[1].lkey	   = htonl(MLX4_INVALID_LKEY);
+			scat[1].addr	   = 0;
+		}
+
+		if (qp->rq.wrid)
+			qp->rq.wrid[ind] = burst->wr_id + i;
+
+		addr += burst->stride;
+		ind = (ind + 1) & (qp->rq.wqe_cnt - 1);
+	}
+}
+
+int mlx4dv_post_recv_burst(struct ibv_qp *ibqp, struct mlx4dv_recv_burst *burst,
+			   int *posted)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	int ind;
+	int n;
+
+	*posted = 0;
+
+	if (!qp->rq.wqe_cnt || burst->num < 0)
+		return EINVAL;
+
+	pthread_spin_lock(&qp->rq.lock);
+
+	n = wq_room(&qp->rq, burst->num, to_mcq(ibqp->recv_cq));
+	if (!n)
+		goto out;
+
+	ind = qp->rq.head & (qp->rq.wqe_cnt - 1);
+
+	/*
+	 * A WQE with room for a single scatter entry needs no
+	 * terminating entry, so give that common case its own loop.
+	 */
+	if (1 << qp->rq.wqe_shift == sizeof (struct mlx4_wqe_data_seg))
+		set_recv_burst(qp, burst, ind, n, 0);
+	else
+		set_recv_burst(qp, burst, ind, n, 1);
+
+	qp->rq.head += n;
+
+	/*
+	 * Make sure that descriptors are written before
+	 * doorbell record.
+	 */
+	wmb();
+
+	*qp->db = htonl(qp->rq.head & 0xffff);
+
+out:
+	pthread_spin_unlock(&qp->rq.lock);
+
+	*posted = n;
+
+	return n < burst->num ? ENOMEM : 0;
+}
+
+/*
+ * Post released slots in order starting at the RQ head.  Called with
+ * the RQ lock held.
+ */
+static void post_recv_ring(struct mlx4_qp *qp, struct mlx4_cq *cq)
+{
+	struct mlx4_recv_ring *ring = qp->recv_ring;
+	int room;
+	int ind;
+	int n;
+
+	room = wq_room(&qp->rq, qp->rq.wqe_cnt, cq);
+	ind = qp->rq.head & (qp->rq.wqe_cnt - 1);
+
+	for (n = 0; n < room && ring->state[ind] == MLX4_RING_RELEASED; ++n) {
+		ring->state[ind] = MLX4_RING_POSTED;
+		ind = (ind + 1) & (qp->rq.wqe_cnt - 1);
+	}
+
+	if (!n)
+		return;
+
+	qp->rq.head += n;
+
+	/*
+	 * Make sure that descriptors are written before
+	 * doorbell record.
+	 */
+	wmb();
+
+	*qp->db = htonl(qp->rq.head & 0xffff);
+}
+
+int mlx4dv_qp_start_recv_ring(struct ibv_qp *ibqp,
+			      struct mlx4dv_recv_ring_attr *attr)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_recv_ring *ring;
+	struct mlx4_wqe_data_seg *scat;
+	uint64_t addr;
+	int ind;
+
+	if (!qp->rq.wrid || !attr->length || attr->stride < attr->length ||
+	    attr->num_bufs < qp->rq.wqe_cnt)
+		return EINVAL;
+
+	if (qp->recv_ring)
+		return EBUSY;
+
+	ring = calloc(1, sizeof *ring + qp->rq.wqe_cnt);
+	if (!ring)
+		return ENOMEM;
+
+	ring->addr     = attr->addr;
+	ring->stride   = attr->stride;
+	ring->num_bufs = qp->rq.wqe_cnt;
+	ring->state    = (uint8_t *) (ring + 1);
+
+	pthread_spin_lock(&qp->rq.lock);
+
+	if (qp->rq.head != qp->rq.tail) {
+		pthread_spin_unlock(&qp->rq.lock);
+		free(ring);
+		return EBUSY;
+	}
+
+	for (ind = 0; ind < qp->rq.wqe_cnt; ++ind) {
+		addr = attr->addr + (uint64_t) ind * attr->stride;
+		scat = get_recv_wqe(qp, ind);
+
+		scat->byte_count = htonl(attr->length);
+		scat->lkey	 = htonl(attr->lkey);
+		scat->addr	 = htonll(addr);
+
+		if (qp->rq.max_gs > 1) {
+			scat[1].byte_count = 0;
+			scat[1].lkey	   = htonl(MLX4_INVALID_LKEY);
+			scat[1].addr	   = 0;
+		}
+
+		qp->rq.wrid[ind] = addr;
+		ring->state[ind] = MLX4_RING_RELEASED;
+	}
+
+	qp->recv_ring = ring;
+	post_recv_ring(qp, to_mcq(ibqp->recv_cq));
+
+	pthread_spin_unlock(&qp->rq.lock);
+
+	attr->num_bufs = qp->rq.wqe_cnt;
+
+	return 0;
+}
+
+int mlx4dv_qp_release_recv(struct ibv_qp *ibqp, uint64_t *wr_id, int num)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_recv_ring *ring = qp->recv_ring;
+	int err = 0;
+	int slot;
+	int i;
+
+	if (!ring)
+		return EINVAL;
+
+	pthread_spin_lock(&qp->rq.lock);
+
+	for (i = 0; i < num; ++i) {
+		slot = mlx4_recv_ring_slot(ring, wr_id[i]);
+		if (slot < 0 || ring->state[slot] != MLX4_RING_HELD) {
+			err = EINVAL;
+			break;
+		}
+
+		ring->state[slot] = MLX4_RING_RELEASED;
+	}
+
+	post_recv_ring(qp, to_mcq(ibqp->recv_cq));
+
+	pthread_spin_unlock(&qp->rq.lock);
+
+	return err;
+}
+
+/*
+ * Post free pool buffers to the RQ slots from the head on.  Only the
+ * address changes, the rest of each slot was set up by
+ * mlx4dv_qp_start_rx().  Called with the RQ lock held.
+ */
+static void __mlx4_rx_refill(struct mlx4_qp *qp)
+{
+	struct mlx4_rx_pool *pool = qp->rx_pool;
+	struct mlx4_wqe_data_seg *scat;
+	uint64_t addr;
+	uint32_t buf;
+	int ind;
+	int n;
+	int i;
+
+	n = wq_room(&qp->rq, pool->num_free, to_mcq(qp->verbs_qp.qp.recv_cq));
+	if (!n)
+		return;
+
+	ind = qp->rq.head & (qp->rq.wqe_cnt - 1);
+
+	for (i = 0; i < n; ++i) {
+		buf = pool->free_bufs[--pool->num_free];
+		pool->is_free[buf] = 0;
+		addr = pool->addr + (uint64_t) buf * pool->stride;
+
+		scat = get_recv_wqe(qp, ind);
+		scat->addr = htonll(addr);
+		qp->rq.wrid[ind] = addr;
+
+		ind = (ind + 1) & (qp->rq.wqe_cnt - 1);
+	}
+
+	qp->rq.head += n;
+
+	/*
+	 * Make sure that descriptors are written before
+	 * doorbell record.
+	 */
+	wmb();
+
+	*qp->db = htonl(qp->rq.head & 0xffff);
+}
+
+void mlx4_rx_refill(struct mlx4_qp *qp)
+{
+	pthread_spin_lock(&qp->rq.lock);
+	__mlx4_rx_refill(qp);
+	pthread_spin_unlock(&qp->rq.lock);
+}
+
+int mlx4dv_qp_start_rx(struct ibv_qp *ibqp, struct mlx4dv_rx_pool_attr *attr)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_rx_pool *pool;
+	struct mlx4_wqe_data_seg *scat;
+	int ind;
+	int i;
+
+	if (!qp->rq.wrid || !attr->num_bufs || !attr->length ||
+	    attr->stride < attr->length)
+		return EINVAL;
+
+	if (qp->recv_ring || qp->rx_pool)
+		return EBUSY;
+
+	pool = malloc(sizeof *pool + attr->num_bufs);
+	if (!pool)
+		return ENOMEM;
+
+	pool->free_bufs = malloc(attr->num_bufs * sizeof *pool->free_bufs);
+	if (!pool->free_bufs) {
+		free(pool);
+		return ENOMEM;
+	}
+
+	/* Hand buffers out in pool order */
+	for (i = 0; i < attr->num_bufs; ++i)
+		pool->free_bufs[i] = attr->num_bufs - 1 - i;
+
+	pool->addr     = attr->addr;
+	pool->stride   = attr->stride;
+	pool->num_bufs = attr->num_bufs;
+	pool->num_free = attr->num_bufs;
+	pool->is_free  = (uint8_t *) (pool + 1);
+	memset(pool->is_free, 1, attr->num_bufs);
+
+	pthread_spin_lock(&qp->rq.lock);
+
+	if (qp->rq.head != qp->rq.tail) {
+		pthread_spin_unlock(&qp->rq.lock);
+		free(pool->free_bufs);
+		free(pool);
+		return EBUSY;
+	}
+
+	for (ind = 0; ind < qp->rq.wqe_cnt; ++ind) {
+		scat = get_recv_wqe(qp, ind);
+
+		scat->byte_count = htonl(attr->length);
+		scat->lkey	 = htonl(attr->lkey);
+
+		if (qp->rq.max_gs > 1) {
+			scat[1].byte_count = 0;
+			scat[1].lkey	   = htonl(MLX4_INVALID_LKEY);
+			scat[1].addr	   = 0;
+		}
+	}
+
+	qp->rx_pool = pool;
+	__mlx4_rx_refill(qp);
+
+	pthread_spin_unlock(&qp->rq.lock);
+
+	return 0;
+}
+
+int mlx4dv_rx_free(struct ibv_qp *ibqp, void **bufs, int num)
+{
+	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_rx_pool *pool = qp->rx_pool;
+	uint64_t off;
+	int err = 0;
+	int i;
+
+	if (!pool)
+		return EINVAL;
+
+	pthread_spin_lock(&qp->rq.lock);
+
+	for (i = 0; i < num; ++i) {
+		off = (uintptr_t) bufs[i] - pool->addr;
+		if ((uintptr_t) bufs[i] < pool->addr || off % pool->stride ||
+		    off / pool->stride >= pool->num_bufs ||
+		    pool->is_free[off / pool->stride]) {
+			err = EINVAL;
+			break;
+		}
+
+		pool->is_free[off / pool->stride] = 1;
+		pool->free_bufs[pool->num_free++] = off / pool->stride;
+	}
+
+	/*
+	 * An RQ that ran dry completes nothing, so returned buffers
+	 * have to be able to restart it.
+	 */
+	__mlx4_rx_refill(qp);
+
+	pthread_spin_unlock(&qp->rq.lock);
+
+	return err;
 }
 
 static int num_inline_segs(int data, enum ibv_qp_type type)
@@ -576,6 +1654,18 @@ void mlx4_calc_sq_wqe_size(struct ibv_qp_cap *cap, enum ibv_qp_type type,
 			size = (sizeof (struct mlx4_wqe_atomic_seg) +
 				sizeof (struct mlx4_wqe_raddr_seg) +
 				sizeof (struct mlx4_wqe_data_seg));
+		/*
+		 * A masked compare and swap carries the masks as well,
+		 * which doesn't fit in a 64 byte WQE, so only pay for
+		 * it when the QP asked for masked atomics.
+		 */
+		if (qp->create_flags & MLX4DV_QP_CREATE_MASKED_ATOMIC &&
+		    size < (sizeof (struct mlx4_wqe_masked_atomic_seg) +
+			    sizeof (struct mlx4_wqe_raddr_seg) +
+			    sizeof (struct mlx4_wqe_data_seg)))
+			size = (sizeof (struct mlx4_wqe_masked_atomic_seg) +
+				sizeof (struct mlx4_wqe_raddr_seg) +
+				sizeof (struct mlx4_wqe_data_seg));
 		break;
 
 	default:
@@ -593,24 +1683,30 @@ void mlx4_calc_sq_wqe_size(struct ibv_qp_cap *cap, enum ibv_qp_type type,
 		; /* nothing */
 }
 
-int mlx4_alloc_qp_buf(struct ibv_context *context, struct ibv_qp_cap *cap,
-		       enum ibv_qp_type type, struct mlx4_qp *qp)
+static int mlx4_qp_buf_flags(struct ibv_context *context, struct mlx4_qp *qp)
 {
-	qp->rq.max_gs	 = cap->max_recv_sge;
+	int flags = to_mctx(context)->buf_flags;
 
-	if (qp->sq.wqe_cnt) {
-		qp->sq.wrid = malloc(qp->sq.wqe_cnt * sizeof (uint64_t));
-		if (!qp->sq.wrid)
-			return -1;
-	}
+	if (qp->create_flags & MLX4DV_QP_CREATE_HUGE_BUF)
+		flags |= MLX4_BUF_HUGE;
+	if (qp->create_flags & MLX4DV_QP_CREATE_POPULATE_BUF)
+		flags |= MLX4_BUF_POPULATE;
 
-	if (qp->rq.wqe_cnt) {
-		qp->rq.wrid = malloc(qp->rq.wqe_cnt * sizeof (uint64_t));
-		if (!qp->rq.wrid) {
-			free(qp->sq.wrid);
-			return -1;
-		}
-	}
+	return flags;
+}
+
+/*
+ * Lay out the QP buffer and return the size to allocate for it, 0 if
+ * the QP has no work queues.
+ */
+static size_t calc_qp_buf_size(struct ibv_qp_cap *cap, struct mlx4_qp *qp)
+{
+	size_t wrid_size = 0;
+
+	qp->rq.max_gs	 = cap->max_recv_sge;
+
+	if (!(qp->create_flags & MLX4DV_QP_CREATE_NO_WRID))
+		wrid_size = (qp->sq.wqe_cnt + qp->rq.wqe_cnt) * sizeof (uint64_t);
 
 	for (qp->rq.wqe_shift = 4;
 	     1 << qp->rq.wqe_shift < qp->rq.max_gs * sizeof (struct mlx4_wqe_data_seg);
@@ -627,23 +1723,97 @@ int mlx4_alloc_qp_buf(struct ibv_context *context, struct ibv_qp_cap *cap,
 		qp->sq.offset = 0;
 	}
 
-	if (qp->buf_size) {
-		if (mlx4_alloc_buf(&qp->buf,
-				   align(qp->buf_size, to_mdev(context->device)->page_size),
-				   to_mdev(context->device)->page_size)) {
-			free(qp->sq.wrid);
-			free(qp->rq.wrid);
-			return -1;
-		}
+	if (!qp->buf_size)
+		return 0;
 
-		memset(qp->buf.buf, 0, qp->buf_size);
-	} else {
+	/*
+	 * The wrid arrays live right behind the WQEs, in the same
+	 * mapping, rather than in two separate heap allocations.  The
+	 * kernel only pins the first buf_size bytes.
+	 */
+	return align(qp->buf_size, MLX4_CACHELINE_SIZE) + wrid_size;
+}
+
+static void init_qp_buf(struct mlx4_qp *qp)
+{
+	size_t wrid_offset = align(qp->buf_size, MLX4_CACHELINE_SIZE);
+
+	if (!qp->buf_size) {
 		qp->buf.buf = NULL;
+		return;
+	}
+
+	/*
+	 * Lazy SQ initialization needs unused WQEs to be zero, which a
+	 * fresh mapping already is.  The RQ is fully written by every
+	 * post.
+	 */
+	if (!(qp->buf.flags & MLX4_BUF_ZEROED))
+		memset(qp->buf.buf + qp->sq.offset, 0,
+		       qp->sq.wqe_cnt << qp->sq.wqe_shift);
+
+	if (!(qp->create_flags & MLX4DV_QP_CREATE_NO_WRID)) {
+		if (qp->sq.wqe_cnt)
+			qp->sq.wrid = qp->buf.buf + wrid_offset;
+		if (qp->rq.wqe_cnt)
+			qp->rq.wrid = qp->buf.buf + wrid_offset +
+				qp->sq.wqe_cnt * sizeof (uint64_t);
 	}
+}
+
+int mlx4_alloc_qp_buf(struct ibv_context *context, struct ibv_qp_cap *cap,
+		       enum ibv_qp_type type, struct mlx4_qp *qp)
+{
+	size_t size = calc_qp_buf_size(cap, qp);
+
+	if (size && mlx4_alloc_queue_buf(to_mctx(context), &qp->buf, size,
+					 mlx4_qp_buf_flags(context, qp),
+					 qp->numa_node))
+		return -1;
+
+	init_qp_buf(qp);
 
 	return 0;
 }
 
+/*
+ * Allocate the buffers of QPs created together, which share their
+ * creation flags and node, with mlx4_alloc_queue_bufs().
+ */
+int mlx4_alloc_qp_bufs(struct ibv_context *context,
+		       struct ibv_qp_init_attr_ex *attrs, struct mlx4_qp *qps,
+		       int num)
+{
+	struct mlx4_buf **bufs;
+	size_t *sizes;
+	int ret = -1;
+	int i;
+
+	bufs  = malloc(num * sizeof *bufs);
+	sizes = malloc(num * sizeof *sizes);
+	if (!bufs || !sizes)
+		goto out;
+
+	for (i = 0; i < num; ++i) {
+		sizes[i] = calc_qp_buf_size(&attrs[i].cap, &qps[i]);
+		bufs[i]	 = &qps[i].buf;
+	}
+
+	ret = mlx4_alloc_queue_bufs(to_mctx(context), bufs, sizes, num,
+				    mlx4_qp_buf_flags(context, &qps[0]),
+				    qps[0].numa_node);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < num; ++i)
+		init_qp_buf(&qps[i]);
+
+out:
+	free(sizes);
+	free(bufs);
+	return ret;
+}
+
 void mlx4_set_sq_sizes(struct mlx4_qp *qp, struct ibv_qp_cap *cap,
 		       enum ibv_qp_type type)
 {
@@ -684,36 +1854,26 @@ void mlx4_set_sq_sizes(struct mlx4_qp *qp, struct ibv_qp_cap *cap,
 
 struct mlx4_qp *mlx4_find_qp(struct mlx4_context *ctx, uint32_t qpn)
 {
-	int tind = (qpn & (ctx->num_qps - 1)) >> ctx->qp_table_shift;
-
-	if (ctx->qp_table[tind].refcnt)
-		return ctx->qp_table[tind].table[qpn & ctx->qp_table_mask];
-	else
-		return NULL;
+	return mlx4_index_lookup(&ctx->qp_table, qpn);
 }
 
+/*
+ * Called with qp_table_mutex held.  Creation no longer holds it across
+ * the kernel command, so the QPN may be one whose previous QP is still
+ * being destroyed.  Wait for that QP to leave the table: until then its
+ * CQEs may still be cleaned by number, which must not hit the new QP's.
+ */
 int mlx4_store_qp(struct mlx4_context *ctx, uint32_t qpn, struct mlx4_qp *qp)
 {
-	int tind = (qpn & (ctx->num_qps - 1)) >> ctx->qp_table_shift;
+	while (mlx4_index_lookup(&ctx->qp_table, qpn))
+		pthread_cond_wait(&ctx->qp_table_cond, &ctx->qp_table_mutex);
 
-	if (!ctx->qp_table[tind].refcnt) {
-		ctx->qp_table[tind].table = calloc(ctx->qp_table_mask + 1,
-						   sizeof (struct mlx4_qp *));
-		if (!ctx->qp_table[tind].table)
-			return -1;
-	}
-
-	++ctx->qp_table[tind].refcnt;
-	ctx->qp_table[tind].table[qpn & ctx->qp_table_mask] = qp;
-	return 0;
+	return mlx4_index_insert(&ctx->qp_table, qpn, qp);
 }
 
 void mlx4_clear_qp(struct mlx4_context *ctx, uint32_t qpn)
 {
-	int tind = (qpn & (ctx->num_qps - 1)) >> ctx->qp_table_shift;
+	mlx4_index_remove(&ctx->qp_table, qpn);
 
-	if (!--ctx->qp_table[tind].refcnt)
-		free(ctx->qp_table[tind].table);
-	else
-		ctx->qp_table[tind].table[qpn & ctx->qp_table_mask] = NULL;
+	pthread_cond_broadcast(&ctx->qp_table_cond);
 }
@@ -38,30 +38,129 @@
 #include <netinet/in.h>
 #include <pthread.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #include "mlx4.h"
 #include "doorbell.h"
 #include "wqe.h"
 #include "mlx4-abi.h"
 
+/*
+ * Link of the free list tail on single producer SRQs, until the chain
+ * appended after it is linked in, see mlx4_free_srq_wqes().
+ */
+enum {
+	MLX4_SRQ_LINK_PENDING	= 0xffff
+};
+
 static void *get_wqe(struct mlx4_srq *srq, int n)
 {
 	return srq->buf.buf + (n << srq->wqe_shift);
 }
 
-void mlx4_free_srq_wqe(struct mlx4_srq *srq, int ind)
+/*
+ * Take the WQE at the head of the free list.  WQEs are linked into the
+ * list as they are first posted rather than all at creation: the
+ * never posted ones follow each other in order, and the last of them
+ * is the initial tail, which gets its link when a WQE is freed.
+ */
+static inline struct mlx4_wqe_srq_next_seg *srq_next_head(struct mlx4_srq *srq)
+{
+	struct mlx4_wqe_srq_next_seg *next = get_wqe(srq, srq->head);
+
+	if (srq->head == srq->unlinked) {
+		if (srq->head != srq->max - 1)
+			next->next_wqe_index = htons(srq->head + 1);
+		++srq->unlinked;
+	}
+
+	srq->head = ntohs(next->next_wqe_index);
+
+	return next;
+}
+
+/*
+ * Snapshot the free list tail for a post call.  Single producer SRQs
+ * have it moved without the lock, see mlx4_free_srq_wqes().
+ */
+static inline int srq_tail(struct mlx4_srq *srq)
+{
+	int tail = srq->tail;
+
+	if (srq->create_flags & MLX4DV_SRQ_CREATE_SINGLE_PRODUCER)
+		rmb();
+
+	return tail;
+}
+
+/*
+ * Whether the WQE at the head can't be posted: it is the tail as of
+ * srq_tail() or, on single producer SRQs, a later tail whose link to
+ * the chain appended after it isn't stored yet.
+ */
+static inline int srq_full(struct mlx4_srq *srq, int tail)
 {
 	struct mlx4_wqe_srq_next_seg *next;
 
+	if (srq->head == tail)
+		return 1;
+
+	if (!(srq->create_flags & MLX4DV_SRQ_CREATE_SINGLE_PRODUCER) ||
+	    (srq->head == srq->unlinked && srq->head != srq->max - 1))
+		return 0;
+
+	next = get_wqe(srq, srq->head);
+
+	return __atomic_load_n(&next->next_wqe_index, __ATOMIC_ACQUIRE) ==
+		htons(MLX4_SRQ_LINK_PENDING);
+}
+
+/*
+ * Append a chain of n freed WQEs, already linked from first to last, to
+ * the tail of the free list.
+ */
+void mlx4_free_srq_wqes(struct mlx4_srq *srq, int first, int last, int n)
+{
+	struct mlx4_wqe_srq_next_seg *next;
+	int prev;
+
+	if (srq->create_flags & MLX4DV_SRQ_CREATE_SINGLE_PRODUCER) {
+		/*
+		 * Pollers of any number of CQs append without the lock.
+		 * The chain's last WQE is marked as not linked yet
+		 * before it is swapped in as the tail, and the old tail
+		 * is linked to the chain only afterwards: the producer
+		 * stops at a pending link, see srq_full().
+		 */
+		next = get_wqe(srq, last);
+		next->next_wqe_index = htons(MLX4_SRQ_LINK_PENDING);
+
+		prev = __atomic_exchange_n(&srq->tail, last, __ATOMIC_ACQ_REL);
+
+		next = get_wqe(srq, prev);
+		__atomic_store_n(&next->next_wqe_index, htons(first),
+				 __ATOMIC_RELEASE);
+
+		__atomic_fetch_add(&srq->completed, n, __ATOMIC_RELAXED);
+		return;
+	}
+
 	pthread_spin_lock(&srq->lock);
 
 	next = get_wqe(srq, srq->tail);
-	next->next_wqe_index = htons(ind);
-	srq->tail = ind;
+	next->next_wqe_index = htons(first);
+	srq->tail = last;
+	srq->completed += n;
 
 	pthread_spin_unlock(&srq->lock);
 }
 
+void mlx4_free_srq_wqe(struct mlx4_srq *srq, int ind)
+{
+	mlx4_free_srq_wqes(srq, ind, ind, 1);
+}
+
 int mlx4_post_srq_recv(struct ibv_srq *ibsrq,
 		       struct ibv_recv_wr *wr,
 		       struct ibv_recv_wr **bad_wr)
@@ -71,10 +170,13 @@ int mlx4_post_srq_recv(struct ibv_srq *ibsrq,
 	struct mlx4_wqe_data_seg *scat;
 	int err = 0;
 	int nreq;
+	int tail;
 	int i;
 
 	pthread_spin_lock(&srq->lock);
 
+	tail = srq_tail(srq);
+
 	for (nreq = 0; wr; ++nreq, wr = wr->next) {
 		if (wr->num_sge > srq->max_gs) {
 			err = -1;
@@ -82,7 +184,7 @@ int mlx4_post_srq_recv(struct ibv_srq *ibsrq,
 			break;
 		}
 
-		if (srq->head == srq->tail) {
+		if (srq_full(srq, tail)) {
 			/* SRQ is full*/
 			err = -1;
 			*bad_wr = wr;
@@ -91,8 +193,7 @@ int mlx4_post_srq_recv(struct ibv_srq *ibsrq,
 
 		srq->wrid[srq->head] = wr->wr_id;
 
-		next      = get_wqe(srq, srq->head);
-		srq->head = ntohs(next->next_wqe_index);
+		next      = srq_next_head(srq);
 		scat      = (struct mlx4_wqe_data_seg *) (next + 1);
 
 		for (i = 0; i < wr->num_sge; ++i) {
@@ -125,18 +226,523 @@ int mlx4_post_srq_recv(struct ibv_srq *ibsrq,
 	return err;
 }
 
+static inline int set_srq_recv_burst(struct mlx4_srq *srq,
+				     struct mlx4dv_recv_burst *burst,
+				     int tail, int term)
+	ALWAYS_INLINE;
+static inline int set_srq_recv_burst(struct mlx4_srq *srq,
+				     struct mlx4dv_recv_burst *burst,
+				     int tail, int term)
+{
+	struct mlx4_wqe_srq_next_seg *next;
+	struct mlx4_wqe_data_seg *scat;
+	uint32_t byte_count = htonl(burst->length);
+	uint32_t lkey = htonl(burst->lkey);
+	uint64_t addr = burst->addr;
+	int n;
+
+	for (n = 0; n < burst->num && !srq_full(srq, tail); ++n) {
+		srq->wrid[srq->head] = burst->wr_id + n;
+
+		next      = srq_next_head(srq);
+		scat      = (struct mlx4_wqe_data_seg *) (next + 1);
+
+		scat->byte_count = byte_count;
+		scat->lkey	 = lkey;
+		scat->addr	 = htonll(addr);
+
+		if (term) {
+			scat[1].byte_count = 0;
+			scat[1].lkey	   = htonl(MLX4_INVALID_LKEY);
+			scat[1].addr	   = 0;
+		}
+
+		addr += burst->stride;
+	}
+
+	return n;
+}
+
+int mlx4dv_post_srq_recv_burst(struct ibv_srq *ibsrq,
+			       struct mlx4dv_recv_burst *burst, int *posted)
+{
+	struct mlx4_srq *srq = to_msrq(ibsrq);
+	int tail;
+	int n;
+
+	*posted = 0;
+
+	if (burst->num < 0)
+		return EINVAL;
+
+	pthread_spin_lock(&srq->lock);
+
+	tail = srq_tail(srq);
+
+	if (1 << srq->wqe_shift == sizeof (struct mlx4_wqe_srq_next_seg) +
+				   sizeof (struct mlx4_wqe_data_seg))
+		n = set_srq_recv_burst(srq, burst, tail, 0);
+	else
+		n = set_srq_recv_burst(srq, burst, tail, 1);
+
+	if (n) {
+		srq->counter += n;
+
+		/*
+		 * Make sure that descriptors are written before
+		 * we write doorbell record.
+		 */
+		wmb();
+
+		*srq->db = htonl(srq->counter);
+	}
+
+	pthread_spin_unlock(&srq->lock);
+
+	*posted = n;
+
+	return n < burst->num ? ENOMEM : 0;
+}
+
+/*
+ * Receives currently posted, tracked without the lock from the post
+ * counter and the number of WQEs returned by completions.
+ */
+static inline int srq_posted(struct mlx4_srq *srq)
+{
+	return (uint16_t) (srq->counter - srq->completed);
+}
+
+static uint64_t replenish_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Called with srq->lock held */
+static void replenish_mark_below(struct mlx4_srq_replenish *rep)
+{
+	if (!rep->below_since) {
+		rep->below_since = replenish_now();
+		++rep->stats.below_watermark;
+	}
+}
+
+/*
+ * Post free slab buffers until either the SRQ or the slab runs out.
+ */
+static void mlx4_srq_replenish(struct mlx4_srq *srq)
+{
+	struct mlx4_srq_replenish *rep = srq->replenish;
+	struct mlx4_wqe_srq_next_seg *next;
+	struct mlx4_wqe_data_seg *scat;
+	uint32_t byte_count = htonl(rep->length);
+	uint32_t lkey = htonl(rep->lkey);
+	uint64_t addr;
+	int tail;
+	int n;
+
+	pthread_spin_lock(&srq->lock);
+
+	if (srq_posted(srq) < rep->watermark)
+		replenish_mark_below(rep);
+
+	tail = srq_tail(srq);
+
+	for (n = 0; rep->num_free && !srq_full(srq, tail); ++n) {
+		addr = rep->addr +
+		       (uint64_t) rep->free_bufs[--rep->num_free] * rep->stride;
+
+		srq->wrid[srq->head] = addr;
+
+		next      = srq_next_head(srq);
+		scat      = (struct mlx4_wqe_data_seg *) (next + 1);
+
+		scat->byte_count = byte_count;
+		scat->lkey	 = lkey;
+		scat->addr	 = htonll(addr);
+
+		if (srq->max_gs > 1) {
+			scat[1].byte_count = 0;
+			scat[1].lkey	   = htonl(MLX4_INVALID_LKEY);
+			scat[1].addr	   = 0;
+		}
+	}
+
+	if (n) {
+		srq->counter += n;
+
+		/*
+		 * Make sure that descriptors are written before
+		 * we write doorbell record.
+		 */
+		wmb();
+
+		*srq->db = htonl(srq->counter);
+
+		++rep->stats.refills;
+		rep->stats.bufs_posted += n;
+	}
+
+	if (rep->below_since) {
+		if (srq_posted(srq) >= rep->watermark) {
+			rep->stats.below_watermark_ns +=
+				replenish_now() - rep->below_since;
+			rep->below_since = 0;
+		} else if (!rep->num_free) {
+			++rep->stats.starved;
+		}
+	}
+
+	pthread_spin_unlock(&srq->lock);
+}
+
+static void *replenish_thread(void *arg)
+{
+	struct mlx4_srq_replenish *rep = arg;
+
+	pthread_mutex_lock(&rep->mutex);
+
+	while (!rep->stop) {
+		if (!rep->kick) {
+			pthread_cond_wait(&rep->cond, &rep->mutex);
+			continue;
+		}
+
+		rep->kick = 0;
+		pthread_mutex_unlock(&rep->mutex);
+
+		mlx4_srq_replenish(rep->srq);
+
+		pthread_mutex_lock(&rep->mutex);
+	}
+
+	pthread_mutex_unlock(&rep->mutex);
+
+	return NULL;
+}
+
+/*
+ * Called after WQEs were returned to an SRQ with a replenisher attached.
+ */
+void mlx4_srq_check_replenish(struct mlx4_srq *srq)
+{
+	struct mlx4_srq_replenish *rep = srq->replenish;
+
+	if (srq_posted(srq) >= rep->watermark)
+		return;
+
+	if (!rep->use_thread) {
+		mlx4_srq_replenish(srq);
+		return;
+	}
+
+	if (rep->kick)
+		return;
+
+	pthread_spin_lock(&srq->lock);
+	replenish_mark_below(rep);
+	pthread_spin_unlock(&srq->lock);
+
+	pthread_mutex_lock(&rep->mutex);
+	rep->kick = 1;
+	pthread_cond_signal(&rep->cond);
+	pthread_mutex_unlock(&rep->mutex);
+}
+
+static void free_replenish(struct mlx4_srq_replenish *rep)
+{
+	pthread_cond_destroy(&rep->cond);
+	pthread_mutex_destroy(&rep->mutex);
+	free(rep->free_bufs);
+	free(rep->held);
+	free(rep);
+}
+
+int mlx4dv_srq_start_replenish(struct ibv_srq *ibsrq,
+			       struct mlx4dv_srq_replenish_attr *attr)
+{
+	struct mlx4_srq *srq = to_msrq(ibsrq);
+	struct mlx4_srq_replenish *rep;
+	int i;
+
+	if (srq->replenish)
+		return EBUSY;
+
+	if (attr->flags & ~MLX4DV_SRQ_REPLENISH_THREAD ||
+	    !attr->num_bufs || !attr->length || attr->stride < attr->length ||
+	    !attr->watermark || attr->watermark >= srq->max)
+		return EINVAL;
+
+	rep = calloc(1, sizeof *rep);
+	if (!rep)
+		return ENOMEM;
+
+	rep->free_bufs = malloc(attr->num_bufs * sizeof *rep->free_bufs);
+	rep->held      = calloc(attr->num_bufs, 1);
+	if (!rep->free_bufs || !rep->held) {
+		free(rep->free_bufs);
+		free(rep->held);
+		free(rep);
+		return ENOMEM;
+	}
+
+	/* Hand buffers out in slab order */
+	for (i = 0; i < attr->num_bufs; ++i)
+		rep->free_bufs[i] = attr->num_bufs - 1 - i;
+
+	rep->srq	= srq;
+	rep->addr	= attr->addr;
+	rep->stride	= attr->stride;
+	rep->length	= attr->length;
+	rep->lkey	= attr->lkey;
+	rep->watermark	= attr->watermark;
+	rep->num_free	= attr->num_bufs;
+	rep->num_bufs	= attr->num_bufs;
+	rep->use_thread	= !!(attr->flags & MLX4DV_SRQ_REPLENISH_THREAD);
+
+	pthread_mutex_init(&rep->mutex, NULL);
+	pthread_cond_init(&rep->cond, NULL);
+
+	if (rep->use_thread &&
+	    pthread_create(&rep->thread, NULL, replenish_thread, rep)) {
+		free_replenish(rep);
+		return EAGAIN;
+	}
+
+	srq->replenish = rep;
+
+	mlx4_srq_replenish(srq);
+
+	return 0;
+}
+
+void mlx4_srq_stop_replenish(struct mlx4_srq *srq)
+{
+	struct mlx4_srq_replenish *rep = srq->replenish;
+
+	if (!rep)
+		return;
+
+	if (rep->use_thread) {
+		pthread_mutex_lock(&rep->mutex);
+		rep->stop = 1;
+		pthread_cond_signal(&rep->cond);
+		pthread_mutex_unlock(&rep->mutex);
+
+		pthread_join(rep->thread, NULL);
+	}
+
+	srq->replenish = NULL;
+	free_replenish(rep);
+}
+
+int mlx4dv_srq_release_buf(struct ibv_srq *ibsrq, uint64_t wr_id)
+{
+	struct mlx4_srq *srq = to_msrq(ibsrq);
+	struct mlx4_srq_replenish *rep = srq->replenish;
+	uint64_t off;
+
+	if (!rep || wr_id < rep->addr)
+		return EINVAL;
+
+	off = wr_id - rep->addr;
+	if (off % rep->stride || off / rep->stride >= rep->num_bufs)
+		return EINVAL;
+
+	pthread_spin_lock(&srq->lock);
+
+	if (!rep->held[off / rep->stride]) {
+		pthread_spin_unlock(&srq->lock);
+		return EINVAL;
+	}
+
+	rep->held[off / rep->stride] = 0;
+	rep->free_bufs[rep->num_free++] = off / rep->stride;
+
+	pthread_spin_unlock(&srq->lock);
+
+	/*
+	 * A drained SRQ sees no completions, so buffers coming back
+	 * have to be able to restart replenishing by themselves.
+	 */
+	mlx4_srq_check_replenish(srq);
+
+	return 0;
+}
+
+int mlx4dv_srq_query_replenish(struct ibv_srq *ibsrq,
+			       struct mlx4dv_srq_replenish_stats *stats)
+{
+	struct mlx4_srq *srq = to_msrq(ibsrq);
+	struct mlx4_srq_replenish *rep = srq->replenish;
+
+	if (!rep)
+		return EINVAL;
+
+	pthread_spin_lock(&srq->lock);
+
+	*stats = rep->stats;
+	if (rep->below_since)
+		stats->below_watermark_ns += replenish_now() - rep->below_since;
+
+	pthread_spin_unlock(&srq->lock);
+
+	return 0;
+}
+
+/*
+ * Post every WQE on the free list but the tail.  In ring mode those
+ * are all released slots whose WQEs still point at their buffers.
+ * Called with srq->lock held.
+ */
+static void post_recv_ring(struct mlx4_srq *srq)
+{
+	int tail = srq->tail;
+	int n;
+
+	for (n = 0; srq->head != tail; ++n)
+		srq_next_head(srq);
+
+	if (!n)
+		return;
+
+	srq->counter += n;
+
+	/*
+	 * Make sure that descriptors are written before
+	 * we write doorbell record.
+	 */
+	wmb();
+
+	*srq->db = htonl(srq->counter);
+}
+
+int mlx4dv_srq_start_recv_ring(struct ibv_srq *ibsrq,
+			       struct mlx4dv_recv_ring_attr *attr)
+{
+	struct mlx4_srq *srq = to_msrq(ibsrq);
+	struct mlx4_recv_ring *ring;
+	struct mlx4_wqe_data_seg *scat;
+	uint64_t addr;
+	int ind;
+
+	if (!attr->length || attr->stride < attr->length ||
+	    attr->num_bufs < srq->max)
+		return EINVAL;
+
+	if (srq->recv_ring || srq->replenish)
+		return EBUSY;
+
+	ring = calloc(1, sizeof *ring + srq->max);
+	if (!ring)
+		return ENOMEM;
+
+	ring->addr     = attr->addr;
+	ring->stride   = attr->stride;
+	ring->num_bufs = srq->max;
+	ring->state    = (uint8_t *) (ring + 1);
+	memset(ring->state, MLX4_RING_RELEASED, srq->max);
+
+	pthread_spin_lock(&srq->lock);
+
+	if (srq_posted(srq)) {
+		pthread_spin_unlock(&srq->lock);
+		free(ring);
+		return EBUSY;
+	}
+
+	for (ind = 0; ind < srq->max; ++ind) {
+		addr = attr->addr + (uint64_t) ind * attr->stride;
+		scat = (struct mlx4_wqe_data_seg *)
+			((struct mlx4_wqe_srq_next_seg *) get_wqe(srq, ind) + 1);
+
+		scat->byte_count = htonl(attr->length);
+		scat->lkey	 = htonl(attr->lkey);
+		scat->addr	 = htonll(addr);
+
+		if (srq->max_gs > 1) {
+			scat[1].byte_count = 0;
+			scat[1].lkey	   = htonl(MLX4_INVALID_LKEY);
+			scat[1].addr	   = 0;
+		}
+
+		srq->wrid[ind] = addr;
+	}
+
+	srq->recv_ring = ring;
+	post_recv_ring(srq);
+
+	pthread_spin_unlock(&srq->lock);
+
+	attr->num_bufs = srq->max;
+
+	return 0;
+}
+
+int mlx4dv_srq_release_recv(struct ibv_srq *ibsrq, uint64_t *wr_id, int num)
+{
+	struct mlx4_srq *srq = to_msrq(ibsrq);
+	struct mlx4_recv_ring *ring = srq->recv_ring;
+	struct mlx4_wqe_srq_next_seg *next;
+	int err = 0;
+	int slot;
+	int i;
+
+	if (!ring)
+		return EINVAL;
+
+	pthread_spin_lock(&srq->lock);
+
+	/*
+	 * A released slot becomes the new tail of the free list, which
+	 * lets the previous tail be posted with the rest of the list.
+	 */
+	for (i = 0; i < num; ++i) {
+		slot = mlx4_recv_ring_slot(ring, wr_id[i]);
+		if (slot < 0 || ring->state[slot] != MLX4_RING_HELD) {
+			err = EINVAL;
+			break;
+		}
+
+		ring->state[slot] = MLX4_RING_RELEASED;
+
+		next = get_wqe(srq, srq->tail);
+		next->next_wqe_index = htons(slot);
+		srq->tail = slot;
+	}
+
+	srq->completed += i;
+
+	post_recv_ring(srq);
+
+	pthread_spin_unlock(&srq->lock);
+
+	return err;
+}
+
+static int mlx4_srq_buf_flags(struct ibv_context *context,
+			      struct mlx4_srq *srq)
+{
+	int flags = to_mctx(context)->buf_flags;
+
+	if (srq->create_flags & MLX4DV_SRQ_CREATE_HUGE_BUF)
+		flags |= MLX4_BUF_HUGE;
+	if (srq->create_flags & MLX4DV_SRQ_CREATE_POPULATE_BUF)
+		flags |= MLX4_BUF_POPULATE;
+
+	return flags;
+}
+
 int mlx4_alloc_srq_buf(struct ibv_pd *pd, struct ibv_srq_attr *attr,
 		       struct mlx4_srq *srq)
 {
 	struct mlx4_wqe_srq_next_seg *next;
-	struct mlx4_wqe_data_seg *scatter;
 	int size;
 	int buf_size;
-	int i;
-
-	srq->wrid = malloc(srq->max * sizeof (uint64_t));
-	if (!srq->wrid)
-		return -1;
 
 	size = sizeof (struct mlx4_wqe_srq_next_seg) +
 		srq->max_gs * sizeof (struct mlx4_wqe_data_seg);
@@ -146,92 +752,66 @@ int mlx4_alloc_srq_buf(struct ibv_pd *pd, struct ibv_srq_attr *attr,
 
 	buf_size = srq->max << srq->wqe_shift;
 
-	if (mlx4_alloc_buf(&srq->buf, buf_size,
-			   to_mdev(pd->context->device)->page_size)) {
-		free(srq->wrid);
+	/* The wrid array follows the WQEs, as for QPs */
+	if (mlx4_alloc_queue_buf(to_mctx(pd->context), &srq->buf,
+				 buf_size + srq->max * sizeof (uint64_t),
+				 mlx4_srq_buf_flags(pd->context, srq),
+				 srq->numa_node))
 		return -1;
-	}
 
-	memset(srq->buf.buf, 0, buf_size);
+	srq->wrid = srq->buf.buf + buf_size;
 
 	/*
-	 * Now initialize the SRQ buffer so that all of the WQEs are
-	 * linked into the list of free WQEs.
+	 * Nothing to initialize but the tail's link on single producer
+	 * SRQs: every post writes the whole scatter list, and
+	 * srq_next_head() links the free list on first use.
 	 */
+	srq->head     = 0;
+	srq->unlinked = 0;
+	srq->tail     = srq->max - 1;
 
-	for (i = 0; i < srq->max; ++i) {
-		next = get_wqe(srq, i);
-		next->next_wqe_index = htons((i + 1) & (srq->max - 1));
-
-		for (scatter = (void *) (next + 1);
-		     (void *) scatter < (void *) next + (1 << srq->wqe_shift);
-		     ++scatter)
-			scatter->lkey = htonl(MLX4_INVALID_LKEY);
+	if (srq->create_flags & MLX4DV_SRQ_CREATE_SINGLE_PRODUCER) {
+		next = get_wqe(srq, srq->tail);
+		next->next_wqe_index = htons(MLX4_SRQ_LINK_PENDING);
 	}
 
-	srq->head = 0;
-	srq->tail = srq->max - 1;
-
 	return 0;
 }
 
-void mlx4_init_xsrq_table(struct mlx4_xsrq_table *xsrq_table, int size)
+int mlx4_init_xsrq_table(struct mlx4_xsrq_table *xsrq_table, int size)
 {
-	memset(xsrq_table, 0, sizeof *xsrq_table);
-	xsrq_table->num_xsrq = size;
-	xsrq_table->shift = ffs(size) - 1 - MLX4_XSRQ_TABLE_BITS;
-	xsrq_table->mask = (1 << xsrq_table->shift) - 1;
-
 	pthread_mutex_init(&xsrq_table->mutex, NULL);
+
+	return mlx4_index_init(&xsrq_table->index, size);
 }
 
-struct mlx4_srq *mlx4_find_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn)
+void mlx4_cleanup_xsrq_table(struct mlx4_xsrq_table *xsrq_table)
 {
-	int index;
-
-	index = (srqn & (xsrq_table->num_xsrq - 1)) >> xsrq_table->shift;
-	if (xsrq_table->xsrq_table[index].refcnt)
-		return xsrq_table->xsrq_table[index].table[srqn & xsrq_table->mask];
+	mlx4_index_cleanup(&xsrq_table->index);
+	pthread_mutex_destroy(&xsrq_table->mutex);
+}
 
-	return NULL;
+struct mlx4_srq *mlx4_find_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn)
+{
+	return mlx4_index_lookup(&xsrq_table->index, srqn);
 }
 
 int mlx4_store_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn,
 		    struct mlx4_srq *srq)
 {
-	int index, ret = 0;
+	int ret;
 
-	index = (srqn & (xsrq_table->num_xsrq - 1)) >> xsrq_table->shift;
 	pthread_mutex_lock(&xsrq_table->mutex);
-	if (!xsrq_table->xsrq_table[index].refcnt) {
-		xsrq_table->xsrq_table[index].table = calloc(xsrq_table->mask + 1,
-							     sizeof(struct mlx4_srq *));
-		if (!xsrq_table->xsrq_table[index].table) {
-			ret = -1;
-			goto out;
-		}
-	}
-
-	xsrq_table->xsrq_table[index].refcnt++;
-	xsrq_table->xsrq_table[index].table[srqn & xsrq_table->mask] = srq;
-
-out:
+	ret = mlx4_index_insert(&xsrq_table->index, srqn, srq);
 	pthread_mutex_unlock(&xsrq_table->mutex);
+
 	return ret;
 }
 
 void mlx4_clear_xsrq(struct mlx4_xsrq_table *xsrq_table, uint32_t srqn)
 {
-	int index;
-
-	index = (srqn & (xsrq_table->num_xsrq - 1)) >> xsrq_table->shift;
 	pthread_mutex_lock(&xsrq_table->mutex);
-
-	if (--xsrq_table->xsrq_table[index].refcnt)
-		xsrq_table->xsrq_table[index].table[srqn & xsrq_table->mask] = NULL;
-	else
-		free(xsrq_table->xsrq_table[index].table);
-
+	mlx4_index_remove(&xsrq_table->index, srqn);
 	pthread_mutex_unlock(&xsrq_table->mutex);
 }
 
@@ -247,7 +827,7 @@ struct ibv_srq *mlx4_create_xrc_srq(struct ibv_context *context,
 	if (attr_ex->attr.max_wr > 1 << 16 || attr_ex->attr.max_sge > 64)
 		return NULL;
 
-	srq = calloc(1, sizeof *srq);
+	srq = mlx4_calloc_aligned(sizeof *srq);
 	if (!srq)
 		return NULL;
 
@@ -258,11 +838,13 @@ struct ibv_srq *mlx4_create_xrc_srq(struct ibv_context *context,
 	srq->max_gs  = attr_ex->attr.max_sge;
 	srq->counter = 0;
 	srq->ext_srq = 1;
+	srq->numa_node = to_mdev(context->device)->numa_node;
 
 	if (mlx4_alloc_srq_buf(attr_ex->pd, &attr_ex->attr, srq))
 		goto err;
 
-	srq->db = mlx4_alloc_db(to_mctx(context), MLX4_DB_TYPE_RQ);
+	srq->db = mlx4_alloc_db(to_mctx(context),
+				mlx4_rq_db_type(to_mctx(context), 0));
 	if (!srq->db)
 		goto err_free;
 
@@ -289,10 +871,9 @@ struct ibv_srq *mlx4_create_xrc_srq(struct ibv_context *context,
 err_destroy:
 	ibv_cmd_destroy_srq(&srq->verbs_srq.srq);
 err_db:
-	mlx4_free_db(to_mctx(context), MLX4_DB_TYPE_RQ, srq->db);
+	mlx4_free_db(to_mctx(context), srq->db);
 err_free:
-	free(srq->wrid);
-	mlx4_free_buf(&srq->buf);
+	mlx4_free_queue_buf(to_mctx(context), &srq->buf);
 err:
 	free(srq);
 	return NULL;
@@ -319,9 +900,10 @@ int mlx4_destroy_xrc_srq(struct ibv_srq *srq)
 		return ret;
 	}
 
-	mlx4_free_db(mctx, MLX4_DB_TYPE_RQ, msrq->db);
-	mlx4_free_buf(&msrq->buf);
-	free(msrq->wrid);
+	mlx4_srq_stop_replenish(msrq);
+	free(msrq->recv_ring);
+	mlx4_free_db(mctx, msrq->db);
+	mlx4_free_queue_buf(mctx, &msrq->buf);
 	free(msrq);
 
 	return 0;
@@ -159,48 +159,240 @@ int mlx4_query_values(struct ibv_context *context,
 	return err;
 }
 
+/*
+ * Device and port attributes are cached per context, and dropped on the
+ * async events that may change them.  Those events carry a port number
+ * but not the device, so they bump a process wide generation of the
+ * port, which makes its cached attributes stale in every context.
+ */
+static pthread_mutex_t attr_gen_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned port_gen[MLX4_PORTS_NUM];
+static unsigned device_gen;
+
+/* Port 0 stands for the device */
+static unsigned get_port_gen(int port)
+{
+	unsigned gen;
+
+	pthread_mutex_lock(&attr_gen_lock);
+	gen = port ? port_gen[port - 1] : device_gen;
+	pthread_mutex_unlock(&attr_gen_lock);
+
+	return gen;
+}
+
+void mlx4_async_event(struct ibv_async_event *event)
+{
+	int i;
+
+	pthread_mutex_lock(&attr_gen_lock);
+
+	switch (event->event_type) {
+	case IBV_EVENT_PORT_ACTIVE:
+	case IBV_EVENT_PORT_ERR:
+	case IBV_EVENT_LID_CHANGE:
+	case IBV_EVENT_PKEY_CHANGE:
+	case IBV_EVENT_SM_CHANGE:
+	case IBV_EVENT_CLIENT_REREGISTER:
+	case IBV_EVENT_GID_CHANGE:
+		if (event->element.port_num > 0 &&
+		    event->element.port_num <= MLX4_PORTS_NUM)
+			++port_gen[event->element.port_num - 1];
+		break;
+
+	case IBV_EVENT_DEVICE_FATAL:
+		++device_gen;
+		for (i = 0; i < MLX4_PORTS_NUM; ++i)
+			++port_gen[i];
+		break;
+
+	default:
+		break;
+	}
+
+	pthread_mutex_unlock(&attr_gen_lock);
+}
+
+void mlx4_init_attr_cache(struct mlx4_context *context)
+{
+	pthread_mutex_init(&context->attr_cache_lock, NULL);
+	memset(&context->attr_cache, 0, sizeof context->attr_cache);
+}
+
+void mlx4_cleanup_attr_cache(struct mlx4_context *context)
+{
+	int i;
+
+	for (i = 0; i < MLX4_PORTS_NUM; ++i) {
+		free(context->attr_cache.port[i].gid);
+		free(context->attr_cache.port[i].gid_valid);
+	}
+
+	pthread_mutex_destroy(&context->attr_cache_lock);
+}
+
+/*
+ * Store freshly queried port attributes, queried at generation gen.
+ * Called with attr_cache_lock held.
+ */
+static void set_port_attr(struct mlx4_port_cache *cache, unsigned gen,
+			  struct ibv_port_attr *attr)
+{
+	int len = attr->gid_tbl_len;
+
+	/* A new generation may come with a new GID table */
+	if (cache->valid && cache->gen == gen &&
+	    cache->attr.gid_tbl_len == len) {
+		cache->attr = *attr;
+		return;
+	}
+
+	free(cache->gid);
+	free(cache->gid_valid);
+	cache->gid	 = len > 0 ? malloc(len * sizeof *cache->gid) : NULL;
+	cache->gid_valid = len > 0 ? calloc(len, 1) : NULL;
+	if (!cache->gid || !cache->gid_valid) {
+		free(cache->gid);
+		free(cache->gid_valid);
+		cache->gid	 = NULL;
+		cache->gid_valid = NULL;
+		attr->gid_tbl_len = len = 0;
+	}
+
+	cache->attr  = *attr;
+	cache->attr.gid_tbl_len = len;
+	cache->gen   = gen;
+	cache->valid = 1;
+}
+
 int mlx4_query_port(struct ibv_context *context, uint8_t port,
 		     struct ibv_port_attr *attr)
 {
+	struct mlx4_context *mctx = to_mctx(context);
 	struct ibv_query_port cmd;
+	struct ibv_port_attr cached;
+	unsigned gen = 0;
 	int err;
 
+	if (port > 0 && port <= MLX4_PORTS_NUM)
+		gen = get_port_gen(port);
+
 	err = ibv_cmd_query_port(context, port, attr, &cmd, sizeof(cmd));
 	if (!err && port <= MLX4_PORTS_NUM && port > 0) {
-		struct mlx4_context *mctx = to_mctx(context);
-		if (!mctx->port_query_cache[port - 1].valid) {
-			mctx->port_query_cache[port - 1].link_layer =
-				attr->link_layer;
-			mctx->port_query_cache[port - 1].caps =
-				attr->port_cap_flags;
-			mctx->port_query_cache[port - 1].valid = 1;
+		cached = *attr;
+		pthread_mutex_lock(&mctx->attr_cache_lock);
+		set_port_attr(&mctx->attr_cache.port[port - 1], gen, &cached);
+		pthread_mutex_unlock(&mctx->attr_cache_lock);
+	}
+
+	return err;
+}
+
+/*
+ * Port attributes from the cache, queried only if the port changed
+ * since they were stored.  Called with attr_cache_lock held.
+ */
+static int __get_port_cache(struct mlx4_context *mctx, uint8_t port,
+			    struct mlx4_port_cache **pcache)
+{
+	struct mlx4_port_cache *cache;
+	struct ibv_query_port cmd;
+	struct ibv_port_attr attr;
+	unsigned gen;
+	int err;
+
+	if (port <= 0 || port > MLX4_PORTS_NUM)
+		return EINVAL;
+
+	cache = &mctx->attr_cache.port[port - 1];
+	gen   = get_port_gen(port);
+	if (!cache->valid || cache->gen != gen) {
+		err = ibv_cmd_query_port(&mctx->ibv_ctx, port, &attr,
+					 &cmd, sizeof cmd);
+		if (err)
+			return err;
+
+		set_port_attr(cache, gen, &attr);
+	}
+
+	*pcache = cache;
+
+	return 0;
+}
+
+static int get_port_attr(struct ibv_context *context, uint8_t port,
+			 struct ibv_port_attr *attr)
+{
+	struct mlx4_context *mctx = to_mctx(context);
+	struct mlx4_port_cache *cache;
+	int err;
+
+	pthread_mutex_lock(&mctx->attr_cache_lock);
+
+	err = __get_port_cache(mctx, port, &cache);
+	if (!err)
+		*attr = cache->attr;
+
+	pthread_mutex_unlock(&mctx->attr_cache_lock);
+
+	return err;
+}
+
+static int get_gid(struct ibv_context *context, uint8_t port, int index,
+		   union ibv_gid *gid)
+{
+	struct mlx4_context *mctx = to_mctx(context);
+	struct mlx4_port_cache *cache;
+	int err;
+
+	pthread_mutex_lock(&mctx->attr_cache_lock);
+
+	err = __get_port_cache(mctx, port, &cache);
+	if (err)
+		goto out;
+
+	if (index < 0 || index >= cache->attr.gid_tbl_len) {
+		/* Out of the table, or no memory to cache it */
+		err = ibv_query_gid(context, port, index, gid);
+	} else if (cache->gid_valid[index]) {
+		*gid = cache->gid[index];
+	} else {
+		err = ibv_query_gid(context, port, index, &cache->gid[index]);
+		if (!err) {
+			cache->gid_valid[index] = 1;
+			*gid = cache->gid[index];
 		}
 	}
 
+out:
+	pthread_mutex_unlock(&mctx->attr_cache_lock);
+
 	return err;
 }
 
-/* Only the fields in the port cache will be valid */
-static int query_port_cache(struct ibv_context *context, uint8_t port_num,
-			    struct ibv_port_attr *port_attr)
+static int get_device_attr(struct ibv_context *context,
+			   struct ibv_device_attr *attr)
 {
 	struct mlx4_context *mctx = to_mctx(context);
-	if (port_num <= 0 || port_num > MLX4_PORTS_NUM)
-		return -EINVAL;
-	if (mctx->port_query_cache[port_num - 1].valid) {
-		port_attr->link_layer =
-			mctx->
-			port_query_cache[port_num - 1].
-			link_layer;
-		port_attr->port_cap_flags =
-			mctx->
-			port_query_cache[port_num - 1].
-			caps;
-		return 0;
+	struct mlx4_attr_cache *cache = &mctx->attr_cache;
+	unsigned gen;
+	int err = 0;
+
+	pthread_mutex_lock(&mctx->attr_cache_lock);
+
+	gen = get_port_gen(0);
+	if (!cache->device_valid || cache->device_gen != gen) {
+		err = mlx4_query_device(context, &cache->device_attr);
+		cache->device_valid = !err;
+		cache->device_gen   = gen;
 	}
-	return mlx4_query_port(context, port_num,
-			       (struct ibv_port_attr *)port_attr);
 
+	if (!err)
+		*attr = cache->device_attr;
+
+	pthread_mutex_unlock(&mctx->attr_cache_lock);
+
+	return err;
 }
 
 struct ibv_pd *mlx4_alloc_pd(struct ibv_context *context)
@@ -228,6 +420,8 @@ int mlx4_free_pd(struct ibv_pd *pd)
 {
 	int ret;
 
+	mlx4_mr_cache_flush_pd(pd);
+
 	ret = ibv_cmd_dealloc_pd(pd);
 	if (ret)
 		return ret;
@@ -275,7 +469,7 @@ int mlx4_close_xrcd(struct ibv_xrcd *ib_xrcd)
 struct ibv_mr *mlx4_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
 			   int access)
 {
-	struct ibv_mr *mr;
+	struct mlx4_mr *mr;
 	struct ibv_reg_mr cmd;
 	struct ibv_reg_mr_resp resp;
 	int ret;
@@ -284,15 +478,25 @@ struct ibv_mr *mlx4_reg_mr(struct ibv_pd *pd, void *addr, size_t length,
 	if (!mr)
 		return NULL;
 
+	if (!mlx4_mr_cache_get(pd, addr, length, access, mr)) {
+		mr->ibv_mr.context = pd->context;
+		mr->ibv_mr.pd	   = pd;
+		mr->ibv_mr.addr	   = addr;
+		mr->ibv_mr.length  = length;
+		return &mr->ibv_mr;
+	}
+
+	mr->entry = NULL;
+
 	ret = ibv_cmd_reg_mr(pd, addr, length, (uintptr_t) addr,
-			     access, mr, &cmd, sizeof cmd,
+			     access, &mr->ibv_mr, &cmd, sizeof cmd,
 			     &resp, sizeof resp);
 	if (ret) {
 		free(mr);
 		return NULL;
 	}
 
-	return mr;
+	return &mr->ibv_mr;
 }
 
 int mlx4_rereg_mr(struct ibv_mr *mr,
@@ -303,6 +507,10 @@ int mlx4_rereg_mr(struct ibv_mr *mr,
 	struct ibv_rereg_mr cmd;
 	struct ibv_rereg_mr_resp resp;
 
+	/* Cached registrations are shared with other MRs */
+	if (to_mmr(mr)->entry)
+		return EINVAL;
+
 	return ibv_cmd_rereg_mr(mr, flags, addr, length,
 				(uintptr_t) addr,
 				access, pd,
@@ -314,11 +522,17 @@ int mlx4_dereg_mr(struct ibv_mr *mr)
 {
 	int ret;
 
+	if (to_mmr(mr)->entry) {
+		mlx4_mr_cache_put(to_mctx(mr->context), to_mmr(mr));
+		free(to_mmr(mr));
+		return 0;
+	}
+
 	ret = ibv_cmd_dereg_mr(mr);
 	if (ret)
 		return ret;
 
-	free(mr);
+	free(to_mmr(mr));
 	return 0;
 }
 
@@ -345,9 +559,19 @@ enum {
 	CREATE_CQ_SUPPORTED_FLAGS = IBV_CREATE_CQ_ATTR_COMPLETION_TIMESTAMP
 };
 
+enum {
+	CREATE_CQ_SUPPORTED_DV_COMP_MASK = MLX4DV_CQ_INIT_ATTR_MASK_NUMA_NODE |
+					   MLX4DV_CQ_INIT_ATTR_MASK_CREATE_FLAGS
+};
+
+enum {
+	CREATE_CQ_SUPPORTED_DV_FLAGS = MLX4DV_CQ_CREATE_ISOLATED_DB
+};
+
 static struct ibv_cq *create_cq(struct ibv_context *context,
 				struct ibv_cq_init_attr_ex *cq_attr,
-				enum cmd_type cmd_type)
+				enum cmd_type cmd_type,
+				struct mlx4dv_cq_init_attr *mlx4_attr)
 {
 	struct mlx4_create_cq		cmd;
 	struct mlx4_create_cq_ex	cmd_e;
@@ -357,6 +581,8 @@ static struct ibv_cq *create_cq(struct ibv_context *context,
 	int				ret;
 	struct mlx4_context		*mctx = to_mctx(context);
 	struct ibv_cq_init_attr_ex	cq_attr_e;
+	int				numa_node;
+	enum mlx4_db_type		db_type;
 	int cqe;
 
 	/* Sanity check CQ size before proceeding */
@@ -392,11 +618,36 @@ static struct ibv_cq *create_cq(struct ibv_context *context,
 		return NULL;
 	}
 
-	cq = malloc(sizeof *cq);
+	numa_node = to_mdev(context->device)->numa_node;
+	db_type	  = mctx->db_isolated ? MLX4_DB_TYPE_CQ_ISOLATED :
+				        MLX4_DB_TYPE_CQ;
+	if (mlx4_attr) {
+		if (mlx4_attr->comp_mask & ~CREATE_CQ_SUPPORTED_DV_COMP_MASK) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		if (mlx4_attr->comp_mask & MLX4DV_CQ_INIT_ATTR_MASK_NUMA_NODE)
+			numa_node = mlx4_attr->numa_node;
+
+		if (mlx4_attr->comp_mask & MLX4DV_CQ_INIT_ATTR_MASK_CREATE_FLAGS) {
+			if (mlx4_attr->create_flags & ~CREATE_CQ_SUPPORTED_DV_FLAGS) {
+				errno = EINVAL;
+				return NULL;
+			}
+
+			if (mlx4_attr->create_flags & MLX4DV_CQ_CREATE_ISOLATED_DB)
+				db_type = MLX4_DB_TYPE_CQ_ISOLATED;
+		}
+	}
+
+	cq = mlx4_calloc_aligned(sizeof *cq);
 	if (!cq)
 		return NULL;
 
 	cq->cons_index = 0;
+	cq->free_srq   = NULL;
+	cq->numa_node  = numa_node;
 
 	if (pthread_spin_init(&cq->lock, PTHREAD_PROCESS_PRIVATE))
 		goto err;
@@ -404,12 +655,11 @@ static struct ibv_cq *create_cq(struct ibv_context *context,
 	cq_attr_e = *cq_attr;
 	cqe = align_queue_size(cq_attr->cqe + 1);
 
-	if (mlx4_alloc_cq_buf(to_mdev(context->device), &cq->buf, cqe,
-			      mctx->cqe_size))
+	if (mlx4_alloc_cq_buf(mctx, &cq->buf, cqe, mctx->cqe_size, numa_node))
 		goto err;
 
 	cq->cqe_size = mctx->cqe_size;
-	cq->set_ci_db  = mlx4_alloc_db(to_mctx(context), MLX4_DB_TYPE_CQ);
+	cq->set_ci_db  = mlx4_alloc_db(to_mctx(context), db_type);
 	if (!cq->set_ci_db)
 		goto err_buf;
 
@@ -455,10 +705,10 @@ static struct ibv_cq *create_cq(struct ibv_context *context,
 	return &cq->ibv_cq;
 
 err_db:
-	mlx4_free_db(to_mctx(context), MLX4_DB_TYPE_CQ, cq->set_ci_db);
+	mlx4_free_db(to_mctx(context), cq->set_ci_db);
 
 err_buf:
-	mlx4_free_buf(&cq->buf);
+	mlx4_free_queue_buf(mctx, &cq->buf);
 
 err:
 	free(cq);
@@ -474,13 +724,20 @@ struct ibv_cq *mlx4_create_cq(struct ibv_context *context, int cqe,
 					     .comp_vector = comp_vector,
 					     .wc_flags = IBV_WC_STANDARD_FLAGS};
 
-	return create_cq(context, &attr, MLX4_CMD_TYPE_BASIC);
+	return create_cq(context, &attr, MLX4_CMD_TYPE_BASIC, NULL);
 }
 
 struct ibv_cq *mlx4_create_cq_ex(struct ibv_context *context,
 				 struct ibv_cq_init_attr_ex *cq_attr)
 {
-	return create_cq(context, cq_attr, MLX4_CMD_TYPE_EXTENDED);
+	return create_cq(context, cq_attr, MLX4_CMD_TYPE_EXTENDED, NULL);
+}
+
+struct ibv_cq *mlx4dv_create_cq(struct ibv_context *context,
+				struct ibv_cq_init_attr_ex *cq_attr,
+				struct mlx4dv_cq_init_attr *mlx4_attr)
+{
+	return create_cq(context, cq_attr, MLX4_CMD_TYPE_EXTENDED, mlx4_attr);
 }
 
 int mlx4_resize_cq(struct ibv_cq *ibcq, int cqe)
@@ -510,7 +767,8 @@ int mlx4_resize_cq(struct ibv_cq *ibcq, int cqe)
 		goto out;
 	}
 
-	ret = mlx4_alloc_cq_buf(to_mdev(ibcq->context->device), &buf, cqe, cq->cqe_size);
+	ret = mlx4_alloc_cq_buf(to_mctx(ibcq->context), &buf, cqe,
+				cq->cqe_size, cq->numa_node);
 	if (ret)
 		goto out;
 
@@ -520,13 +778,13 @@ int mlx4_resize_cq(struct ibv_cq *ibcq, int cqe)
 	ret = ibv_cmd_resize_cq(ibcq, cqe - 1, &cmd.ibv_cmd, sizeof cmd,
 				&resp, sizeof resp);
 	if (ret) {
-		mlx4_free_buf(&buf);
+		mlx4_free_queue_buf(to_mctx(ibcq->context), &buf);
 		goto out;
 	}
 
 	mlx4_cq_resize_copy_cqes(cq, buf.buf, old_cqe);
 
-	mlx4_free_buf(&cq->buf);
+	mlx4_free_queue_buf(to_mctx(ibcq->context), &cq->buf);
 	cq->buf = buf;
 
 out:
@@ -542,26 +800,67 @@ int mlx4_destroy_cq(struct ibv_cq *cq)
 	if (ret)
 		return ret;
 
-	mlx4_free_db(to_mctx(cq->context), MLX4_DB_TYPE_CQ, to_mcq(cq)->set_ci_db);
-	mlx4_free_buf(&to_mcq(cq)->buf);
+	mlx4_free_db(to_mctx(cq->context), to_mcq(cq)->set_ci_db);
+	mlx4_free_queue_buf(to_mctx(cq->context), &to_mcq(cq)->buf);
 	free(to_mcq(cq));
 
 	return 0;
 }
 
-struct ibv_srq *mlx4_create_srq(struct ibv_pd *pd,
-				struct ibv_srq_init_attr *attr)
+enum {
+	CREATE_SRQ_SUPPORTED_DV_COMP_MASK = MLX4DV_SRQ_INIT_ATTR_MASK_CREATE_FLAGS |
+					    MLX4DV_SRQ_INIT_ATTR_MASK_NUMA_NODE
+};
+
+enum {
+	CREATE_SRQ_SUPPORTED_DV_FLAGS = MLX4DV_SRQ_CREATE_SINGLE_PRODUCER |
+					MLX4DV_SRQ_CREATE_HUGE_BUF |
+					MLX4DV_SRQ_CREATE_POPULATE_BUF |
+					MLX4DV_SRQ_CREATE_ISOLATED_DB
+};
+
+static struct ibv_srq *create_srq(struct ibv_pd *pd,
+				  struct ibv_srq_init_attr *attr,
+				  struct mlx4dv_srq_init_attr *mlx4_attr)
 {
 	struct mlx4_create_srq      cmd;
 	struct mlx4_create_srq_resp resp;
 	struct mlx4_srq		   *srq;
+	uint32_t		    create_flags = 0;
+	int			    numa_node;
 	int			    ret;
 
 	/* Sanity check SRQ size before proceeding */
 	if (attr->attr.max_wr > 1 << 16 || attr->attr.max_sge > 64)
 		return NULL;
 
-	srq = malloc(sizeof *srq);
+	numa_node = to_mdev(pd->context->device)->numa_node;
+	if (mlx4_attr) {
+		if (mlx4_attr->comp_mask & ~CREATE_SRQ_SUPPORTED_DV_COMP_MASK) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		if (mlx4_attr->comp_mask & MLX4DV_SRQ_INIT_ATTR_MASK_CREATE_FLAGS)
+			create_flags = mlx4_attr->create_flags;
+
+		if (create_flags & ~CREATE_SRQ_SUPPORTED_DV_FLAGS) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		/* 0xffff marks pending free list links, see srq.c */
+		if (create_flags & MLX4DV_SRQ_CREATE_SINGLE_PRODUCER &&
+		    attr->attr.max_wr >= 1 << 15) {
+			errno = EINVAL;
+			return NULL;
+		}
+
+		if (mlx4_attr->comp_mask & MLX4DV_SRQ_INIT_ATTR_MASK_NUMA_NODE)
+			numa_node = mlx4_attr->numa_node;
+	}
+
+	srq = mlx4_calloc_aligned(sizeof *srq);
 	if (!srq)
 		return NULL;
 
@@ -572,11 +871,19 @@ struct ibv_srq *mlx4_create_srq(struct ibv_pd *pd,
 	srq->max_gs  = attr->attr.max_sge;
 	srq->counter = 0;
 	srq->ext_srq = 0;
+	srq->create_flags = create_flags;
+	srq->numa_node = numa_node;
+	srq->completed = 0;
+	srq->replenish = NULL;
+	srq->recv_ring = NULL;
 
 	if (mlx4_alloc_srq_buf(pd, &attr->attr, srq))
 		goto err;
 
-	srq->db = mlx4_alloc_db(to_mctx(pd->context), MLX4_DB_TYPE_RQ);
+	srq->db = mlx4_alloc_db(to_mctx(pd->context),
+				mlx4_rq_db_type(to_mctx(pd->context),
+						create_flags &
+						MLX4DV_SRQ_CREATE_ISOLATED_DB));
 	if (!srq->db)
 		goto err_free;
 
@@ -594,11 +901,10 @@ struct ibv_srq *mlx4_create_srq(struct ibv_pd *pd,
 	return &srq->verbs_srq.srq;
 
 err_db:
-	mlx4_free_db(to_mctx(pd->context), MLX4_DB_TYPE_RQ, srq->db);
+	mlx4_free_db(to_mctx(pd->context), srq->db);
 
 err_free:
-	free(srq->wrid);
-	mlx4_free_buf(&srq->buf);
+	mlx4_free_queue_buf(to_mctx(pd->context), &srq->buf);
 
 err:
 	free(srq);
@@ -606,6 +912,19 @@ err:
 	return NULL;
 }
 
+struct ibv_srq *mlx4_create_srq(struct ibv_pd *pd,
+				struct ibv_srq_init_attr *attr)
+{
+	return create_srq(pd, attr, NULL);
+}
+
+struct ibv_srq *mlx4dv_create_srq(struct ibv_pd *pd,
+				  struct ibv_srq_init_attr *attr,
+				  struct mlx4dv_srq_init_attr *mlx4_attr)
+{
+	return create_srq(pd, attr, mlx4_attr);
+}
+
 struct ibv_srq *mlx4_create_srq_ex(struct ibv_context *context,
 				   struct ibv_srq_init_attr_ex *attr_ex)
 {
@@ -646,34 +965,85 @@ int mlx4_destroy_srq(struct ibv_srq *srq)
 	if (ret)
 		return ret;
 
-	mlx4_free_db(to_mctx(srq->context), MLX4_DB_TYPE_RQ, to_msrq(srq)->db);
-	mlx4_free_buf(&to_msrq(srq)->buf);
-	free(to_msrq(srq)->wrid);
+	mlx4_srq_stop_replenish(to_msrq(srq));
+	free(to_msrq(srq)->recv_ring);
+
+	mlx4_free_db(to_mctx(srq->context), to_msrq(srq)->db);
+	mlx4_free_queue_buf(to_mctx(srq->context), &to_msrq(srq)->buf);
 	free(to_msrq(srq));
 
 	return 0;
 }
 
-struct ibv_qp *mlx4_create_qp_ex(struct ibv_context *context,
-				 struct ibv_qp_init_attr_ex *attr)
+enum {
+	CREATE_QP_SUPPORTED_DV_COMP_MASK = MLX4DV_QP_INIT_ATTR_MASK_CREATE_FLAGS |
+					   MLX4DV_QP_INIT_ATTR_MASK_SIGNAL_PERIOD |
+					   MLX4DV_QP_INIT_ATTR_MASK_NUMA_NODE
+};
+
+enum {
+	CREATE_QP_SUPPORTED_DV_FLAGS = MLX4DV_QP_CREATE_MASKED_ATOMIC |
+				       MLX4DV_QP_CREATE_AUTO_SIGNAL |
+				       MLX4DV_QP_CREATE_HUGE_BUF |
+				       MLX4DV_QP_CREATE_POPULATE_BUF |
+				       MLX4DV_QP_CREATE_ISOLATED_DB |
+				       MLX4DV_QP_CREATE_NO_WRID
+};
+
+static int check_qp_caps(struct ibv_qp_init_attr_ex *attr)
 {
-	struct mlx4_create_qp     cmd;
-	struct ibv_create_qp_resp resp;
-	struct mlx4_qp		 *qp;
-	int			  ret;
+	return attr->cap.max_send_wr     > 65536 ||
+	       attr->cap.max_recv_wr     > 65536 ||
+	       attr->cap.max_send_sge    > 64    ||
+	       attr->cap.max_recv_sge    > 64    ||
+	       attr->cap.max_inline_data > 1024;
+}
 
-	/* Sanity check QP size before proceeding */
-	if (attr->cap.max_send_wr     > 65536 ||
-	    attr->cap.max_recv_wr     > 65536 ||
-	    attr->cap.max_send_sge    > 64    ||
-	    attr->cap.max_recv_sge    > 64    ||
-	    attr->cap.max_inline_data > 1024)
-		return NULL;
+static int check_qp_dv_attr(struct ibv_context *context,
+			    struct ibv_qp_init_attr_ex *attr,
+			    struct mlx4dv_qp_init_attr *mlx4_attr,
+			    uint32_t *create_flags, uint32_t *signal_period,
+			    int *numa_node)
+{
+	*create_flags  = 0;
+	*signal_period = 0;
+	*numa_node     = to_mdev(context->device)->numa_node;
 
-	qp = calloc(1, sizeof *qp);
-	if (!qp)
-		return NULL;
+	if (!mlx4_attr)
+		return 0;
 
+	if (mlx4_attr->comp_mask & ~CREATE_QP_SUPPORTED_DV_COMP_MASK)
+		return EINVAL;
+
+	if (mlx4_attr->comp_mask & MLX4DV_QP_INIT_ATTR_MASK_CREATE_FLAGS)
+		*create_flags = mlx4_attr->create_flags;
+
+	if (*create_flags & ~CREATE_QP_SUPPORTED_DV_FLAGS)
+		return EINVAL;
+
+	if (*create_flags & MLX4DV_QP_CREATE_MASKED_ATOMIC &&
+	    attr->qp_type != IBV_QPT_RC)
+		return EINVAL;
+
+	if (mlx4_attr->comp_mask & MLX4DV_QP_INIT_ATTR_MASK_SIGNAL_PERIOD) {
+		*signal_period = mlx4_attr->signal_period;
+		if (!*signal_period ||
+		    !(*create_flags & MLX4DV_QP_CREATE_AUTO_SIGNAL))
+			return EINVAL;
+	}
+
+	if (*create_flags & MLX4DV_QP_CREATE_AUTO_SIGNAL &&
+	    attr->qp_type == IBV_QPT_XRC_RECV)
+		return EINVAL;
+
+	if (mlx4_attr->comp_mask & MLX4DV_QP_INIT_ATTR_MASK_NUMA_NODE)
+		*numa_node = mlx4_attr->numa_node;
+
+	return 0;
+}
+
+static void init_qp_sizes(struct ibv_qp_init_attr_ex *attr, struct mlx4_qp *qp)
+{
 	if (attr->qp_type == IBV_QPT_XRC_RECV) {
 		attr->cap.max_send_wr = qp->sq.wqe_cnt = 0;
 	} else {
@@ -696,37 +1066,113 @@ struct ibv_qp *mlx4_create_qp_ex(struct ibv_context *context,
 		if (attr->cap.max_recv_wr < 1)
 			attr->cap.max_recv_wr = 1;
 	}
+}
+
+static int init_qp_locks(struct mlx4_qp *qp)
+{
+	return pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE) ||
+	       pthread_spin_init(&qp->rq.lock, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void init_qp_cmd(struct mlx4_qp *qp, struct mlx4_create_qp *cmd)
+{
+	cmd->db_addr	     = (uintptr_t) qp->db;
+	cmd->buf_addr	     = (uintptr_t) qp->buf.buf;
+	cmd->log_sq_stride   = qp->sq.wqe_shift;
+	for (cmd->log_sq_bb_count = 0;
+	     qp->sq.wqe_cnt > 1 << cmd->log_sq_bb_count;
+	     ++cmd->log_sq_bb_count)
+		; /* nothing */
+	cmd->sq_no_prefetch = 0;	/* OK for ABI 2: just a reserved field */
+	memset(cmd->reserved, 0, sizeof cmd->reserved);
+}
+
+/*
+ * Set up what depends on the capabilities the kernel returned.
+ */
+static void finish_qp(struct mlx4_qp *qp, struct ibv_qp_init_attr_ex *attr,
+		      uint32_t signal_period)
+{
+	qp->rq.wqe_cnt = qp->rq.max_post = attr->cap.max_recv_wr;
+	qp->rq.max_gs  = attr->cap.max_recv_sge;
+	if (attr->qp_type != IBV_QPT_XRC_RECV)
+		mlx4_set_sq_sizes(qp, &attr->cap, attr->qp_type);
+
+	if (qp->create_flags & MLX4DV_QP_CREATE_AUTO_SIGNAL) {
+		/*
+		 * Keep at least two signaled WQEs in flight on a full
+		 * SQ, so that it is always reclaimed before it fills.
+		 */
+		if (!signal_period)
+			signal_period = qp->sq.max_post / 4;
+		if (signal_period > qp->sq.max_post / 2)
+			signal_period = qp->sq.max_post / 2;
+		if (!signal_period)
+			signal_period = 1;
+
+		qp->sq_signal_period = signal_period;
+		qp->sq_next_signal   = signal_period - 1;
+	}
+
+	qp->doorbell_qpn    = htonl(qp->verbs_qp.qp.qp_num << 8);
+	if (attr->sq_sig_all)
+		qp->sq_signal_bits = htonl(MLX4_WQE_CTRL_CQ_UPDATE);
+	else
+		qp->sq_signal_bits = 0;
+}
+
+static struct ibv_qp *create_qp_ex(struct ibv_context *context,
+				   struct ibv_qp_init_attr_ex *attr,
+				   struct mlx4dv_qp_init_attr *mlx4_attr)
+{
+	struct mlx4_create_qp     cmd;
+	struct ibv_create_qp_resp resp;
+	struct mlx4_qp		 *qp;
+	uint32_t		  create_flags;
+	uint32_t		  signal_period;
+	int			  numa_node;
+	int			  ret;
+
+	/* Sanity check QP size before proceeding */
+	if (check_qp_caps(attr))
+		return NULL;
+
+	ret = check_qp_dv_attr(context, attr, mlx4_attr, &create_flags,
+			       &signal_period, &numa_node);
+	if (ret) {
+		errno = ret;
+		return NULL;
+	}
+
+	qp = mlx4_calloc_aligned(sizeof *qp);
+	if (!qp)
+		return NULL;
+
+	qp->create_flags = create_flags;
+	qp->numa_node	 = numa_node;
+
+	init_qp_sizes(attr, qp);
 
 	if (mlx4_alloc_qp_buf(context, &attr->cap, attr->qp_type, qp))
 		goto err;
 
 	mlx4_init_qp_indices(qp);
 
-	if (pthread_spin_init(&qp->sq.lock, PTHREAD_PROCESS_PRIVATE) ||
-	    pthread_spin_init(&qp->rq.lock, PTHREAD_PROCESS_PRIVATE))
+	if (init_qp_locks(qp))
 		goto err_free;
 
 	if (attr->cap.max_recv_sge) {
-		qp->db = mlx4_alloc_db(to_mctx(context), MLX4_DB_TYPE_RQ);
+		qp->db = mlx4_alloc_db(to_mctx(context),
+				       mlx4_rq_db_type(to_mctx(context),
+						       create_flags &
+						       MLX4DV_QP_CREATE_ISOLATED_DB));
 		if (!qp->db)
 			goto err_free;
 
 		*qp->db = 0;
-		cmd.db_addr = (uintptr_t) qp->db;
-	} else {
-		cmd.db_addr = 0;
 	}
 
-	cmd.buf_addr	    = (uintptr_t) qp->buf.buf;
-	cmd.log_sq_stride   = qp->sq.wqe_shift;
-	for (cmd.log_sq_bb_count = 0;
-	     qp->sq.wqe_cnt > 1 << cmd.log_sq_bb_count;
-	     ++cmd.log_sq_bb_count)
-		; /* nothing */
-	cmd.sq_no_prefetch = 0;	/* OK for ABI 2: just a reserved field */
-	memset(cmd.reserved, 0, sizeof cmd.reserved);
-
-	pthread_mutex_lock(&to_mctx(context)->qp_table_mutex);
+	init_qp_cmd(qp, &cmd);
 
 	ret = ibv_cmd_create_qp_ex(context, &qp->verbs_qp,
 				   sizeof(qp->verbs_qp), attr,
@@ -735,22 +1181,14 @@ struct ibv_qp *mlx4_create_qp_ex(struct ibv_context *context,
 		goto err_rq_db;
 
 	if (qp->sq.wqe_cnt || qp->rq.wqe_cnt) {
+		pthread_mutex_lock(&to_mctx(context)->qp_table_mutex);
 		ret = mlx4_store_qp(to_mctx(context), qp->verbs_qp.qp.qp_num, qp);
+		pthread_mutex_unlock(&to_mctx(context)->qp_table_mutex);
 		if (ret)
 			goto err_destroy;
 	}
-	pthread_mutex_unlock(&to_mctx(context)->qp_table_mutex);
-
-	qp->rq.wqe_cnt = qp->rq.max_post = attr->cap.max_recv_wr;
-	qp->rq.max_gs  = attr->cap.max_recv_sge;
-	if (attr->qp_type != IBV_QPT_XRC_RECV)
-		mlx4_set_sq_sizes(qp, &attr->cap, attr->qp_type);
 
-	qp->doorbell_qpn    = htonl(qp->verbs_qp.qp.qp_num << 8);
-	if (attr->sq_sig_all)
-		qp->sq_signal_bits = htonl(MLX4_WQE_CTRL_CQ_UPDATE);
-	else
-		qp->sq_signal_bits = 0;
+	finish_qp(qp, attr, signal_period);
 
 	return &qp->verbs_qp.qp;
 
@@ -758,15 +1196,11 @@ err_destroy:
 	ibv_cmd_destroy_qp(&qp->verbs_qp.qp);
 
 err_rq_db:
-	pthread_mutex_unlock(&to_mctx(context)->qp_table_mutex);
 	if (attr->cap.max_recv_sge)
-		mlx4_free_db(to_mctx(context), MLX4_DB_TYPE_RQ, qp->db);
+		mlx4_free_db(to_mctx(context), qp->db);
 
 err_free:
-	free(qp->sq.wrid);
-	if (qp->rq.wqe_cnt)
-		free(qp->rq.wrid);
-	mlx4_free_buf(&qp->buf);
+	mlx4_free_queue_buf(to_mctx(context), &qp->buf);
 
 err:
 	free(qp);
@@ -774,6 +1208,164 @@ err:
 	return NULL;
 }
 
+/*
+ * Create QPs in bulk.  Their structs share one allocation, their
+ * buffers one mapping and their doorbell records one pass through the
+ * allocator; the kernel commands are issued back to back and the QPs
+ * enter the QP table in a single critical section.
+ */
+int mlx4dv_create_qp_bulk(struct ibv_context *context, int num,
+			  struct ibv_qp_init_attr_ex *attrs,
+			  struct mlx4dv_qp_init_attr *mlx4_attr,
+			  struct ibv_qp **qps)
+{
+	struct mlx4_context	 *ctx = to_mctx(context);
+	struct mlx4_create_qp     cmd;
+	struct ibv_create_qp_resp resp;
+	struct mlx4_qp_slab	 *slab;
+	struct mlx4_qp		 *qp;
+	uint32_t		**dbs = NULL;
+	uint32_t		  create_flags;
+	uint32_t		  signal_period;
+	int			  numa_node;
+	int			  num_db = 0;
+	int			  ret;
+	int			  i, j;
+
+	if (num <= 0)
+		return EINVAL;
+
+	for (i = 0; i < num; ++i) {
+		if (check_qp_caps(&attrs[i]))
+			return EINVAL;
+
+		ret = check_qp_dv_attr(context, &attrs[i], mlx4_attr,
+				       &create_flags, &signal_period,
+				       &numa_node);
+		if (ret)
+			return ret;
+	}
+
+	slab = mlx4_calloc_aligned(align(sizeof *slab, MLX4_CACHELINE_SIZE) +
+				   num * sizeof *qp);
+	if (!slab)
+		return ENOMEM;
+
+	slab->refcnt = num;
+	qp = (void *) slab + align(sizeof *slab, MLX4_CACHELINE_SIZE);
+
+	for (i = 0; i < num; ++i) {
+		qp[i].create_flags = create_flags;
+		qp[i].numa_node	   = numa_node;
+		qp[i].slab	   = slab;
+
+		init_qp_sizes(&attrs[i], &qp[i]);
+		if (attrs[i].cap.max_recv_sge)
+			++num_db;
+	}
+
+	if (mlx4_alloc_qp_bufs(context, attrs, qp, num)) {
+		ret = ENOMEM;
+		goto err;
+	}
+
+	for (i = 0; i < num; ++i) {
+		mlx4_init_qp_indices(&qp[i]);
+		if (init_qp_locks(&qp[i])) {
+			ret = ENOMEM;
+			goto err_free;
+		}
+	}
+
+	if (num_db) {
+		dbs = malloc(num_db * sizeof *dbs);
+		if (!dbs ||
+		    mlx4_alloc_dbs(ctx, mlx4_rq_db_type(ctx, create_flags &
+						       MLX4DV_QP_CREATE_ISOLATED_DB),
+				   dbs, num_db)) {
+			ret = ENOMEM;
+			goto err_free;
+		}
+
+		for (i = 0, j = 0; i < num; ++i)
+			if (attrs[i].cap.max_recv_sge) {
+				qp[i].db  = dbs[j++];
+				*qp[i].db = 0;
+			}
+	}
+
+	for (i = 0; i < num; ++i) {
+		init_qp_cmd(&qp[i], &cmd);
+
+		ret = ibv_cmd_create_qp_ex(context, &qp[i].verbs_qp,
+					   sizeof(qp[i].verbs_qp), &attrs[i],
+					   &cmd.ibv_cmd, sizeof cmd,
+					   &resp, sizeof resp);
+		if (ret)
+			goto err_destroy;
+	}
+
+	pthread_mutex_lock(&ctx->qp_table_mutex);
+
+	for (i = 0; i < num; ++i) {
+		if (!qp[i].sq.wqe_cnt && !qp[i].rq.wqe_cnt)
+			continue;
+
+		if (mlx4_store_qp(ctx, qp[i].verbs_qp.qp.qp_num, &qp[i])) {
+			while (i--)
+				if (qp[i].sq.wqe_cnt || qp[i].rq.wqe_cnt)
+					mlx4_clear_qp(ctx, qp[i].verbs_qp.qp.qp_num);
+
+			pthread_mutex_unlock(&ctx->qp_table_mutex);
+			ret = ENOMEM;
+			i = num;
+			goto err_destroy;
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->qp_table_mutex);
+
+	for (i = 0; i < num; ++i) {
+		finish_qp(&qp[i], &attrs[i], signal_period);
+		qps[i] = &qp[i].verbs_qp.qp;
+	}
+
+	free(dbs);
+
+	return 0;
+
+err_destroy:
+	while (i--)
+		ibv_cmd_destroy_qp(&qp[i].verbs_qp.qp);
+
+	for (i = 0; i < num; ++i)
+		if (qp[i].db)
+			mlx4_free_db(ctx, qp[i].db);
+
+err_free:
+	for (i = 0; i < num; ++i)
+		mlx4_free_queue_buf(ctx, &qp[i].buf);
+
+err:
+	free(dbs);
+	free(slab);
+
+	return ret;
+}
+
+struct ibv_qp *mlx4_create_qp_ex(struct ibv_context *context,
+				 struct ibv_qp_init_attr_ex *attr)
+{
+	return create_qp_ex(context, attr, NULL);
+}
+
+struct ibv_qp *mlx4dv_create_qp(struct ibv_context *context,
+				struct ibv_qp_init_attr_ex *attr,
+				struct mlx4dv_qp_init_attr *mlx4_attr)
+{
+	return create_qp_ex(context, attr, mlx4_attr);
+}
+
 struct ibv_qp *mlx4_create_qp(struct ibv_pd *pd, struct ibv_qp_init_attr *attr)
 {
 	struct ibv_qp_init_attr_ex attr_ex;
@@ -795,7 +1387,7 @@ struct ibv_qp *mlx4_open_qp(struct ibv_context *context, struct ibv_qp_open_attr
 	struct mlx4_qp *qp;
 	int ret;
 
-	qp = calloc(1, sizeof *qp);
+	qp = mlx4_calloc_aligned(sizeof *qp);
 	if (!qp)
 		return NULL;
 
@@ -843,13 +1435,12 @@ int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 
 	memset(&device_attr, 0, sizeof(device_attr));
 	if (attr_mask & IBV_QP_PORT) {
-		ret = ibv_query_port(qp->context, attr->port_num,
-				     &port_attr);
+		ret = get_port_attr(qp->context, attr->port_num, &port_attr);
 		if (ret)
 			return ret;
 		mqp->link_layer = port_attr.link_layer;
 
-		ret = ibv_query_device(qp->context, &device_attr);
+		ret = get_device_attr(qp->context, &device_attr);
 		if (ret)
 			return ret;
 
@@ -880,6 +1471,14 @@ int mlx4_modify_qp(struct ibv_qp *qp, struct ibv_qp_attr *attr,
 
 	ret = ibv_cmd_modify_qp(qp, attr, attr_mask, &cmd, sizeof cmd);
 
+	/* Reset gave the posted rx pool buffers back, post them again */
+	if (!ret			  &&
+	    to_mqp(qp)->rx_pool		  &&
+	    qp->state == IBV_QPS_RESET	  &&
+	    (attr_mask & IBV_QP_STATE)	  &&
+	    attr->qp_state == IBV_QPS_INIT)
+		mlx4_rx_refill(to_mqp(qp));
+
 	if (!ret		       &&
 	    (attr_mask & IBV_QP_STATE) &&
 	    attr->qp_state == IBV_QPS_RESET) {
@@ -942,15 +1541,15 @@ static void mlx4_unlock_cqs(struct ibv_qp *qp)
 
 int mlx4_destroy_qp(struct ibv_qp *ibqp)
 {
+	struct mlx4_context *ctx = to_mctx(ibqp->context);
 	struct mlx4_qp *qp = to_mqp(ibqp);
+	struct mlx4_qp_slab *slab;
+	int free_slab;
 	int ret;
 
-	pthread_mutex_lock(&to_mctx(ibqp->context)->qp_table_mutex);
 	ret = ibv_cmd_destroy_qp(ibqp);
-	if (ret) {
-		pthread_mutex_unlock(&to_mctx(ibqp->context)->qp_table_mutex);
+	if (ret)
 		return ret;
-	}
 
 	mlx4_lock_cqs(ibqp);
 
@@ -960,20 +1559,45 @@ int mlx4_destroy_qp(struct ibv_qp *ibqp)
 	if (ibqp->send_cq && ibqp->send_cq != ibqp->recv_cq)
 		__mlx4_cq_clean(to_mcq(ibqp->send_cq), ibqp->qp_num, NULL);
 
+	mlx4_unlock_cqs(ibqp);
+
+	/*
+	 * The QPN may already belong to a new QP, whose creation waits
+	 * in mlx4_store_qp() until this one is out of the table.
+	 */
+	pthread_mutex_lock(&to_mctx(ibqp->context)->qp_table_mutex);
+
 	if (qp->sq.wqe_cnt || qp->rq.wqe_cnt)
 		mlx4_clear_qp(to_mctx(ibqp->context), ibqp->qp_num);
 
-	mlx4_unlock_cqs(ibqp);
 	pthread_mutex_unlock(&to_mctx(ibqp->context)->qp_table_mutex);
 
-	if (qp->rq.wqe_cnt) {
-		mlx4_free_db(to_mctx(ibqp->context), MLX4_DB_TYPE_RQ, qp->db);
-		free(qp->rq.wrid);
+	if (qp->rq.wqe_cnt)
+		mlx4_free_db(to_mctx(ibqp->context), qp->db);
+	free(qp->recv_ring);
+	if (qp->rx_pool) {
+		free(qp->rx_pool->free_bufs);
+		free(qp->rx_pool);
 	}
-	if (qp->sq.wqe_cnt)
-		free(qp->sq.wrid);
-	mlx4_free_buf(&qp->buf);
-	free(qp);
+	mlx4_free_queue_buf(to_mctx(ibqp->context), &qp->buf);
+
+	if (!qp->slab) {
+		free(qp);
+		return 0;
+	}
+
+	/*
+	 * qp lives in the slab of its mlx4dv_create_qp_bulk() call, so
+	 * once our reference is dropped another thread destroying the
+	 * last of its QPs may free it: touch nothing of qp after that.
+	 */
+	slab = qp->slab;
+	pthread_mutex_lock(&ctx->qp_table_mutex);
+	free_slab = !--slab->refcnt;
+	pthread_mutex_unlock(&ctx->qp_table_mutex);
+
+	if (free_slab)
+		free(slab);
 
 	return 0;
 }
@@ -1019,8 +1643,8 @@ static int mlx4_resolve_grh_to_l2(struct ibv_pd *pd, struct mlx4_ah *ah,
 		for (i = 2; i < 6; ++i)
 			ah->mac[i] = attr->grh.dgid.raw[i + 10];
 
-		err = ibv_query_gid(pd->context, attr->port_num,
-				    attr->grh.sgid_index, &sgid);
+		err = get_gid(pd->context, attr->port_num,
+			      attr->grh.sgid_index, &sgid);
 		if (err)
 			return err;
 
@@ -1044,7 +1668,7 @@ struct ibv_ah *mlx4_create_ah(struct ibv_pd *pd, struct ibv_ah_attr *attr)
 	struct mlx4_ah *ah;
 	struct ibv_port_attr port_attr;
 
-	if (query_port_cache(pd->context, attr->port_num, &port_attr))
+	if (get_port_attr(pd->context, attr->port_num, &port_attr))
 		return NULL;
 
 	ah = malloc(sizeof *ah);
@@ -43,6 +43,7 @@ enum {
 	MLX4_WQE_CTRL_SOLICIT		= 1 << 1,
 	MLX4_WQE_CTRL_IP_HDR_CSUM	= 1 << 4,
 	MLX4_WQE_CTRL_TCP_UDP_CSUM	= 1 << 5,
+	MLX4_WQE_CTRL_INS_VLAN		= 1 << 6,
 };
 
 enum {
@@ -56,8 +57,19 @@ enum {
 
 struct mlx4_wqe_ctrl_seg {
 	uint32_t		owner_opcode;
-	uint8_t			reserved[3];
-	uint8_t			fence_size;
+	union {
+		struct {
+			/* VLAN to insert on raw Ethernet QPs */
+			uint16_t	vlan_tag;
+			uint8_t		ins_vlan;
+			uint8_t		fence_size;
+		};
+		/*
+		 * WQEs written to the BlueFlame page carry the QPN in
+		 * place of the VLAN.
+		 */
+		uint32_t	bf_qpn;
+	};
 	/*
 	 * High 24 bits are SRC remote buffer; low 8 bits are flags:
 	 * [7]   SO (strong ordering)
@@ -111,6 +123,13 @@ struct mlx4_wqe_atomic_seg {
 	uint64_t		compare;
 };
 
+struct mlx4_wqe_masked_atomic_seg {
+	uint64_t		swap_add;
+	uint64_t		compare;
+	uint64_t		swap_add_mask;
+	uint64_t		compare_mask;
+};
+
 struct mlx4_wqe_bind_seg {
 	uint32_t		flags1;
 	uint32_t		flags2;